@@ -0,0 +1,54 @@
+#include <stddef.h>
+#include <stdlib.h>
+
+#include "arena.h"
+#include "types.h"
+
+#define ARENA_ALIGNMENT                     16
+#define ARENA_BLOCK_SIZE                    (1 << 20)
+
+struct arena_block {
+    struct arena_block *next;
+    // payload is stored after the header, which is a multiple of the alignment
+};
+#define BLOCK_HEADER_SIZE \
+    ((sizeof(struct arena_block) + ARENA_ALIGNMENT - 1) & ~(ARENA_ALIGNMENT - 1))
+
+void *
+arena_alloc(struct arena *arena, size_t size)
+{
+    // return zeroed memory, aligned for any usual type
+    size_t block_size;
+    struct arena_block *block;
+
+    size = (size + ARENA_ALIGNMENT - 1) & ~(size_t) (ARENA_ALIGNMENT - 1);
+    if (!arena->blocks || arena->used + size > arena->size) {
+        // oversized allocations get a dedicated block, inserted after the
+        // current one so that its remaining space is still usable
+        block_size = MAX(size, ARENA_BLOCK_SIZE);
+        block = calloc(1, BLOCK_HEADER_SIZE + block_size);
+        if (arena->blocks && block_size > ARENA_BLOCK_SIZE) {
+            block->next = arena->blocks->next;
+            arena->blocks->next = block;
+            return (char *) block + BLOCK_HEADER_SIZE;
+        }
+        block->next = arena->blocks;
+        arena->blocks = block;
+        arena->used = 0;
+        arena->size = block_size;
+    }
+    arena->used += size;
+    return (char *) arena->blocks + BLOCK_HEADER_SIZE + arena->used - size;
+}
+
+void
+arena_free_all(struct arena *arena)
+{
+    struct arena_block *block, *next;
+
+    for (block = arena->blocks; block; block = next) {
+        next = block->next;
+        free(block);
+    }
+    *arena = (struct arena) {0};
+}
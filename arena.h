@@ -0,0 +1,16 @@
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <stddef.h>
+
+struct arena_block;
+struct arena {
+    // allocations can not be freed individually, only all at once
+    struct arena_block *blocks;
+    size_t used, size; // of the first block
+};
+
+void *arena_alloc(struct arena *arena, size_t size);
+void arena_free_all(struct arena *arena);
+
+#endif // ARENA_H
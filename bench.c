@@ -0,0 +1,294 @@
+// scenarios of the bench subcommand run on the calling thread, without
+// spawning the interface threads (the scrolling one is run by the
+// controller), each reporting its costs on the standard output
+
+#include <inttypes.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "bench.h"
+#include "csv.h"
+#include "evaluation.h"
+#include "file_format.h"
+#include "kernels.h"
+#include "loader.h"
+#include "storage.h"
+#include "string_pool.h"
+#include "types.h"
+
+#define BENCH_BATCH                         (1 << 16) // cells set at once
+#define BENCH_LABELS                        16 // distinct generated strings
+#define BENCH_REPEATS                       5 // runs, the fastest reported
+
+static double elapsed_since(const struct timespec *start);
+static int generate_csv(const char *path, char delimiter, off_t size);
+static int generate_grid(const char *path, off_t size);
+
+int
+bench_aggregate(int nb_rows)
+{
+    // aggregate a column of nb_rows numbers (every hundredth cell being
+    // empty) cell by cell, as range functions were evaluated before the
+    // typed arrays, then with the aggregate kernels
+    double kernels_time, per_cell_time, t;
+    struct address address = {0};
+    struct aggregate kernels, per_cell;
+    struct area range = {.row_span = nb_rows, .col_span = 1};
+    struct timespec start;
+    struct value *values, value;
+
+    values = malloc(BENCH_BATCH*sizeof(*values));
+    for (int row = 0; row < nb_rows; row += BENCH_BATCH) {
+        for (int i = 0; i < BENCH_BATCH; i++) {
+            values[i] = (row + i)%100 == 99 ? (struct value) {0} :
+                (struct value) {
+                    .type = VALUE_NUMBER,
+                    .as.number = (row + i)%1000*0.25,
+                };
+        }
+        address.row = row;
+        storage_set_values(address, values, MIN(BENCH_BATCH, nb_rows - row),
+            0);
+    }
+    free(values);
+
+    kernels_time = per_cell_time = 0;
+    for (int k = 0; k < BENCH_REPEATS; k++) {
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        aggregate_init(&per_cell);
+        for (address.row = 0; address.row < nb_rows; address.row++) {
+            value = storage_get_value(address);
+            if (value.type == VALUE_NUMBER) {
+                per_cell.count++;
+                per_cell.sum += value.as.number;
+                per_cell.min = MIN(per_cell.min, value.as.number);
+                per_cell.max = MAX(per_cell.max, value.as.number);
+            }
+        }
+        t = elapsed_since(&start);
+        per_cell_time = k ? MIN(per_cell_time, t) : t;
+
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        aggregate_init(&kernels);
+        storage_aggregate(range, &kernels);
+        t = elapsed_since(&start);
+        kernels_time = k ? MIN(kernels_time, t) : t;
+    }
+    storage_clear();
+
+    printf("%d rows, %ld numbers: %.3f ms per cell, %.3f ms with kernels "
+        "(%.1fx)\n", nb_rows, kernels.count, per_cell_time*1e3,
+        kernels_time*1e3, per_cell_time/MAX(kernels_time, 1e-9));
+    if (kernels.count != per_cell.count || kernels.min != per_cell.min ||
+        kernels.max != per_cell.max ||
+        kernels.sum - per_cell.sum > 1e-9*per_cell.sum ||
+        per_cell.sum - kernels.sum > 1e-9*per_cell.sum) {
+        fprintf(stderr, "grid-client: aggregates differ\n");
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
+
+int
+bench_csv(const char *path, int size)
+{
+    // import path, generated with size MiB of records if missing, then
+    // export it again to /dev/null
+    char delimiter;
+    double export_time, import_time;
+    int res;
+    struct address origin = {0};
+    struct area area;
+    struct snapshot *snapshot;
+    struct stat st;
+    struct timespec start;
+
+    delimiter = csv_delimiter(path);
+    if (stat(path, &st) && (generate_csv(path, delimiter,
+        (off_t) size << 20) || stat(path, &st))) {
+        fprintf(stderr, "grid-client: can not write %s\n", path);
+        return EXIT_FAILURE;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    if (csv_import(path, origin, delimiter, &area)) {
+        fprintf(stderr, "grid-client: can not read %s\n", path);
+        storage_clear();
+        return EXIT_FAILURE;
+    }
+    import_time = elapsed_since(&start);
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    snapshot = storage_snapshot();
+    res = csv_export(snapshot, area, delimiter, "/dev/null");
+    storage_release_snapshot(snapshot);
+    export_time = elapsed_since(&start);
+    storage_clear();
+    if (res) {
+        fprintf(stderr, "grid-client: can not write /dev/null\n");
+        return EXIT_FAILURE;
+    }
+
+    printf("%lld bytes, %lld records of %d fields: %.3f s to import "
+        "(%.1f MiB/s), %.3f s to export (%.1f MiB/s)\n",
+        (long long) st.st_size, (long long) area.row_span, area.col_span,
+        import_time, st.st_size/MAX(import_time, 1e-9)/(1 << 20),
+        export_time, st.st_size/MAX(export_time, 1e-9)/(1 << 20));
+    return EXIT_SUCCESS;
+}
+
+int
+bench_load(const char *path, int size)
+{
+    // load path, generated with size MiB of definitions if missing, then
+    // compute its formulas, as on startup without an up to date sidecar
+    double evaluation_time, load_time;
+    int nb_evaluated, nb_invalid;
+    struct stat st;
+    struct timespec start;
+
+    if (stat(path, &st) && (generate_grid(path, (off_t) size << 20) ||
+        stat(path, &st))) {
+        fprintf(stderr, "grid-client: can not write %s\n", path);
+        return EXIT_FAILURE;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    if ((nb_invalid = load_file(path, NULL)) < 0) {
+        fprintf(stderr, "grid-client: can not read %s\n", path);
+        return EXIT_FAILURE;
+    }
+    load_time = elapsed_since(&start);
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (nb_evaluated = 0; evaluate_next_dirty_cell(); nb_evaluated++) {
+        continue;
+    }
+    evaluation_time = elapsed_since(&start);
+    storage_clear();
+
+    printf("%lld bytes (%d invalid lines): %.3f s to load (%.1f MiB/s), "
+        "%.3f s to compute %d formulas\n", (long long) st.st_size,
+        nb_invalid, load_time, st.st_size/MAX(load_time, 1e-9)/(1 << 20),
+        evaluation_time, nb_evaluated);
+    return EXIT_SUCCESS;
+}
+
+static double
+elapsed_since(const struct timespec *start)
+{
+    // in s
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec - start->tv_sec + (now.tv_nsec - start->tv_nsec)/1e9;
+}
+
+static int
+generate_csv(const char *path, char delimiter, off_t size)
+{
+    // records of an integer, a number, a label and a quoted field holding
+    // the delimiter, until size bytes are written, return a non-null result
+    // on failure
+    int res;
+    off_t len;
+    FILE *fp;
+
+    if (!(fp = fopen(path, "w"))) {
+        return -1;
+    }
+    len = 0;
+    for (int64_t row = 0; len < size; row++) {
+        len += fprintf(fp, "%" PRId64 "%c%g%clabel %d%c"
+            "\"note%c \"\"%d\"\"\"\n", row, delimiter, row%1000*0.25,
+            delimiter, (int) (row%BENCH_LABELS), delimiter, delimiter,
+            (int) (row%7));
+    }
+
+    res = fflush(fp) || ferror(fp);
+    res = fclose(fp) || res;
+    if (res) {
+        unlink(path);
+    }
+    return res;
+}
+
+static int
+generate_grid(const char *path, off_t size)
+{
+    // numbers in columns A and B, labels in C, constant areas in D and sums
+    // of column B in E, row after row until size bytes are written, return
+    // a non-null result on failure
+    char buf[16];
+    int res;
+    off_t len;
+    struct definition definition;
+    struct value labels[BENCH_LABELS];
+    FILE *fp;
+
+    if (!(fp = fopen(path, "w"))) {
+        return -1;
+    }
+    for (int i = 0; i < BENCH_LABELS; i++) {
+        sprintf(buf, "label %d", i);
+        labels[i] = (struct value) {
+            .type = VALUE_STRING,
+            .as.string = string_intern(buf, strlen(buf)),
+        };
+    }
+    len = 0;
+    for (int64_t row = 0; len < size; row++) {
+        definition = (struct definition) {
+            .area = {.row = row, .row_span = 1, .col_span = 1},
+            .value = {.type = VALUE_NUMBER, .as.number = row},
+        };
+        len += write_definition(fp, &definition);
+        definition.area.col = 1;
+        definition.value.as.number = row%1000*0.25;
+        len += write_definition(fp, &definition);
+        definition.area.col = 2;
+        definition.value = labels[row%BENCH_LABELS];
+        len += write_definition(fp, &definition);
+        if (row%100 == 0) {
+            definition.area.col = 3;
+            definition.area.row_span = 100;
+            definition.value = (struct value) {
+                .type = VALUE_NUMBER,
+                .as.number = 1,
+            };
+            len += write_definition(fp, &definition);
+        }
+        if (row%1000 == 999) {
+            definition.area = (struct area) {
+                .row = row,
+                .col = 4,
+                .row_span = 1,
+                .col_span = 1,
+            };
+            definition.formula = (struct formula) {
+                .function = FUNCTION_SUM,
+                .range = {
+                    .row = row - 999,
+                    .col = 1,
+                    .row_span = 1000,
+                    .col_span = 1,
+                },
+            };
+            len += write_definition(fp, &definition);
+        }
+    }
+    for (int i = 0; i < BENCH_LABELS; i++) {
+        value_unref(labels[i]);
+    }
+
+    res = fflush(fp) || ferror(fp);
+    res = fclose(fp) || res;
+    if (res) {
+        unlink(path);
+    }
+    return res;
+}
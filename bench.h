@@ -0,0 +1,8 @@
+#ifndef BENCH_H
+#define BENCH_H
+
+int bench_aggregate(int nb_rows);
+int bench_csv(const char *path, int size);
+int bench_load(const char *path, int size);
+
+#endif // BENCH_H
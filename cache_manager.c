@@ -10,7 +10,9 @@
 #include "client.h"
 #include "config.h"
 #include "display.h"
+#include "hidden.h"
 #include "pthread_queue.h"
+#include "string_pool.h"
 #include "thread_management.h"
 #include "types.h"
 
@@ -47,20 +49,29 @@ get_view(struct view view, struct cell_display *cells, int *hits,
     // cells and and hits buffers must be of length get_view_length(view)
     // try to retrieve the cached display of view cells in cells, and the
     // content located at address in cell
+    // cells already hit are known, and not requested again (they are only
+    // refreshed from the cache)
 
     int index, nb_cells;
     struct view_request view_request;
 
     pthread_mutex_lock(&cache_mutex);
 
-    // init
+    // init, the hidden lines of view being held by last_requested_view and
+    // by the request, until processed
+    hold_hidden(view.hidden);
+    hold_hidden(view.hidden);
+    release_hidden(last_requested_view.hidden);
     last_requested_view = view;
     nb_cells = get_view_length(view);
     view_request = (struct view_request) {
         .view = view,
-        .hits = calloc(nb_cells, sizeof(int)),
+        .hits = malloc(MAX(nb_cells, 1)*sizeof(int)),
         .nb_hits = 0,
     };
+    for (int i = 0; i < nb_cells; i++) {
+        view_request.nb_hits += view_request.hits[i] = hits[i];
+    }
 
     // explore the cache to fill the view.cells buffer with found cells
     for (int i = 0; i < CACHE_SIZE; i++) {
@@ -69,13 +80,14 @@ get_view(struct view view, struct cell_display *cells, int *hits,
         }
         if ((index = get_view_index(view, metadata[i].address)) >= 0) {
             cells[index] = display_cache[i];
+            view_request.nb_hits += !hits[index];
             hits[index] = view_request.hits[index] = 1;
-            view_request.nb_hits++;
             use(i);
         }
         if (address_equal(address, metadata[i].address)) {
             *hit = 1;
             *cell = content_cache[i];
+            value_ref(cell->value);
         }
     }
 
@@ -96,6 +108,21 @@ get_cell(struct address address, int *hit, struct cell_content *dest)
     } else {
         *hit = 1;
         *dest = content_cache[index];
+        value_ref(dest->value);
+    }
+    pthread_mutex_unlock(&cache_mutex);
+}
+
+void
+redisplay_col(sheet_id sheet_id, int col)
+{
+    // display the cached cells of a column again, after its width changed
+    pthread_mutex_lock(&cache_mutex);
+    for (int i = 0; i < CACHE_SIZE; i++) {
+        if (metadata[i].valid && metadata[i].address.sheet_id == sheet_id &&
+            metadata[i].address.col == col) {
+            display_cache[i] = display_cell(&content_cache[i]);
+        }
     }
     pthread_mutex_unlock(&cache_mutex);
 }
@@ -122,15 +149,26 @@ dllist_link(cache_id a, cache_id b)
 static void
 process_cell_update(struct cell_content *cell_update)
 {
+    int is_stored;
     cache_id index;
     struct address address;
 
     address = cell_update->address;
-    if ((index = find_address(address)) >= 0 || should_store(address)) {
-        store(cell_update, index);
+    is_stored = (index = find_address(address)) >= 0 || should_store(address);
+    if (is_stored) {
+        index = store(cell_update, index);
     }
     if (should_send_to_controller(address)) {
-        draw_cell(cell_update);
+        // the display of stored cells is not computed again
+        if (is_stored) {
+            draw_cell(address, &display_cache[index]);
+        } else {
+            struct cell_display display = display_cell(cell_update);
+            draw_cell(address, &display);
+        }
+    }
+    if (!is_stored) {
+        value_unref(cell_update->value);
     }
 }
 
@@ -152,6 +190,7 @@ store(struct cell_content *cell, cache_id index)
 {
     // if index >= 0, refresh the existing value, else insert cell in the cache
     // and set as most recently used element
+    // the cache takes ownership of the string reference of cell, if any
     // return the index used
     if (index < 0) {
         if (is_full) {
@@ -168,6 +207,7 @@ store(struct cell_content *cell, cache_id index)
         }
         metadata[index].address = cell->address;
     }
+    value_unref(content_cache[index].value);
     content_cache[index] = *cell;
     display_cache[index] = display_cell(cell);
     return index;
@@ -6,5 +6,6 @@
 void get_view(struct view view, struct cell_display *cells, int *hits,
     struct address address, struct cell_content *cell, int *hit);
 void get_cell(struct address address, int *hit, struct cell_content *dest);
+void redisplay_col(sheet_id sheet_id, int col);
 
 #endif // CACHE_MANAGER_H
@@ -1,17 +1,58 @@
 #include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
 
+#include "bench.h"
 #include "clic.h"
+#include "csv.h"
+#include "evaluation.h"
+#include "file_format.h"
+#include "journal.h"
+#include "loader.h"
 #include "pthread_queue.h"
+#include "sidecar.h"
+#include "storage.h"
 #include "thread_management.h"
 #include "types.h"
+#include "writer.h"
 
+enum subcommand {
+    MAIN_SCOPE,
+    BENCH,
+    EXPORT,
+    IMPORT,
+    VIEW,
+};
+
+static char delimiter_of(const char *delimiter, const char *path);
+static int export(const char *area_name, int sheet, const char *output,
+    const char *delimiter);
+static int import(const char *csv_path, const char *delimiter);
+
+const char *file_path, *viewed_path;
+struct file_layout file_layout;
+int bench_height, bench_steps, bench_width, is_following, is_headless;
 struct pthread_queue
+    appended_rows = PTHREAD_QUEUE_INITIALIZER(STATE_MANAGER,
+        sizeof(struct appended_rows)),
     approved_modifs = PTHREAD_QUEUE_INITIALIZER(STATE_MANAGER, 0),
     cell_updates = PTHREAD_QUEUE_INITIALIZER(CACHE_MANAGER,
         sizeof(struct cell_content)),
     cursor_pos = PTHREAD_QUEUE_INITIALIZER(SENDER, sizeof(struct cursor_pos)),
+    export_requests = PTHREAD_QUEUE_INITIALIZER(STATE_MANAGER,
+        sizeof(struct export_request)),
+    exports = PTHREAD_QUEUE_INITIALIZER(WRITER, 0),
+    file_changes = PTHREAD_QUEUE_INITIALIZER(STATE_MANAGER,
+        sizeof(struct stat)),
+    finished_exports = PTHREAD_QUEUE_INITIALIZER(STATE_MANAGER, 0),
+    finished_saves = PTHREAD_QUEUE_INITIALIZER(STATE_MANAGER, 0),
+    import_requests = PTHREAD_QUEUE_INITIALIZER(STATE_MANAGER,
+        sizeof(struct import_request)),
     local_modifs = PTHREAD_QUEUE_INITIALIZER(STATE_MANAGER, 0),
     modif_attempts = PTHREAD_QUEUE_INITIALIZER(SENDER, 0),
+    saves = PTHREAD_QUEUE_INITIALIZER(WRITER, 0),
     validations = PTHREAD_QUEUE_INITIALIZER(STATE_MANAGER,
         sizeof(struct validation)),
     view_requests = PTHREAD_QUEUE_INITIALIZER(STATE_MANAGER,
@@ -22,14 +63,75 @@ struct pthread_queue
 int
 main(int argc, char *argv[])
 {
-    int exit_status;
+    int exit_status, rows, sheet, size, subcommand;
+    const char *area, *csv_path, *delimiter, *output, *scenario;
 
     capture_signals();
 
     // parse command line arguments
     clic_init("grid-client", VERSION, "GPLv3", "spreadsheet editor", 0, 0);
+    clic_add_arg_string(MAIN_SCOPE, "file", "grid file to edit", &file_path,
+        0);
+    clic_add_subcommand(BENCH, "bench",
+        "scroll through a grid file rendered in memory, and report the cost "
+        "of frames", 0);
+    clic_add_param_int(BENCH, "height", "rows of the rendering", 100,
+        &bench_height);
+    clic_add_param_int(BENCH, "rows", "rows of the aggregated column",
+        10000000, &rows);
+    clic_add_param_string(BENCH, "scenario", "what to measure: scrolling, "
+        "range functions with and without the aggregate kernels, startup, "
+        "or csv import and export", "scroll", &scenario, 1);
+    clic_add_param_string_option(BENCH, "scenario", "aggregate");
+    clic_add_param_string_option(BENCH, "scenario", "csv");
+    clic_add_param_string_option(BENCH, "scenario", "load");
+    clic_add_param_string_option(BENCH, "scenario", "scroll");
+    clic_add_param_int(BENCH, "size", "MiB of the generated file", 1024,
+        &size);
+    clic_add_param_int(BENCH, "steps", "rows scrolled down, then up", 1000,
+        &bench_steps);
+    clic_add_param_int(BENCH, "width", "columns of the rendering", 300,
+        &bench_width);
+    clic_add_arg_string(BENCH, "file", "grid file to render or to load, "
+        "or csv file to import, generated if missing (load and csv "
+        "scenarios)", &file_path, 0);
+    clic_add_subcommand(EXPORT, "export",
+        "export a sheet or an area of a grid file as csv", 0);
+    clic_add_param_string(EXPORT, "area", "area to export (default: used "
+        "area of the sheet)", NULL, &area, 0);
+    clic_add_param_string(EXPORT, "delimiter",
+        "field delimiter (default: tab for .tsv files, comma otherwise)",
+        NULL, &delimiter, 0);
+    clic_add_param_string(EXPORT, "output", "csv file to write (default: "
+        "standard output)", NULL, &output, 0);
+    clic_add_param_int(EXPORT, "sheet", "sheet to export", 0, &sheet);
+    clic_add_arg_string(EXPORT, "file", "grid file to read", &file_path, 0);
+    clic_add_subcommand(IMPORT, "import",
+        "import a csv file in the first sheet of a grid file", 0);
+    clic_add_param_string(IMPORT, "delimiter",
+        "field delimiter (default: tab for .tsv files, comma otherwise)",
+        NULL, &delimiter, 0);
+    clic_add_arg_string(IMPORT, "csv", "csv file to import", &csv_path, 0);
+    clic_add_arg_string(IMPORT, "file", "grid file to write", &file_path, 0);
+    clic_add_subcommand(VIEW, "view",
+        "view a csv file of any size, read-only", 0);
+    clic_add_param_flag(VIEW, 'f', "follow records appended to the file",
+        &is_following, 1);
+    clic_add_arg_string(VIEW, "csv", "csv file to view", &viewed_path, 0);
     // TODO
-    clic_parse(argc, (const char **) argv, NULL);
+    clic_parse(argc, (const char **) argv, &subcommand);
+    if (subcommand == BENCH && !strcmp(scenario, "aggregate")) {
+        return bench_aggregate(rows);
+    } else if (subcommand == BENCH && !strcmp(scenario, "csv")) {
+        return bench_csv(file_path, size);
+    } else if (subcommand == BENCH && !strcmp(scenario, "load")) {
+        return bench_load(file_path, size);
+    } else if (subcommand == EXPORT) {
+        return export(area, sheet, output, delimiter);
+    } else if (subcommand == IMPORT) {
+        return import(csv_path, delimiter);
+    }
+    is_headless = subcommand == BENCH;
 
     // init
     // TODO
@@ -42,3 +144,133 @@ main(int argc, char *argv[])
     // TODO
     return exit_status;
 }
+
+static char
+delimiter_of(const char *delimiter, const char *path)
+{
+    // the delimiter given on the command line, or the one of path
+    if (!delimiter) {
+        return path ? csv_delimiter(path) : ',';
+    }
+    return !strcmp(delimiter, "tab") ? '\t' : delimiter[0];
+}
+
+static int
+export(const char *area_name, int sheet, const char *output,
+    const char *delimiter)
+{
+    // export the values of file_path once computed, its journal replayed,
+    // without spawning the interface threads
+    char *journal_path;
+    int res;
+    struct area area;
+    struct file_layout journal_layout = {0};
+    struct snapshot *snapshot;
+
+    if (sidecar_load(file_path, NULL) && load_file(file_path, NULL) < 0) {
+        fprintf(stderr, "grid-client: can not read %s\n", file_path);
+        return EXIT_FAILURE;
+    }
+    journal_path = malloc(strlen(file_path) + sizeof(".journal"));
+    sprintf(journal_path, "%s.journal", file_path);
+    res = replay_journal(journal_path, &journal_layout);
+    free(journal_layout.lines);
+    if (res < 0) {
+        fprintf(stderr, "grid-client: can not read %s\n", journal_path);
+        free(journal_path);
+        storage_clear();
+        return EXIT_FAILURE;
+    }
+    free(journal_path);
+    while (evaluate_next_dirty_cell()) {
+        continue;
+    }
+    snapshot = storage_snapshot();
+    if (!area_name) {
+        area = snapshot_sheet_area(snapshot, sheet);
+    } else if (parse_area(area_name, area_name + strlen(area_name), sheet,
+        &area) != area_name + strlen(area_name)) {
+        fprintf(stderr, "grid-client: invalid area %s\n", area_name);
+        storage_release_snapshot(snapshot);
+        storage_clear();
+        return EXIT_FAILURE;
+    }
+    res = csv_export(snapshot, area, delimiter_of(delimiter, output), output);
+    storage_release_snapshot(snapshot);
+    storage_clear();
+    if (res) {
+        fprintf(stderr, "grid-client: can not write %s\n",
+            output ? output : "standard output");
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
+
+static int
+import(const char *csv_path, const char *delimiter)
+{
+    // import csv_path over the content of file_path, its journal replayed,
+    // without spawning the interface threads; the journaled modifications
+    // are saved along with the import, so the journal is emptied
+    char *journal_path;
+    int nb_journaled;
+    struct address origin = {0};
+    struct file_layout journal_layout = {0};
+    struct save save = {0};
+
+    if (sidecar_load(file_path, &file_layout) &&
+        load_file(file_path, &file_layout) < 0) {
+        fprintf(stderr, "grid-client: can not read %s\n", file_path);
+        return EXIT_FAILURE;
+    }
+    journal_path = malloc(strlen(file_path) + sizeof(".journal"));
+    sprintf(journal_path, "%s.journal", file_path);
+    if (replay_journal(journal_path, &journal_layout) < 0) {
+        fprintf(stderr, "grid-client: can not read %s\n", journal_path);
+        save.is_failed = 1;
+    } else {
+        nb_journaled = journal_layout.nb_lines;
+        save.changes = malloc((nb_journaled + 1)*sizeof(*save.changes));
+        for (int i = 0; i < nb_journaled; i++) {
+            save.changes[i] = journal_layout.lines[i].area;
+        }
+        save.nb_changes = nb_journaled + 1;
+        if (csv_import(csv_path, origin, delimiter_of(delimiter, csv_path),
+            &save.changes[nb_journaled])) {
+            fprintf(stderr, "grid-client: can not read %s\n", csv_path);
+            save.is_failed = 1;
+        }
+    }
+    if (save.is_failed) {
+        free(save.changes);
+        free(journal_layout.lines);
+        free(journal_path);
+        free(file_layout.lines);
+        storage_clear();
+        return EXIT_FAILURE;
+    }
+
+    save.snapshot = storage_snapshot();
+    save.is_failed = write_save(&save, file_path);
+    if (!save.is_failed) {
+        sidecar_write(save.snapshot, file_path, &file_layout);
+
+        // the journaled modifications are now part of the grid file
+        if (journal_layout.size) {
+            journal_open(journal_path);
+            journal_compact(journal_mark());
+            journal_close();
+        }
+    }
+    storage_release_snapshot(save.snapshot);
+    storage_clear();
+    free(save.changes);
+    free(journal_layout.lines);
+    free(journal_path);
+    free(file_layout.lines);
+    if (save.is_failed) {
+        fprintf(stderr, "grid-client: can not write %s\n", file_path);
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
@@ -1,9 +1,18 @@
 #ifndef CLIENT_H
 #define CLIENT_H
 
+#include "file_format.h"
 #include "pthread_queue.h"
 
-extern struct pthread_queue approved_modifs, cell_updates, cursor_pos,
-    local_modifs, modif_attempts, validations, view_requests, write_requests;
+extern int bench_height, bench_steps, bench_width; // of the bench subcommand
+extern const char *file_path;
+extern const char *viewed_path; // csv file shown read-only, instead of a grid
+extern struct file_layout file_layout; // filled by loader, kept by writer
+extern int is_following; // viewed file is followed as it grows
+extern int is_headless; // rendered in memory, for the bench subcommand
+extern struct pthread_queue appended_rows, approved_modifs, cell_updates,
+    cursor_pos, export_requests, exports, file_changes, finished_exports,
+    finished_saves, import_requests, local_modifs, modif_attempts, saves,
+    validations, view_requests, write_requests;
 
 #endif // CLIENT_H
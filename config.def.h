@@ -1,6 +1,7 @@
 #include "termbox2.h"
 
 // features
+#define HARDWARE_SCROLL             1 // terminal scroll regions, if supported
 #define TB_MOUSE_SUPPORT            0
 #ifndef TB_OUTPUT_MODE
 #define TB_OUTPUT_MODE              TB_OUTPUT_NORMAL
@@ -8,9 +9,23 @@
 
 // performance
 #define CACHE_SIZE                  (1 << 10)
+#define EVALUATION_BATCH_SIZE       (1 << 12)
+#define FORMAT_MEMO_SIZE            (1 << 12) // numbers formatted for display
+#define FRAME_RATE                  60 // Hz, screen updates at most
+#define INDEX_MAX_COLS              (1 << 6) // of aggregated ranges indexed
+#define JOURNAL_GROUP_DELAY         100 // ms before committing modifications
+#define JOURNAL_GROUP_SIZE          (1 << 16) // bytes committed at once
+#define LOADER_CHUNK_SIZE           (1 << 24) // bytes parsed by a worker
+#define LOADER_WINDOW               16 // chunks parsed ahead of the loading
+#define RELOAD_MAX_AREAS            (1 << 6) // more are merged by sheet
+#define SAVE_MAX_CHANGES            (1 << 10) // more rewrite the whole file
+#define SIDECAR_MIN_SIZE            (1 << 20) // of cached grid files, 0: none
+#define VIEWER_INDEX_STRIDE         (1 << 10) // records between indexed ones
+#define WATCHER_PERIOD              100 // ms a changed file must stay stable
 
 // spacing
-#define CELL_WIDTH                  8
+#define CELL_MAX_WIDTH              32
+#define CELL_WIDTH                  8 // unless set otherwise for a column
 #define ROWS_NB_WIDTH               4
 #define XPAD                        1
 #define YPAD                        3
@@ -1,34 +1,180 @@
+#include <poll.h>
 #include <pthread.h>
 #include <signal.h>
 #include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
 
 #include "config.h"
 #include "client.h"
 #include "display.h"
+#include "hidden.h"
 #include "pthread_queue.h"
 #include "termbox2.h"
 #include "thread_management.h"
 #include "types.h"
+#include "widths.h"
 
-int cursor_content_found;
+#define BENCH_SETTLE                        5 // ms without frames ending a step
+#define COMMAND_SIZE                        256
+
+char command[COMMAND_SIZE]; // typed after ':', shown on the status line
+int cursor_content_found, is_command_mode;
 struct cell_content cursor_content;
 struct cursor_pos cursor;
 
+static void execute_command(void);
+static const char *parse_header(const char *s, enum axis *axis,
+    int64_t *line);
+static int parse_headers(const char *s, enum axis *axis, int64_t *first,
+    int64_t *end);
+static void process_command_event(struct tb_event ev);
 static void process_event(struct tb_event ev);
+static void run_benchmark(void);
+static void settle(int timeout);
+static void wait_for_input(int timeout);
 
+static int is_cursor_moved; // since the view was last moved to the cursor
 static int wait_for_resize;
 
+static void
+execute_command(void)
+{
+    // "import PATH" imports a csv file at the cursor, "export PATH" exports
+    // the current sheet, "width N" sets the width of the cursor column,
+    // "hide LINES" and "show LINES" hide and show columns (as in B:D) or rows
+    // (as in 3:10)
+    int64_t end, first;
+    enum axis axis;
+    struct export_request export_request;
+    struct import_request import_request;
+
+    if (!strncmp(command, "export ", 7) && command[7]) {
+        export_request.path = malloc(strlen(command + 7) + 1);
+        strcpy(export_request.path, command + 7);
+        export_request.sheet_id = cursor.sheet_id;
+        pthread_queue_push(&export_requests, &export_request);
+    } else if (!strncmp(command, "import ", 7) && command[7]) {
+        import_request.path = malloc(strlen(command + 7) + 1);
+        strcpy(import_request.path, command + 7);
+        import_request.origin = address_of_cursor(cursor);
+        import_request.origin.row = MAX(0, import_request.origin.row);
+        import_request.origin.col = MAX(0, import_request.origin.col);
+        pthread_queue_push(&import_requests, &import_request);
+    } else if (!strncmp(command, "width ", 6)) {
+        resize_cursor_col(atoi(command + 6));
+    } else if ((!strncmp(command, "hide ", 5) ||
+        !strncmp(command, "show ", 5)) &&
+        !parse_headers(command + 5, &axis, &first, &end)) {
+        set_lines_hidden(axis, first, end, command[0] == 'h');
+    }
+}
+
+static const char *
+parse_header(const char *s, enum axis *axis, int64_t *line)
+{
+    // parse a column name or a row number, return a pointer to the first
+    // character after it, or NULL
+    const char *p;
+
+    *line = 0;
+    if (*s >= 'A' && *s <= 'Z') {
+        // bijective base-26, see col_name
+        for (p = s; *p >= 'A' && *p <= 'Z' && *line < NB_COLUMNS; p++) {
+            *line = *line*26 + *p - 'A' + 1;
+        }
+        *axis = AXIS_COLS;
+    } else {
+        for (p = s; *p >= '0' && *p <= '9' && *line <= NB_ROWS; p++) {
+            *line = *line*10 + *p - '0';
+        }
+        *axis = AXIS_ROWS;
+    }
+    (*line)--;
+    return p == s || *line < 0 || *line >= (*axis == AXIS_COLS ?
+        NB_COLUMNS : NB_ROWS) ? NULL : p;
+}
+
+static int
+parse_headers(const char *s, enum axis *axis, int64_t *first, int64_t *end)
+{
+    // parse "LINE" or "LINE:LINE" as [first, end), return a non-null result
+    // if invalid
+    int64_t last;
+    enum axis last_axis;
+
+    if (!(s = parse_header(s, axis, first))) {
+        return 1;
+    } else if (!*s) {
+        *end = *first + 1;
+        return 0;
+    } else if (*s != ':' || !(s = parse_header(s + 1, &last_axis, &last)) ||
+        *s || last_axis != *axis) {
+        return 1;
+    }
+    *end = MAX(*first, last) + 1;
+    *first = MIN(*first, last);
+    return 0;
+}
+
+static void
+process_command_event(struct tb_event ev)
+{
+    int length;
+
+    length = strlen(command);
+    if (ev.ch) {
+        // characters are stored in UTF-8
+        if (length + 7 < COMMAND_SIZE) {
+            length += tb_utf8_unicode_to_char(command + length, ev.ch);
+            command[length] = '\0';
+        }
+    } else switch (ev.key) {
+    case TB_KEY_BACKSPACE:
+    case TB_KEY_BACKSPACE2:
+        // remove the last UTF-8 sequence
+        while (length && (command[--length] & 0xc0) == 0x80) {
+            continue;
+        }
+        command[length] = '\0';
+        break;
+    case TB_KEY_ENTER:
+        execute_command();
+        // fallthrough
+    case TB_KEY_ESC:
+        command[0] = '\0';
+        is_command_mode = 0;
+        break;
+    }
+    print_command_status_line();
+}
+
 static void
 process_event(struct tb_event ev)
 {
     // TODO
     struct write_request write_request;
 
+    if (is_command_mode && ev.type == TB_EVENT_KEY) {
+        process_command_event(ev);
+        return;
+    }
     switch (ev.type) {
     case TB_EVENT_KEY:
         // key (TB_KEY_*) XOR ch (Unicode codepoint), mod (TB_MOD_*)
         if (ev.ch) switch (ev.ch) {
+        case '<':
+        case '>':
+            resize_cursor_col(col_width(cursor.sheet_id, cursor.col) +
+                (ev.ch == '<' ? -1 : 1));
+            break;
+        case ':':
+            is_command_mode = 1;
+            print_command_status_line();
+            break;
         case 'q':
             request_termination(0);
             break;
@@ -38,13 +184,17 @@ process_event(struct tb_event ev)
         } else switch (ev.key) {
         case TB_KEY_ARROW_UP:
         case TB_KEY_ARROW_DOWN:
-            cursor.row += ev.key == TB_KEY_ARROW_UP ? -1 : 1;
-            move_to_cursor();
+            cursor.row = next_shown(get_hidden(cursor.sheet_id), AXIS_ROWS,
+                cursor.row, ev.key == TB_KEY_ARROW_UP ? -1 : 1);
+            clamp_cursor();
+            is_cursor_moved = 1;
             break;
         case TB_KEY_ARROW_LEFT:
         case TB_KEY_ARROW_RIGHT:
-            cursor.col += ev.key == TB_KEY_ARROW_LEFT ? -1 : 1;
-            move_to_cursor();
+            cursor.col = next_shown(get_hidden(cursor.sheet_id), AXIS_COLS,
+                cursor.col, ev.key == TB_KEY_ARROW_LEFT ? -1 : 1);
+            clamp_cursor();
+            is_cursor_moved = 1;
             break;
         }
         break;
@@ -61,25 +211,106 @@ process_event(struct tb_event ev)
     }
 }
 
+static void
+run_benchmark(void)
+{
+    // scroll bench_steps rows down then up again, one row per step, each
+    // step presenting frames until the cells it requested are drawn, and
+    // report the cost of these frames on the standard output
+    struct frame_stats stats;
+    struct pollfd fd;
+
+    // the first view is drawn once the file is loaded, possibly before the
+    // first frame is presented
+    fd = (struct pollfd) {.fd = frame_fd(), .events = POLLIN};
+    do {
+        if (should_terminate()) {
+            return;
+        }
+        present_frame();
+    } while (!get_frame_stats().cell_frames && poll(&fd, 1, 100) >= 0);
+    settle(BENCH_SETTLE);
+    get_frame_stats();
+
+    for (int i = 0; i < 2*bench_steps && !should_terminate(); i++) {
+        cursor.row += i < bench_steps ? 1 : -1;
+        move_to_cursor();
+        refresh_terminal();
+        settle(BENCH_SETTLE);
+    }
+    stats = get_frame_stats();
+    printf("%d steps, %d frames, %ld bytes (%.1f per step), %.3f ms "
+        "(%.1f us per frame, %.1f at most)\n", 2*bench_steps, stats.frames,
+        stats.bytes, (double) stats.bytes/MAX(1, 2*bench_steps),
+        stats.time*1e3, stats.time*1e6/MAX(1, stats.frames),
+        stats.max_time*1e6);
+    request_termination(EXIT_SUCCESS);
+}
+
+static void
+settle(int timeout)
+{
+    // present frames until none is requested for timeout ms
+    struct pollfd fd;
+
+    fd = (struct pollfd) {.fd = frame_fd(), .events = POLLIN};
+    do {
+        present_frame();
+    } while (poll(&fd, 1, timeout) > 0);
+}
+
+static void
+wait_for_input(int timeout)
+{
+    // wait for an event, a frame requested by another thread, or timeout ms
+    int resize_fd, tty_fd;
+    struct pollfd fds[3];
+
+    tb_get_fds(&tty_fd, &resize_fd);
+    fds[0] = (struct pollfd) {.fd = tty_fd, .events = POLLIN};
+    fds[1] = (struct pollfd) {.fd = resize_fd, .events = POLLIN};
+    fds[2] = (struct pollfd) {.fd = frame_fd(), .events = POLLIN};
+    poll(fds, 3, timeout);
+}
+
 void *
 controller_routine(void *sem)
 {
-    int rv;
+    int delay, rv;
     struct tb_event ev;
 
     (void) sem; // ignored, but should_terminate() is still periodically checked
 
     wait_for_resize = init_termbox();
     refresh_terminal();
+    if (is_headless) {
+        if (wait_for_resize) {
+            fprintf(stderr, "grid-client: %dx%d is too small to render\n",
+                bench_width, bench_height);
+            request_termination(EXIT_FAILURE);
+        } else {
+            run_benchmark();
+        }
+        goto cleanup;
+    }
 
+    // pending events are processed as a batch, cursor moves being folded
+    // into a single view change, before the frame is presented
     while (1) {
-        rv = tb_peek_event(&ev, 100);
+        rv = tb_peek_event(&ev, 0);
         if (should_terminate()) {
             goto cleanup;
         }
         // TODO: manage all possible errors
         switch (rv) {
+        default:
         case TB_ERR_NO_EVENT:
+            if (is_cursor_moved) {
+                is_cursor_moved = 0;
+                move_to_cursor();
+            }
+            delay = present_frame();
+            wait_for_input(delay < 0 ? 100 : delay);
             break;
         case TB_OK:
             if (ev.type == TB_EVENT_KEY && ev.key == TB_KEY_CTRL_C) {
@@ -0,0 +1,915 @@
+// csv import and export
+// for imports, the file is split in chunks at record boundaries, found by
+// counting quotes to know whether a newline is inside a quoted field, then
+// chunks are parsed by the loader workers and applied in bulk by columns;
+// workers intern strings in a table of their chunk, published to the string
+// pool at once when the chunk is applied, so that they do not contend for it
+// the type of each column is inferred from the first records, so that for
+// instance codes with leading zeros are kept as strings
+// exports are written from a snapshot, by bands of rows aligned on tiles
+// the viewer maps a file without loading it: the offset of one record out of
+// VIEWER_INDEX_STRIDE is indexed in the background, and only the records
+// asked for are parsed, starting from the closest known one; a followed file
+// is watched for appended bytes, only the new records being indexed
+
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <sys/inotify.h>
+#endif // __linux__
+
+#include "config.h"
+#include "csv.h"
+#include "evaluation.h"
+#include "file_format.h"
+#include "kernels.h"
+#include "loader.h"
+#include "storage.h"
+#include "string_pool.h"
+#include "types.h"
+
+#define BAND_SIZE                           (1 << 16) // cells held by exports
+#define SAMPLE_SIZE                         64 // records to infer types from
+
+struct band {
+    // rows of an export, values being borrowed from the snapshot
+    struct area area;
+    struct value *values; // row by row
+};
+enum column_type {
+    COLUMN_AUTO, // each field is typed on its own
+    COLUMN_BOOLEAN,
+    COLUMN_NUMBER,
+    COLUMN_STRING,
+};
+struct column {
+    struct value *values; // missing ones are empty
+    int length, capacity;
+};
+struct csv_chunk {
+    // until the chunk is applied, string values hold the index of their key
+    // in strings (as.boolean), keys pointing to the file between start and
+    // end, or to copies owned by the chunk
+    struct value *values; // column by column
+    int nb_rows, nb_cols;
+    const char *start, *end;
+    struct string_key *strings;
+    int nb_strings, strings_capacity;
+    int *slots, nb_slots; // open addressing table of strings, -1 if free
+};
+struct csv_load {
+    char delimiter;
+    const enum column_type *types;
+    int nb_types, nb_rows, nb_cols;
+    struct address origin;
+};
+struct field {
+    const char *start;
+    size_t length;
+    int is_quoted, has_escapes, is_last; // is_last if it ends the record
+};
+struct viewer {
+    // data is remapped by the indexer as the file grows, under viewer_mutex
+    int is_open, fd, watch_fd; // watch_fd is -1 without inotify
+    const char *data;
+    size_t size;
+    char delimiter, *scratch; // scratch for field_value
+    size_t scratch_size;
+    enum column_type *types;
+    int nb_types;
+    // offsets[i] is the start of the record i*VIEWER_INDEX_STRIDE, offsets
+    // being appended by the indexer
+    size_t *offsets;
+    int nb_offsets, offsets_capacity, is_closing;
+    void (*on_append)(int64_t first, int64_t end);
+    pthread_t indexer;
+    // last record found, as rows are usually asked for in order
+    int64_t last_row;
+    size_t last_record;
+};
+
+static void apply_chunk(void *parsed, void *arg);
+static int chunk_string(struct csv_chunk *chunk, const char *s, size_t n);
+static int collect_cell(struct address address, struct value value,
+    const struct formula *formula, void *arg);
+static struct value field_value(const struct field *field,
+    enum column_type type, char **scratch, size_t *scratch_size,
+    struct csv_chunk *chunk);
+static void *index_routine(void *arg);
+static enum column_type *infer_types(const char *p, const char *end,
+    char delimiter, int *nb_types);
+static const char *next_field(const char *p, const char *end, char delimiter,
+    struct field *field);
+static int parse_boolean(const char *s, size_t n, int *boolean);
+static void *parse_chunk(const char *start, const char *end, int i,
+    void *arg);
+static int parse_number(const char *s, size_t n, double *number);
+static const char *record_end(const char *p, const char *end, int is_quoted);
+static void remap_viewed(size_t size);
+static off_t wait_for_growth(void);
+static void write_field(FILE *fp, struct value value, char delimiter);
+
+static pthread_mutex_t viewer_mutex = PTHREAD_MUTEX_INITIALIZER;
+static struct viewer viewer;
+
+char
+csv_delimiter(const char *path)
+{
+    // return the delimiter implied by the extension of path
+    size_t length;
+
+    length = strlen(path);
+    return length >= 4 && !strcasecmp(path + length - 4, ".tsv") ? '\t' : ',';
+}
+
+int
+csv_export(const struct snapshot *snapshot, struct area area,
+    char delimiter, const char *path)
+{
+    // write the cells of area to path (stdout if NULL) as records, return a
+    // non-null result on failure
+    int band_height, res;
+    FILE *fp;
+    struct band band;
+
+    if (!path) {
+        fp = stdout;
+    } else if (!(fp = fopen(path, "w"))) {
+        return -1;
+    }
+
+    // bands hold at most BAND_SIZE cells
+    band_height = TILE_ROWS;
+    while (band_height > 1 && (size_t) band_height*area.col_span > BAND_SIZE) {
+        band_height /= 2;
+    }
+    band.area = area;
+    band.values = malloc(MAX((size_t) band_height*area.col_span, 1)*
+        sizeof(*band.values));
+    for (int64_t row = area.row; row < area.row + area.row_span;
+        row += band.area.row_span) {
+        band.area.row = row;
+        band.area.row_span = MIN(band_height - row%band_height,
+            area.row + area.row_span - row);
+        memset(band.values, 0, (size_t) band.area.row_span*area.col_span*
+            sizeof(*band.values));
+        snapshot_visit_area(snapshot, band.area, collect_cell, &band);
+        for (int i = 0; i < band.area.row_span; i++) {
+            for (int j = 0; j < area.col_span; j++) {
+                if (j) {
+                    fputc(delimiter, fp);
+                }
+                write_field(fp, band.values[(size_t) i*area.col_span + j],
+                    delimiter);
+            }
+            fputc('\n', fp);
+        }
+    }
+    free(band.values);
+
+    res = fflush(fp) || ferror(fp);
+    if (path) {
+        res = fclose(fp) || res;
+    }
+    return res;
+}
+
+int
+csv_import(const char *path, struct address origin, char delimiter,
+    struct area *area)
+{
+    // set the cells from origin to the records of path, one row per record,
+    // and area to the cells set, return a non-null result on failure
+    int is_quoted, nb_chunks;
+    const char *data, **bounds, *end, *nominal, *scanned;
+    enum column_type *types;
+    struct csv_load load = {.delimiter = delimiter, .origin = origin};
+    struct stat st;
+
+    *area = (struct area) {
+        .sheet_id = origin.sheet_id,
+        .row = origin.row,
+        .col = origin.col,
+    };
+    if (map_file(path, &data, &st)) {
+        return -1;
+    } else if (!data) {
+        return 0;
+    }
+    end = data + st.st_size;
+    types = infer_types(data, end, delimiter, &load.nb_types);
+    load.types = types;
+
+    // a newline after a nominal boundary ends a record if it is preceded by
+    // an even number of quotes
+    nb_chunks = (st.st_size + LOADER_CHUNK_SIZE - 1)/LOADER_CHUNK_SIZE;
+    bounds = malloc((nb_chunks + 1)*sizeof(*bounds));
+    bounds[0] = scanned = data;
+    is_quoted = 0;
+    for (int i = 1; i < nb_chunks; i++) {
+        nominal = data + (size_t) i*LOADER_CHUNK_SIZE;
+        is_quoted ^= count_byte(scanned, nominal, '"') & 1;
+        scanned = nominal;
+        bounds[i] = MAX(record_end(nominal, end, is_quoted), bounds[i - 1]);
+    }
+    bounds[nb_chunks] = end;
+
+    process_chunks(bounds, nb_chunks, parse_chunk, apply_chunk, &load);
+    area->row_span = load.nb_rows;
+    area->col_span = load.nb_cols;
+    free(bounds);
+    free(types);
+    munmap((void *) data, st.st_size);
+    return 0;
+}
+
+void
+csv_view_close(void)
+{
+    if (!viewer.is_open) {
+        return;
+    }
+    pthread_mutex_lock(&viewer_mutex);
+    viewer.is_closing = 1;
+    pthread_mutex_unlock(&viewer_mutex);
+    pthread_join(viewer.indexer, NULL);
+    if (viewer.data) {
+        munmap((void *) viewer.data, viewer.size);
+    }
+    if (viewer.watch_fd >= 0) {
+        close(viewer.watch_fd);
+    }
+    close(viewer.fd);
+    free(viewer.offsets);
+    free(viewer.scratch);
+    free(viewer.types);
+    viewer = (struct viewer) {0};
+}
+
+int
+csv_view_open(const char *path,
+    void (*on_append)(int64_t first, int64_t end))
+{
+    // map path for csv_view_row, return a non-null result on failure
+    // if on_append is not NULL, path is followed: on_append is called from
+    // another thread with the rows [first, end) modified by appended bytes
+    struct stat st;
+
+    csv_view_close();
+    if ((viewer.fd = open(path, O_RDONLY)) < 0) {
+        return -1;
+    } else if (fstat(viewer.fd, &st)) {
+        close(viewer.fd);
+        return -1;
+    }
+    remap_viewed(st.st_size);
+    if (st.st_size && !viewer.data) {
+        close(viewer.fd);
+        return -1;
+    }
+    viewer.is_open = 1;
+    viewer.watch_fd = -1;
+#ifdef __linux__
+    if (on_append &&
+        (viewer.watch_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC)) >= 0 &&
+        inotify_add_watch(viewer.watch_fd, path, IN_MODIFY) < 0) {
+        close(viewer.watch_fd);
+        viewer.watch_fd = -1;
+    }
+#endif // __linux__
+    viewer.on_append = on_append;
+    viewer.delimiter = csv_delimiter(path);
+    viewer.types = infer_types(viewer.data, viewer.data + viewer.size,
+        viewer.delimiter, &viewer.nb_types);
+    viewer.offsets_capacity = 1 << 10;
+    viewer.offsets = malloc(viewer.offsets_capacity*sizeof(*viewer.offsets));
+    viewer.offsets[0] = 0;
+    viewer.nb_offsets = 1;
+    pthread_create(&viewer.indexer, NULL, index_routine, NULL);
+    return 0;
+}
+
+void
+csv_view_row(int64_t row, struct value *values, int nb_cols)
+{
+    // set values to the first nb_cols fields of the record row of the viewed
+    // file (empty if missing), as new references
+    int col;
+    int64_t i;
+    const char *end, *p;
+    struct field field;
+
+    for (col = 0; col < nb_cols; col++) {
+        values[col] = (struct value) {.type = VALUE_EMPTY};
+    }
+    pthread_mutex_lock(&viewer_mutex);
+    if (!viewer.data) {
+        goto unlock;
+    }
+
+    // start from the closest record known before row
+    i = MIN(row/VIEWER_INDEX_STRIDE, viewer.nb_offsets - 1);
+    p = viewer.data + viewer.offsets[i];
+    i *= VIEWER_INDEX_STRIDE;
+    if (viewer.last_row <= row && viewer.last_row > i) {
+        i = viewer.last_row;
+        p = viewer.data + viewer.last_record;
+    }
+    end = viewer.data + viewer.size;
+    for (; i < row && p < end; i++) {
+        p = record_end(p, end, 0);
+    }
+    if (p == end) {
+        goto unlock;
+    }
+    viewer.last_row = row;
+    viewer.last_record = p - viewer.data;
+
+    // parse the fields asked for only
+    for (col = 0; col < nb_cols; col++) {
+        p = next_field(p, end, viewer.delimiter, &field);
+        values[col] = field_value(&field, col < viewer.nb_types ?
+            viewer.types[col] : COLUMN_AUTO, &viewer.scratch,
+            &viewer.scratch_size, NULL);
+        if (field.is_last) {
+            break;
+        }
+    }
+
+unlock:
+    pthread_mutex_unlock(&viewer_mutex);
+}
+
+static void
+apply_chunk(void *parsed, void *arg)
+{
+    size_t nb_values;
+    const char *data;
+    const struct string **strings;
+    struct csv_chunk *chunk;
+    struct csv_load *load;
+
+    chunk = parsed;
+    load = arg;
+    nb_values = (size_t) chunk->nb_rows*chunk->nb_cols;
+
+    // the values borrow the references of the chunk to its strings
+    strings = malloc(MAX(chunk->nb_strings, 1)*sizeof(*strings));
+    string_intern_keys(chunk->strings, chunk->nb_strings, strings);
+    for (size_t k = 0; k < nb_values; k++) {
+        if (chunk->values[k].type == VALUE_STRING) {
+            chunk->values[k].as.string =
+                strings[chunk->values[k].as.boolean];
+        }
+    }
+    if (nb_values) {
+        apply_values((struct area) {
+            .sheet_id = load->origin.sheet_id,
+            .row = load->origin.row + load->nb_rows,
+            .col = load->origin.col,
+            .row_span = chunk->nb_rows,
+            .col_span = chunk->nb_cols,
+        }, chunk->values);
+    }
+    string_unref_all(strings, chunk->nb_strings);
+    for (int k = 0; k < chunk->nb_strings; k++) {
+        data = chunk->strings[k].data;
+        if (data < chunk->start || data >= chunk->end) {
+            free((char *) data);
+        }
+    }
+    load->nb_rows += chunk->nb_rows;
+    load->nb_cols = MAX(load->nb_cols, chunk->nb_cols);
+    free(strings);
+    free(chunk->strings);
+    free(chunk->values);
+    free(chunk);
+}
+
+static int
+chunk_string(struct csv_chunk *chunk, const char *s, size_t n)
+{
+    // return the index of the key of s in the strings of chunk, added if
+    // missing, s being copied if it is not in the chunk
+    char *copy;
+    size_t j, mask;
+    uint64_t h;
+    const struct string_key *key;
+
+    // keep the load factor under 1/2
+    if (2*(chunk->nb_strings + 1) > chunk->nb_slots) {
+        chunk->nb_slots = chunk->nb_slots ? 2*chunk->nb_slots : 64;
+        chunk->slots = realloc(chunk->slots,
+            chunk->nb_slots*sizeof(*chunk->slots));
+        memset(chunk->slots, -1, chunk->nb_slots*sizeof(*chunk->slots));
+        mask = chunk->nb_slots - 1;
+        for (int i = 0; i < chunk->nb_strings; i++) {
+            for (j = chunk->strings[i].hash & mask; chunk->slots[j] >= 0;
+                j = (j + 1) & mask);
+            chunk->slots[j] = i;
+        }
+    }
+
+    h = string_hash(s, n);
+    mask = chunk->nb_slots - 1;
+    for (j = h & mask; chunk->slots[j] >= 0; j = (j + 1) & mask) {
+        key = &chunk->strings[chunk->slots[j]];
+        if (key->hash == h && key->length == n && !memcmp(key->data, s, n)) {
+            return chunk->slots[j];
+        }
+    }
+    if (chunk->nb_strings == chunk->strings_capacity) {
+        chunk->strings_capacity = chunk->strings_capacity ?
+            2*chunk->strings_capacity : 16;
+        chunk->strings = realloc(chunk->strings,
+            chunk->strings_capacity*sizeof(*chunk->strings));
+    }
+    if (s < chunk->start || s >= chunk->end) {
+        copy = malloc(n);
+        memcpy(copy, s, n);
+        s = copy;
+    }
+    chunk->strings[chunk->nb_strings] = (struct string_key) {
+        .data = s,
+        .length = n,
+        .hash = h,
+    };
+    chunk->slots[j] = chunk->nb_strings;
+    return chunk->nb_strings++;
+}
+
+static int
+collect_cell(struct address address, struct value value,
+    const struct formula *formula, void *arg)
+{
+    struct band *band;
+
+    (void) formula;
+    band = arg;
+    band->values[(size_t) (address.row - band->area.row)*band->area.col_span +
+        address.col - band->area.col] = value;
+    return 0;
+}
+
+static struct value
+field_value(const struct field *field, enum column_type type, char **scratch,
+    size_t *scratch_size, struct csv_chunk *chunk)
+{
+    // doubled quotes are unescaped in scratch, strings are interned in the
+    // strings of chunk if not NULL, else in the pool
+    const char *s;
+    size_t n;
+    struct value value;
+
+    if (!field->length) {
+        return (struct value) {.type = VALUE_EMPTY};
+    }
+    s = field->start;
+    n = field->length;
+    if (field->has_escapes) {
+        if (*scratch_size < n) {
+            *scratch_size = MAX(n, 2*(*scratch_size));
+            *scratch = realloc(*scratch, *scratch_size);
+        }
+        for (n = 0; s < field->start + field->length; s++) {
+            (*scratch)[n++] = *s;
+            s += *s == '"';
+        }
+        s = *scratch;
+    }
+
+    // quotes mark strings, unless the whole column is typed
+    if (type == COLUMN_NUMBER ||
+        (type == COLUMN_AUTO && !field->is_quoted)) {
+        if (!parse_number(s, n, &value.as.number)) {
+            value.type = VALUE_NUMBER;
+            return value;
+        }
+    }
+    if (type == COLUMN_BOOLEAN ||
+        (type == COLUMN_AUTO && !field->is_quoted)) {
+        if (!parse_boolean(s, n, &value.as.boolean)) {
+            value.type = VALUE_BOOLEAN;
+            return value;
+        }
+    }
+    value.type = VALUE_STRING;
+    if (chunk) {
+        value.as.boolean = chunk_string(chunk, s, n);
+    } else {
+        value.as.string = string_intern(s, n);
+    }
+    return value;
+}
+
+static enum column_type *
+infer_types(const char *p, const char *end, char delimiter, int *nb_types)
+{
+    // a column is typed if all its sampled fields share a type, the first
+    // record being skipped as it may be a header
+    int boolean, capacity, col, is_number, nb_records;
+    double number;
+    const char *s;
+    enum column_type *types;
+    struct field field;
+    struct {
+        int has_values, has_non_numbers, has_non_booleans;
+    } *seen;
+
+    seen = NULL;
+    *nb_types = capacity = 0;
+    for (nb_records = 0; p < end && nb_records <= SAMPLE_SIZE;
+        nb_records++) {
+        col = 0;
+        do {
+            p = next_field(p, end, delimiter, &field);
+            if (!nb_records || !field.length) {
+                col++;
+                continue;
+            }
+            if (col >= capacity) {
+                capacity = MAX(col + 1, 2*capacity);
+                seen = realloc(seen, capacity*sizeof(*seen));
+            }
+            while (*nb_types <= col) {
+                memset(&seen[(*nb_types)++], 0, sizeof(*seen));
+            }
+
+            // leading zeros are meaningful, as in codes
+            s = field.start + (*field.start == '-' || *field.start == '+');
+            is_number = !field.has_escapes &&
+                !parse_number(field.start, field.length, &number) &&
+                !(s + 1 < field.start + field.length && s[0] == '0' &&
+                s[1] >= '0' && s[1] <= '9');
+            seen[col].has_values = 1;
+            seen[col].has_non_numbers |= !is_number;
+            seen[col].has_non_booleans |= field.has_escapes ||
+                parse_boolean(field.start, field.length, &boolean);
+            col++;
+        } while (!field.is_last);
+    }
+
+    types = malloc(MAX(*nb_types, 1)*sizeof(*types));
+    for (int i = 0; i < *nb_types; i++) {
+        types[i] = !seen[i].has_values ? COLUMN_AUTO :
+            !seen[i].has_non_numbers ? COLUMN_NUMBER :
+            !seen[i].has_non_booleans ? COLUMN_BOOLEAN : COLUMN_STRING;
+    }
+    free(seen);
+    return types;
+}
+
+static const char *
+next_field(const char *p, const char *end, char delimiter,
+    struct field *field)
+{
+    // parse the field starting at p, return a pointer to the next one
+    const char *q;
+
+    *field = (struct field) {.start = p};
+    if (p < end && *p == '"') {
+        field->is_quoted = 1;
+        field->start = ++p;
+        while ((q = memchr(p, '"', end - p)) && q + 1 < end && q[1] == '"') {
+            field->has_escapes = 1;
+            p = q + 2;
+        }
+        q = q ? q : end;
+        field->length = q - field->start;
+        p = q + (q < end);
+    }
+
+    // characters after a closing quote are ignored
+    q = find_either(p, end, delimiter, '\n');
+    field->is_last = q == end || *q == '\n';
+    if (!field->is_quoted) {
+        field->length = q - p;
+        if (field->is_last && field->length && q[-1] == '\r') {
+            field->length--;
+        }
+    }
+    return q < end ? q + 1 : q;
+}
+
+static int
+parse_boolean(const char *s, size_t n, int *boolean)
+{
+    // return a non-null result on failure
+    if (n == 4 && !strncasecmp(s, "TRUE", 4)) {
+        *boolean = 1;
+    } else if (n == 5 && !strncasecmp(s, "FALSE", 5)) {
+        *boolean = 0;
+    } else {
+        return -1;
+    }
+    return 0;
+}
+
+static void *
+parse_chunk(const char *start, const char *end, int i, void *arg)
+{
+    // fields are gathered by columns, then packed in a single buffer
+    char *scratch;
+    int col, nb_columns, columns_capacity;
+    size_t scratch_size;
+    const char *p;
+    struct column *column, *columns;
+    struct csv_chunk *chunk;
+    struct csv_load *load;
+    struct field field;
+    struct value value;
+
+    (void) i;
+    load = arg;
+    chunk = calloc(1, sizeof(*chunk));
+    chunk->start = start;
+    chunk->end = end;
+    columns = NULL;
+    nb_columns = columns_capacity = 0;
+    scratch = NULL;
+    scratch_size = 0;
+    for (p = start; p < end; chunk->nb_rows++) {
+        col = 0;
+        do {
+            p = next_field(p, end, load->delimiter, &field);
+            value = field_value(&field, col < load->nb_types ?
+                load->types[col] : COLUMN_AUTO, &scratch, &scratch_size,
+                chunk);
+            if (value.type == VALUE_EMPTY) {
+                col++;
+                continue;
+            }
+            if (col >= columns_capacity) {
+                columns_capacity = MAX(col + 1, 2*columns_capacity);
+                columns = realloc(columns,
+                    columns_capacity*sizeof(*columns));
+            }
+            while (nb_columns <= col) {
+                columns[nb_columns++] = (struct column) {0};
+            }
+
+            // VALUE_EMPTY is null, and so are skipped fields
+            column = &columns[col++];
+            if (column->capacity <= chunk->nb_rows) {
+                column->capacity = MAX(chunk->nb_rows + 1,
+                    2*column->capacity);
+                column->values = realloc(column->values,
+                    column->capacity*sizeof(*column->values));
+            }
+            memset(column->values + column->length, 0,
+                (chunk->nb_rows - column->length)*sizeof(*column->values));
+            column->values[chunk->nb_rows] = value;
+            column->length = chunk->nb_rows + 1;
+        } while (!field.is_last);
+    }
+
+    chunk->nb_cols = nb_columns;
+    chunk->values = calloc(MAX((size_t) chunk->nb_rows*nb_columns, 1),
+        sizeof(*chunk->values));
+    for (int j = 0; j < nb_columns; j++) {
+        if (columns[j].length) {
+            memcpy(chunk->values + (size_t) j*chunk->nb_rows,
+                columns[j].values,
+                columns[j].length*sizeof(*chunk->values));
+        }
+        free(columns[j].values);
+    }
+    free(columns);
+    free(scratch);
+    free(chunk->slots);
+    return chunk;
+}
+
+static int
+parse_number(const char *s, size_t n, double *number)
+{
+    // return a non-null result on failure
+    // plain decimals of at most 15 significant digits are converted with a
+    // single division, exact as both operands are: strtod is used otherwise
+    static const double powers[] = {
+        1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11, 1e12,
+        1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22,
+    };
+    char buf[64], *num_end;
+    int has_digits, has_point, nb_decimals, nb_digits;
+    size_t i;
+    uint64_t mantissa;
+
+    i = n && (s[0] == '-' || s[0] == '+');
+    has_digits = has_point = nb_decimals = nb_digits = 0;
+    for (mantissa = 0; i < n; i++) {
+        if (s[i] >= '0' && s[i] <= '9') {
+            mantissa = 10*mantissa + (s[i] - '0');
+            has_digits = 1;
+            nb_digits += nb_digits || s[i] != '0';
+            nb_decimals += has_point;
+        } else if (s[i] == '.' && !has_point) {
+            has_point = 1;
+        } else {
+            break;
+        }
+    }
+    if (i == n && has_digits && nb_digits <= 15 &&
+        nb_decimals < (int) (sizeof(powers)/sizeof(*powers))) {
+        *number = (double) mantissa/powers[nb_decimals];
+        *number = s[0] == '-' ? -*number : *number;
+        return 0;
+    }
+
+    // exponents, or too many digits (strtod would also accept hexadecimal
+    // numbers, infinities and NaN)
+    if (!has_digits || n >= sizeof(buf) ||
+        strspn(s + i, "0123456789+-.eE") < n - i) {
+        return -1;
+    }
+    memcpy(buf, s, n);
+    buf[n] = '\0';
+    *number = strtod(buf, &num_end);
+    return num_end != buf + n;
+}
+
+static const char *
+record_end(const char *p, const char *end, int is_quoted)
+{
+    // return a pointer after the first newline outside quotes, or end
+    while ((p = find_either(p, end, '"', '\n')) < end) {
+        if (*p == '\n' && !is_quoted) {
+            return p + 1;
+        }
+        is_quoted ^= *p == '"';
+        p++;
+    }
+    return end;
+}
+
+static void
+remap_viewed(size_t size)
+{
+    // map the first size bytes of the viewed file, keeping the current
+    // mapping on failure; viewer_mutex must be held once the indexer runs
+    void *map;
+
+    map = size ? mmap(NULL, size, PROT_READ, MAP_PRIVATE, viewer.fd, 0) :
+        NULL;
+    if (map == MAP_FAILED) {
+        return;
+    }
+    if (viewer.data) {
+        munmap((void *) viewer.data, viewer.size);
+    }
+    viewer.data = map;
+    viewer.size = size;
+}
+
+static off_t
+wait_for_growth(void)
+{
+    // return the size of the viewed file once it changed, or -1 once the
+    // viewer is closing
+    char buf[1 << 12];
+    int is_closing;
+    struct pollfd pollfd;
+    struct stat st;
+
+    while (1) {
+        pthread_mutex_lock(&viewer_mutex);
+        is_closing = viewer.is_closing;
+        pthread_mutex_unlock(&viewer_mutex);
+        if (is_closing) {
+            return -1;
+        } else if (!fstat(viewer.fd, &st) && (size_t) st.st_size !=
+            viewer.size) {
+            return st.st_size;
+        }
+
+        // without inotify, the size is polled
+        pollfd = (struct pollfd) {.fd = viewer.watch_fd, .events = POLLIN};
+        if (poll(&pollfd, viewer.watch_fd >= 0, 100) > 0) {
+            while (read(viewer.watch_fd, buf, sizeof(buf)) > 0) {
+                continue;
+            }
+        }
+    }
+}
+
+static void
+write_field(FILE *fp, struct value value, char delimiter)
+{
+    // strings are quoted if needed to be read back as they are
+    char buf[32];
+    int boolean;
+    double number;
+    const char *p;
+    const struct string *string;
+
+    switch (value.type) {
+    case VALUE_EMPTY:
+        break;
+    case VALUE_BOOLEAN:
+        fputs(value.as.boolean ? "TRUE" : "FALSE", fp);
+        break;
+    case VALUE_ERROR:
+        fputs(value.as.error == ERROR_CYCLE ? "#CYCLE" :
+            value.as.error == ERROR_DIV0 ? "#DIV/0" : "#N/A", fp);
+        break;
+    case VALUE_NUMBER:
+        fwrite(buf, 1, format_number(value.as.number, buf), fp);
+        break;
+    case VALUE_STRING:
+        string = value.as.string;
+        for (p = string->data; *p; p++) {
+            if (*p == delimiter || *p == '"' || *p == '\n' || *p == '\r') {
+                break;
+            }
+        }
+        if (!*p && parse_number(string->data, string->length, &number) &&
+            parse_boolean(string->data, string->length, &boolean)) {
+            fwrite(string->data, 1, string->length, fp);
+            break;
+        }
+        fputc('"', fp);
+        for (p = string->data; *p; p++) {
+            if (*p == '"') {
+                fputc('"', fp);
+            }
+            fputc(*p, fp);
+        }
+        fputc('"', fp);
+        break;
+    }
+}
+
+static void *
+index_routine(void *arg)
+{
+    // index the complete records of the viewed file until closed, then
+    // follow the appended ones if needed
+    int is_first_pass;
+    int64_t first, nb_records;
+    off_t size;
+    size_t start;
+    const char *end, *next, *p;
+
+    (void) arg;
+    nb_records = 0;
+    start = 0;
+    for (is_first_pass = 1; ; is_first_pass = 0) {
+        // the last record may not be completely written yet
+        first = nb_records;
+        end = viewer.data + viewer.size;
+        for (p = viewer.data + start; p < end; p = next) {
+            next = record_end(p, end, 0);
+            if (next == end && (end[-1] != '\n' ||
+                count_byte(p, end, '"') & 1)) {
+                break;
+            }
+            start = next - viewer.data;
+            if (++nb_records%VIEWER_INDEX_STRIDE) {
+                continue;
+            }
+            pthread_mutex_lock(&viewer_mutex);
+            if (viewer.is_closing) {
+                pthread_mutex_unlock(&viewer_mutex);
+                return NULL;
+            }
+            if (viewer.nb_offsets == viewer.offsets_capacity) {
+                viewer.offsets_capacity *= 2;
+                viewer.offsets = realloc(viewer.offsets,
+                    viewer.offsets_capacity*sizeof(*viewer.offsets));
+            }
+            viewer.offsets[viewer.nb_offsets++] = start;
+            pthread_mutex_unlock(&viewer_mutex);
+        }
+        if (!is_first_pass) {
+            viewer.on_append(first, nb_records + (start < viewer.size));
+        } else if (!viewer.on_append) {
+            return NULL;
+        }
+
+        // the index is built again if the file is truncated
+        if ((size = wait_for_growth()) < 0) {
+            return NULL;
+        }
+        pthread_mutex_lock(&viewer_mutex);
+        if ((size_t) size < viewer.size) {
+            viewer.on_append(0, nb_records + (start < viewer.size));
+            nb_records = 0;
+            start = 0;
+            viewer.nb_offsets = 1;
+            viewer.last_row = 0;
+            viewer.last_record = 0;
+        }
+        remap_viewed(size);
+        pthread_mutex_unlock(&viewer_mutex);
+    }
+}
@@ -0,0 +1,20 @@
+#ifndef CSV_H
+#define CSV_H
+
+#include <stdint.h>
+
+#include "types.h"
+
+struct snapshot;
+
+char csv_delimiter(const char *path);
+int csv_export(const struct snapshot *snapshot, struct area area,
+    char delimiter, const char *path);
+int csv_import(const char *path, struct address origin, char delimiter,
+    struct area *area);
+void csv_view_close(void);
+int csv_view_open(const char *path,
+    void (*on_append)(int64_t first, int64_t end));
+void csv_view_row(int64_t row, struct value *values, int nb_cols);
+
+#endif // CSV_H
@@ -1,89 +1,221 @@
+#include <fcntl.h>
+#include <math.h>
 #include <pthread.h>
+#include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <time.h>
+#include <unistd.h>
 
 #include "cache_manager.h"
+#include "client.h"
 #include "config.h"
 #include "display.h"
+#include "file_format.h"
+#include "hidden.h"
+#include "string_pool.h"
 #include "termbox2.h"
 #include "types.h"
+#include "widths.h"
 
 #define CELL_DATA_HEIGHT                    3
 #define CELL_DATA_MINIMUM_WIDTH             8
 #define COMMAND_MINIMUM_WIDTH               3
 #define STATUS_WIDTH                        0 // TODO: set it with ifdef status options
 
-#define NB_COLUMNS                          (26 * 27)
 #if ROWS_NB_WIDTH < 2
 #undef ROWS_NB_WIDTH
 #define ROWS_NB_WIDTH                       0
-#elif ROWS_NB_WIDTH == 2
-#define ROWS_NB_MODULUS                     10
-#elif ROWS_NB_WIDTH == 3
-#define ROWS_NB_MODULUS                     100
-#else
-#define ROWS_NB_MODULUS                     1000
 #endif // ROWS_NB_WIDTH
 
-extern int cursor_content_found;
+struct formatted_number {
+    // display of a number in a column width, see format_cell_number
+    uint64_t bits; // of the number
+    int width, len; // width is 0 for unused entries
+    char s[32];
+};
+
+extern char command[];
+extern int cursor_content_found, is_command_mode;
 extern struct cell_content cursor_content;
 extern struct cursor_pos cursor;
 
+static void damage(int x, int64_t y);
+static double elapsed_since(const struct timespec *start);
 static int enforce_view_changes(void);
-static uintattr_t get_cell_bg(int x, int y);
+static void fit_cell_buf(const char *s, int len, int width, int offset);
+static int format_cell_number(double number, int width, char buf[]);
+static uintattr_t get_cell_bg(int x, int64_t y);
+static void init_headless(void);
+static long pop_headless_output(void);
+static void place_view_cols(void);
+static int present_silently(void);
+static void print_col_header(int j);
+static void print_row_number(int i);
+static void print_view_cell(int index);
+static void save_presented(void);
+static int scroll_grid(const struct view *old, const struct view *new);
+static int scroll_terminal(int y, int h, int n);
+static void shift_rows(struct tb_cell *buf, int width, int y, int h, int n,
+    struct tb_cell exposed);
+static int supports_scroll_regions(void);
 static void transfer_view_knowledge(struct view *old, struct view *new);
 
-static char cell_buf[CELL_WIDTH + 1];
+static int can_scroll; // the terminal, see scroll_terminal
+static char cell_buf[CELL_MAX_WIDTH + 1];
+static int *col_xs = NULL, col_xs_capacity; // view columns start, and end
+static int drawn_col = -1; // cursor position when printed, with drawn_row
+static int64_t drawn_row = -1;
+static int exposed_first, exposed_end; // view rows scrolled in, to print
+static int frame_pipe[2] = {-1, -1}; // wakes the controller up for a frame
+static double frame_time; // s spent printing the grid since the last frame
+static struct frame_stats frame_stats; // of headless frames
+static struct formatted_number formatted_numbers[FORMAT_MEMO_SIZE];
+static FILE *headless_output; // receives what the terminal would
+static int headless_fd = -1; // termbox's, a duplicate of headless_output
+static int is_cell_drawn; // by draw_cell since the last frame
+static int is_frame_requested;
+static int grid_width; // for the columns after the frozen ones
+static int is_grid_damaged = 1; // every cell and header is printed again
+static int is_view_outdated; // known cells must be requested again
+static int null_fd = -1; // discards the output of silent presents
+static struct tb_cell *presented; // termbox's front buffer, as last presented
+static int presented_length;
+static int rows_nb_width = ROWS_NB_WIDTH; // fits the last row in view
+static struct tb_cell *spare_back; // back buffer, while presented silently
 static int tb_initialized;
+static struct timespec last_frame;
 static int term_height, term_width, xpad, ypad;
+static pthread_mutex_t formatted_numbers_mutex = PTHREAD_MUTEX_INITIALIZER;
 static pthread_mutex_t tb_mutex = PTHREAD_MUTEX_INITIALIZER;
-static const struct cell_display missing_cell = {
-    .ch = "  miss  ",
-    .fg = TB_COLOR_FG_MISS,
-};
-static struct view view;
+static struct view buffers_view = {.sheet_id = -1}, view;
 
-// hits are cells buffers should be of length get_view_length(view)
-static int *hits = NULL;
-static struct cell_display *cells = NULL;
+// hits are cells buffers should be of length get_view_length(buffers_view),
+// the spare ones being used on view changes
+static char *damaged = NULL, *spare_damaged = NULL; // cells to print again
+static int buffers_capacity;
+static int *hits = NULL, *spare_hits = NULL;
+static struct cell_display *cells = NULL, *spare_cells = NULL;
 
 struct cell_display
 display_cell(const struct cell_content *cell)
 {
-    // TODO
+    // TODO: formats
+    // as wide as the column of cell, strings being aligned left and other
+    // values right
+    char buf[32];
+    const char *s;
+    int len, width;
     struct cell_display res;
+    const struct value *value;
 
-    memset(res.ch, ' ', CELL_WIDTH);
-    res.ch[CELL_WIDTH] = '\0';
-    res.ch[0] = 'r';
-    if (cell->state) {
-        res.ch[0] = 'S';
+    value = &cell->value;
+    width = col_width(cell->address.sheet_id, cell->address.col);
+    memset(res.ch, ' ', width);
+    res.ch[width] = '\0';
+    s = NULL;
+    switch (value->type) {
+    case VALUE_EMPTY:
+        break;
+    case VALUE_BOOLEAN:
+        s = value->as.boolean ? "TRUE" : "FALSE";
+        break;
+    case VALUE_ERROR:
+        s = value->as.error == ERROR_CYCLE ? "#CYCLE" :
+            value->as.error == ERROR_DIV0 ? "#DIV/0" : "#N/A";
+        break;
+    case VALUE_NUMBER:
+        format_cell_number(value->as.number, width, buf);
+        s = buf;
+        break;
+    case VALUE_STRING:
+        memcpy(res.ch, value->as.string->data,
+            MIN(value->as.string->length, (size_t) width));
+        break;
+    }
+    if (s) {
+        len = strlen(s);
+        memcpy(res.ch + MAX(0, width - len), s, MIN(len, width));
     }
     res.fg = TB_COLOR_FG_DEFAULT;
     return res;
 }
 
 void
-draw_cell(const struct cell_content *cell)
+draw_cell(struct address address, const struct cell_display *display)
 {
-    int is_ready;
+    // store the display of the cell at address if in view, printed with the
+    // next frame
+    int index;
 
-    // return early if interface isn't initialized
     pthread_mutex_lock(&tb_mutex);
-    is_ready = tb_initialized;
-    pthread_mutex_unlock(&tb_mutex);
-    if (!is_ready) {
-        return;
+    if (tb_initialized &&
+        (index = get_view_index(buffers_view, address)) >= 0) {
+        cells[index] = *display;
+        hits[index] = damaged[index] = 1;
+        is_cell_drawn = 1;
+        if (!is_frame_requested) {
+            is_frame_requested = 1;
+            write(frame_pipe[1], "", 1);
+        }
     }
+    pthread_mutex_unlock(&tb_mutex);
+}
 
-    // TODO
+void
+clamp_cursor(void)
+{
+    // keep the cursor on a valid shown address, or on the headers
+    const struct hidden *hidden;
+
+    hidden = get_hidden(view.sheet_id);
+    cursor.col = MAX(-1, MIN(cursor.col, NB_COLUMNS - 1));
+    cursor.row = MAX(-1, MIN(cursor.row, NB_ROWS - 1));
+    if (cursor.col >= 0) {
+        cursor.col = MIN(next_shown(hidden, AXIS_COLS, cursor.col, 0),
+            NB_COLUMNS - 1);
+    }
+    if (cursor.row >= 0) {
+        cursor.row = MIN(next_shown(hidden, AXIS_ROWS, cursor.row, 0),
+            NB_ROWS - 1);
+    }
 }
 
 void
 deinit_termbox(void)
 {
+    pthread_mutex_lock(&tb_mutex);
+    tb_initialized = 0;
+    pthread_mutex_unlock(&tb_mutex);
+
     tb_shutdown();
+    if (headless_output) {
+        close(headless_fd);
+        fclose(headless_output);
+        headless_fd = -1;
+        headless_output = NULL;
+    }
+    if (null_fd >= 0) {
+        close(null_fd);
+        null_fd = -1;
+    }
+    close(frame_pipe[0]);
+    close(frame_pipe[1]);
+    frame_pipe[0] = frame_pipe[1] = -1;
     free(cells); cells = NULL;
+    free(col_xs); col_xs = NULL;
+    free(damaged); damaged = NULL;
+    free(spare_damaged); spare_damaged = NULL;
     free(hits); hits = NULL;
+    free(spare_cells); spare_cells = NULL;
+    free(spare_hits); spare_hits = NULL;
+    free(presented); presented = NULL;
+    free(spare_back); spare_back = NULL;
+    presented_length = 0;
+    buffers_capacity = col_xs_capacity = 0;
+    free_col_widths();
+    free_hidden();
 }
 
 int
@@ -92,62 +224,165 @@ init_termbox(void)
     // return a non-null result if terminal is too small
     int invalid_term_size;
 
-    tb_init();
+    if (!pipe(frame_pipe)) {
+        fcntl(frame_pipe[0], F_SETFL, O_NONBLOCK);
+        fcntl(frame_pipe[1], F_SETFL, O_NONBLOCK);
+    }
+    if (!is_headless) {
+        tb_init();
+    } else if ((headless_output = tmpfile())) {
+        init_headless();
+    }
     tb_set_clear_attrs(TB_COLOR_FG_DEFAULT, TB_COLOR_BG_DEFAULT);
 #ifdef TB_MOUSE_SUPPORT
     tb_set_input_mode(tb_set_input_mode(TB_INPUT_CURRENT) | TB_INPUT_MOUSE);
 #endif // TB_MOUSE_SUPPORT
     tb_set_output_mode(TB_OUTPUT_MODE);
-    invalid_term_size = set_term_size(tb_width(), tb_height());
+    can_scroll = HARDWARE_SCROLL && !tb_has_egc() &&
+        supports_scroll_regions() &&
+        (null_fd = open("/dev/null", O_WRONLY)) >= 0;
 
+    // cells answering the first view request must not be missed
     pthread_mutex_lock(&tb_mutex);
     tb_initialized = 1;
     pthread_mutex_unlock(&tb_mutex);
 
+    invalid_term_size = set_term_size(tb_width(), tb_height());
+    pop_headless_output();
     return invalid_term_size;
 }
 
 void
 move_to_cursor(void)
 {
-    static struct view old_view = {.sheet_id = -1};
-
     // TODO: manage sheet changes (view.sheet, view.*force)
+    char buf[32];
+    int end, start, width, x;
+    int64_t first, ordinal;
+    const struct hidden *hidden;
+    sheet_id sheet_id;
 
     // ensure address is valid
-    cursor.col = MAX(-1, MIN(cursor.col, NB_COLUMNS - 1));
-    cursor.row = MAX(-1, cursor.row);
+    clamp_cursor();
+    sheet_id = view.sheet_id;
+    hold_hidden(hidden = get_hidden(sheet_id));
+    release_hidden(view.hidden);
+    view.hidden = hidden;
 
-    // move view
-    if (cursor.col < view.xforce + xpad) {
-        view.xmin = view.xforce;
-    } else if (cursor.col >= NB_COLUMNS - xpad) {
-        view.xmin = NB_COLUMNS - view.xlen;
+    // move view, in ordinals of the shown rows and columns, ymin and xmin
+    // being shown
+    ordinal = shown_before(hidden, AXIS_ROWS, cursor.row);
+    if (cursor.row < 0 ||
+        ordinal < shown_before(hidden, AXIS_ROWS, view.yforce) + ypad) {
+        view.ymin = view.yforce;
     } else {
-        view.xmin = MIN(view.xmin, cursor.col - xpad);
-        view.xmin = MAX(view.xmin, cursor.col + xpad + 1 - view.xlen);
+        first = shown_before(hidden, AXIS_ROWS, view.ymin);
+        first = MIN(first, ordinal - ypad);
+        first = MAX(first, ordinal + ypad + 1 - view.ylen);
+        first = MIN(first, shown_before(hidden, AXIS_ROWS, NB_ROWS) -
+            view.ylen);
+        view.ymin = MAX(view.yforce, nth_shown(hidden, AXIS_ROWS, first));
     }
-    if (cursor.row < view.yforce + ypad) {
-        view.ymin = view.yforce;
+    view.ymin = next_shown(hidden, AXIS_ROWS, view.ymin, 0);
+
+    // row numbers are as wide as the last one in view, the grid being
+    // printed again when they widen or narrow
+    width = !ROWS_NB_WIDTH ? 0 : MAX(ROWS_NB_WIDTH, 1 + row_name(
+        get_view_row(view, view.yforce + view.ylen - 1) + 1, buf));
+    if (width != rows_nb_width) {
+        grid_width += rows_nb_width - width;
+        pthread_mutex_lock(&tb_mutex);
+        rows_nb_width = width;
+        is_grid_damaged = 1;
+        pthread_mutex_unlock(&tb_mutex);
+    }
+
+    // the columns from xmin, as many as fit in grid_width
+    ordinal = shown_before(hidden, AXIS_COLS, cursor.col);
+    if (cursor.col < 0 ||
+        ordinal < shown_before(hidden, AXIS_COLS, view.xforce) + xpad) {
+        view.xmin = view.xforce;
     } else {
-        view.ymin = MIN(view.ymin, cursor.row - ypad);
-        view.ymin = MAX(view.ymin, cursor.row + ypad + 1 - view.ylen);
+        // the first column from which the ones up to end fit
+        end = MIN(next_shown(hidden, AXIS_COLS, cursor.col, xpad + 1),
+            NB_COLUMNS);
+        start = col_position(sheet_id, end) - grid_width;
+        x = col_at(sheet_id, start);
+        x += col_position(sheet_id, x) < start;
+        view.xmin = MIN(view.xmin,
+            next_shown(hidden, AXIS_COLS, cursor.col, -xpad));
+        view.xmin = MAX(view.xforce, MIN(MAX(view.xmin, x), cursor.col));
     }
+    view.xmin = next_shown(hidden, AXIS_COLS, view.xmin, 0);
+    view.xlen = shown_before(hidden, AXIS_COLS, col_at(sheet_id,
+        col_position(sheet_id, view.xmin) + grid_width)) -
+        shown_before(hidden, AXIS_COLS, view.xmin);
 
     // if change in view, realloc and init buffers, query cache manager
-    if (!view_equal(old_view, view)) {
-        transfer_view_knowledge(&old_view, &view);
+    if (!view_equal(buffers_view, view) || is_view_outdated) {
+        is_view_outdated = 0;
+        place_view_cols();
+        if (cursor_content_found) {
+            value_unref(cursor_content.value);
+            cursor_content_found = 0;
+        }
+        pthread_mutex_lock(&tb_mutex);
+        if (!scroll_grid(&buffers_view, &view)) {
+            is_grid_damaged = 1;
+        }
+        transfer_view_knowledge(&buffers_view, &view);
+        hold_hidden(view.hidden);
+        release_hidden(buffers_view.hidden);
+        buffers_view = view;
+        pthread_mutex_unlock(&tb_mutex);
         get_view(view, cells, hits, address_of_cursor(cursor),
             &cursor_content, &cursor_content_found);
     }
 
-    // remember new view
-    old_view = view;
-
     // redraw grid
     print_grid();
 }
 
+void
+resize_cursor_col(int width)
+{
+    // set the width of the column of the cursor, the cells of which are
+    // displayed again
+    int j, nb_cols;
+
+    if (cursor.col < 0) {
+        return;
+    }
+    set_col_width(view.sheet_id, cursor.col, width);
+    redisplay_col(view.sheet_id, cursor.col);
+    pthread_mutex_lock(&tb_mutex);
+    if ((j = get_view_col_index(buffers_view, cursor.col)) >= 0) {
+        nb_cols = buffers_view.xforce + buffers_view.xlen;
+        for (int i = 0; i < buffers_view.yforce + buffers_view.ylen; i++) {
+            hits[i*nb_cols + j] = 0;
+        }
+    }
+    is_grid_damaged = is_view_outdated = 1;
+    pthread_mutex_unlock(&tb_mutex);
+
+    // the columns in view change, as well as grid_width for frozen ones
+    enforce_view_changes();
+}
+
+void
+set_lines_hidden(enum axis axis, int64_t first, int64_t end, int hidden)
+{
+    // hide or show the columns or rows of [first, end), the known cells
+    // moving to their new position
+    set_hidden(view.sheet_id, axis, first, end, hidden);
+    pthread_mutex_lock(&tb_mutex);
+    is_grid_damaged = 1;
+    pthread_mutex_unlock(&tb_mutex);
+
+    // the columns in view change, as well as grid_width for frozen ones
+    enforce_view_changes();
+}
+
 int
 set_force(int x, int y)
 {
@@ -174,10 +409,12 @@ set_term_size(int width, int height)
     // detect invalid terminal size
     term_height = height;
     term_width = width;
+    is_grid_damaged = 1;
     invalid_term_size = enforce_view_changes();
 
-    // redraw everything
+    // redraw everything, enforce_view_changes having printed the grid
     tb_clear();
+    is_grid_damaged = 1;
     if (invalid_term_size) {
         print_invalid_term_size();
     } else {
@@ -189,6 +426,78 @@ set_term_size(int width, int height)
     return invalid_term_size;
 }
 
+int
+frame_fd(void)
+{
+    // readable once a frame is requested from another thread
+    return frame_pipe[0];
+}
+
+struct frame_stats
+get_frame_stats(void)
+{
+    // of the headless frames presented since the last call
+    struct frame_stats res;
+
+    pthread_mutex_lock(&tb_mutex);
+    res = frame_stats;
+    memset(&frame_stats, 0, sizeof(frame_stats));
+    pthread_mutex_unlock(&tb_mutex);
+    return res;
+}
+
+int
+present_frame(void)
+{
+    // present the requested frame if FRAME_RATE allows it, return the delay
+    // in ms before it can be, or -1 if no frame is requested
+    // headless frames are presented right away, and measured
+    char buf[64];
+    double time;
+    int delay, is_due;
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    pthread_mutex_lock(&tb_mutex);
+    while (read(frame_pipe[0], buf, sizeof(buf)) > 0) {
+        continue;
+    }
+    delay = 1000/FRAME_RATE - (int) ((now.tv_sec - last_frame.tv_sec)*1000 +
+        (now.tv_nsec - last_frame.tv_nsec)/1000000);
+    is_due = is_frame_requested && (delay <= 0 || is_headless);
+    if (!is_frame_requested) {
+        delay = -1;
+    }
+    pthread_mutex_unlock(&tb_mutex);
+    if (!is_due) {
+        return delay < 0 ? delay : MAX(delay, 1);
+    }
+
+    // cells drawn meanwhile are printed first
+    if (is_cell_drawn) {
+        print_grid();
+    }
+    pthread_mutex_lock(&tb_mutex);
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    tb_present();
+    if (can_scroll) {
+        save_presented();
+    }
+    if (is_headless) {
+        time = frame_time + elapsed_since(&now);
+        frame_stats.cell_frames += is_cell_drawn;
+        frame_stats.frames++;
+        frame_stats.bytes += pop_headless_output();
+        frame_stats.max_time = MAX(frame_stats.max_time, time);
+        frame_stats.time += time;
+        frame_time = 0;
+    }
+    is_frame_requested = is_cell_drawn = 0;
+    last_frame = now;
+    pthread_mutex_unlock(&tb_mutex);
+    return -1;
+}
+
 void
 print_cell_data(void)
 {
@@ -198,52 +507,99 @@ print_cell_data(void)
 void
 print_command_status_line(void)
 {
-    // TODO
+    // TODO: status
+    int offset;
+
+    pthread_mutex_lock(&tb_mutex);
+    for (int x = 0; x < term_width; x++) {
+        tb_set_cell(x, term_height - 1, ' ', TB_COLOR_FG_DEFAULT,
+            TB_COLOR_BG_DEFAULT);
+    }
+    if (is_command_mode) {
+        // keep the end of the command visible
+        offset = MAX(0, (int) strlen(command) + 2 - term_width);
+        while ((command[offset] & 0xc0) == 0x80) {
+            offset++;
+        }
+        tb_printf(0, term_height - 1, TB_COLOR_FG_DEFAULT, TB_COLOR_BG_DEFAULT,
+            ":%s", command + offset);
+    }
+    pthread_mutex_unlock(&tb_mutex);
 }
 
 void
 print_grid(void)
 {
-    int index, x, y;
-    const struct cell_display *cell;
+    // only print the damaged parts of the grid: everything once the view or
+    // the screen changed, else the rows scrolled in, the headers and cells of
+    // the previous and new cursor positions, and the cells marked by
+    // draw_cell
+    int nb_cells, width;
+    char *p;
+    struct timespec start;
 
     pthread_mutex_lock(&tb_mutex);
+    if (is_headless) {
+        clock_gettime(CLOCK_MONOTONIC, &start);
+    }
+    nb_cells = get_view_length(view);
+    width = view.xforce + view.xlen;
+    if (is_grid_damaged) {
+        memset(damaged, 1, nb_cells);
+    } else if (cursor.col != drawn_col || cursor.row != drawn_row) {
+        damage(drawn_col, drawn_row);
+        damage(cursor.col, cursor.row);
+    }
+    if (!is_grid_damaged && exposed_first < exposed_end) {
+        memset(damaged + exposed_first*width, 1,
+            (exposed_end - exposed_first)*width);
+    }
 
-    // corner
+    // corner and headers
 #if ROWS_NB_WIDTH
-    memset(cell_buf, ' ', ROWS_NB_WIDTH);
-    cell_buf[ROWS_NB_WIDTH] = '\0';
+    memset(cell_buf, ' ', rows_nb_width);
+    cell_buf[rows_nb_width] = '\0';
     tb_print(0, CELL_DATA_HEIGHT, 0, cursor.col < 0 || cursor.row < 0 ?
         TB_COLOR_BG_CURSOR : TB_COLOR_BG_HEADERS, cell_buf);
 #endif // ROWS_NB_WIDTH
-
-    // columns header
-    memset(cell_buf, ' ', CELL_WIDTH);
-    for (int i = 0; i < view.xforce + view.xlen; i++) {
-        x = i < view.xforce ? i : view.xmin + i - view.xforce;
-        col_name(x, cell_buf + CELL_WIDTH/2 - 1);
-        tb_print(ROWS_NB_WIDTH + i*CELL_WIDTH, CELL_DATA_HEIGHT,
-            TB_COLOR_FG_HEADERS,
-            x == cursor.col ? TB_COLOR_BG_CURSOR : TB_COLOR_BG_HEADERS,
-            cell_buf);
-    }
-
-    // row numbers and cells
-    index = 0;
-    for (int i = 0; i < view.yforce + view.ylen; i++) {
-        y = i < view.yforce ? i : view.ymin + i - view.yforce;
-#if ROWS_NB_WIDTH
-        tb_printf(0, CELL_DATA_HEIGHT + 1 + i, TB_COLOR_FG_HEADERS,
-            y == cursor.row ? TB_COLOR_BG_CURSOR : TB_COLOR_BG_HEADERS,
-            "%*d ", ROWS_NB_WIDTH - 1, (y + 1)%ROWS_NB_MODULUS);
-#endif // ROWS_NB_WIDTH
+    if (is_grid_damaged) {
         for (int j = 0; j < view.xforce + view.xlen; j++) {
-            x = j < view.xforce ? j : view.xmin + j - view.xforce;
-            cell = hits[index] ? &cells[index] : &missing_cell;
-            tb_print(ROWS_NB_WIDTH + j*CELL_WIDTH, CELL_DATA_HEIGHT + 1 + i,
-                cell->fg, get_cell_bg(x, y), cell->ch);
-            index++;
+            print_col_header(j);
+        }
+        for (int i = 0; i < view.yforce + view.ylen; i++) {
+            print_row_number(i);
         }
+
+        // the right of the last column is left blank
+        for (int y = CELL_DATA_HEIGHT; y <= CELL_DATA_HEIGHT + view.yforce +
+            view.ylen; y++) {
+            for (int x = rows_nb_width + col_xs[view.xforce +
+                MAX(view.xlen, 0)]; x < term_width; x++) {
+                tb_set_cell(x, y, ' ', TB_COLOR_FG_DEFAULT,
+                    TB_COLOR_BG_DEFAULT);
+            }
+        }
+    } else {
+        print_col_header(get_view_col_index(view, drawn_col));
+        print_col_header(get_view_col_index(view, cursor.col));
+        print_row_number(get_view_row_index(view, drawn_row));
+        print_row_number(get_view_row_index(view, cursor.row));
+        for (int i = exposed_first; i < exposed_end; i++) {
+            print_row_number(i);
+        }
+    }
+    exposed_first = exposed_end = 0;
+
+    // cells
+    for (p = damaged; (p = memchr(p, 1, damaged + nb_cells - p)); p++) {
+        *p = 0;
+        print_view_cell(p - damaged);
+    }
+    is_grid_damaged = 0;
+    drawn_col = cursor.col;
+    drawn_row = cursor.row;
+    if (is_headless) {
+        frame_time += elapsed_since(&start);
     }
 
     pthread_mutex_unlock(&tb_mutex);
@@ -258,56 +614,469 @@ print_invalid_term_size(void)
 void
 refresh_terminal(void)
 {
+    // request a frame, presented by present_frame
     pthread_mutex_lock(&tb_mutex);
-    tb_present();
+    is_frame_requested = 1;
     pthread_mutex_unlock(&tb_mutex);
 }
 
+static void
+damage(int x, int64_t y)
+{
+    // mark the cell of column x and row y to be printed again, if in view
+    int i, j;
+
+    if ((i = get_view_row_index(view, y)) >= 0 &&
+        (j = get_view_col_index(view, x)) >= 0) {
+        damaged[i*(view.xforce + view.xlen) + j] = 1;
+    }
+}
+
+static double
+elapsed_since(const struct timespec *start)
+{
+    // in s
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec - start->tv_sec + (now.tv_nsec - start->tv_nsec)/1e9;
+}
+
 static int
 enforce_view_changes(void)
 {
-    int invalid_term_size;
-
-    view.xlen = (term_width - ROWS_NB_WIDTH)/CELL_WIDTH - view.xforce;
+    // view.xlen depends on the widths of the columns from view.xmin, and is
+    // set by move_to_cursor
+    grid_width = term_width - rows_nb_width -
+        col_position(view.sheet_id, view.xforce);
     view.ylen = term_height - (CELL_DATA_HEIGHT + 2 + view.yforce);
-    invalid_term_size = view.xlen < 1 || view.ylen < 1 ||
-        term_width < CELL_DATA_MINIMUM_WIDTH ||
-        term_width < COMMAND_MINIMUM_WIDTH + STATUS_WIDTH;
-    xpad = MIN(XPAD, (view.xlen - 1)/2);
+    xpad = MIN(XPAD, (grid_width/CELL_WIDTH - 1)/2);
     ypad = MIN(YPAD, (view.ylen - 1)/2);
     move_to_cursor();
 
-    return invalid_term_size;
+    return view.xlen < 1 || view.ylen < 1 ||
+        term_width < CELL_DATA_MINIMUM_WIDTH ||
+        term_width < COMMAND_MINIMUM_WIDTH + STATUS_WIDTH;
+}
+
+static void
+fit_cell_buf(const char *s, int len, int width, int offset)
+{
+    // set cell_buf to width characters, s being copied from offset
+    memset(cell_buf, ' ', width);
+    memcpy(cell_buf + offset, s, MAX(0, MIN(len, width - offset)));
+    cell_buf[width] = '\0';
+}
+
+static int
+format_cell_number(double number, int width, char buf[])
+{
+    // write number in buf (of length 32) and return its length, at most
+    // width if possible: the shortest representation read back as number,
+    // else number rounded to the decimals that fit, else with an exponent,
+    // else width '#' rather than a truncated number
+    // screens of numbers are formatted again on every refill, so results are
+    // memoized by width, the only format so far
+    char exponent_buf[8];
+    int exponent, is_fixed, len, nb_decimals, nb_digits;
+    double magnitude, mantissa, scale;
+    uint64_t bits, h;
+    struct formatted_number *memo;
+
+    // murmur3 finalizer, as the low bits of numbers are often null
+    memcpy(&bits, &number, sizeof(bits));
+    h = bits ^ (uint64_t) width;
+    h = (h ^ (h >> 33))*0xff51afd7ed558ccdu;
+    h = (h ^ (h >> 33))*0xc4ceb9fe1a85ec53u;
+    memo = &formatted_numbers[(h ^ (h >> 33)) % FORMAT_MEMO_SIZE];
+    pthread_mutex_lock(&formatted_numbers_mutex);
+    if (memo->width == width && memo->bits == bits) {
+        len = memo->len;
+        memcpy(buf, memo->s, len + 1);
+        pthread_mutex_unlock(&formatted_numbers_mutex);
+        return len;
+    }
+    pthread_mutex_unlock(&formatted_numbers_mutex);
+
+    // numbers of more than 15 significant digits do not fit in narrower
+    // columns, where they are rounded right away
+    magnitude = fabs(number);
+    is_fixed = magnitude >= 1e-3 && magnitude < 1e15;
+    len = is_fixed && width < 16 ? width + 1 : format_number(number, buf);
+    if (len > width && is_fixed) {
+        // the decimals left by the sign and the integer part, 15 significant
+        // digits at most, if one of them is not null
+        for (nb_digits = 1, scale = 10; magnitude >= scale; nb_digits++) {
+            scale *= 10;
+        }
+        nb_decimals = MAX(0, MIN(width - !!signbit(number) - nb_digits - 1,
+            15 - nb_digits));
+        scale = 1;
+        for (int i = 0; i < nb_decimals; i++) {
+            scale *= 10;
+        }
+        if (magnitude*scale >= 1) {
+            len = format_fixed(number, nb_decimals, buf);
+        }
+    }
+
+    // with an exponent, the mantissa in [1, 10) being rounded to the
+    // decimals left
+    if (len > width && magnitude && isfinite(number)) {
+        mantissa = decimal_mantissa(magnitude, &exponent);
+        nb_decimals = MAX(0, MIN(width - !!signbit(number) - 2 -
+            format_exponent(exponent, exponent_buf), 14));
+        len = format_fixed(copysign(mantissa, number), nb_decimals, buf);
+        if (!strcmp(buf + !!signbit(number), "10")) {
+            buf[--len] = '\0';
+            exponent++;
+        }
+        len += format_exponent(exponent, buf + len);
+    }
+    if (len > width) {
+        memset(buf, '#', width);
+        buf[len = width] = '\0';
+    }
+
+    pthread_mutex_lock(&formatted_numbers_mutex);
+    memo->bits = bits;
+    memo->width = width;
+    memo->len = len;
+    memcpy(memo->s, buf, len + 1);
+    pthread_mutex_unlock(&formatted_numbers_mutex);
+    return len;
 }
 
 static uintattr_t
-get_cell_bg(int x, int y)
+get_cell_bg(int x, int64_t y)
 {
     return x == cursor.col && y == cursor.row ? TB_COLOR_BG_CURSOR :
         TB_COLOR_BG_DEFAULT;
 }
 
+static void
+init_headless(void)
+{
+    // termbox takes its size from a terminal: a pseudo-terminal of the bench
+    // size, whose file descriptor is then replaced by a duplicate of
+    // headless_output, so that frames are written there
+    // TERM is set so that the numbers do not depend on it
+    int master;
+    struct winsize size = {.ws_row = bench_height, .ws_col = bench_width};
+
+    setenv("TERM", "xterm", 1);
+    if ((master = posix_openpt(O_RDWR | O_NOCTTY)) < 0) {
+        return;
+    }
+    if (!grantpt(master) && !unlockpt(master) &&
+        !ioctl(master, TIOCSWINSZ, &size) &&
+        (headless_fd = open(ptsname(master), O_RDWR | O_NOCTTY)) >= 0 &&
+        tb_init_fd(headless_fd) == TB_OK) {
+        dup2(fileno(headless_output), headless_fd);
+    }
+    close(master);
+}
+
+static long
+pop_headless_output(void)
+{
+    // return the number of bytes written to the headless output since the
+    // last call, discarding them
+    int fd;
+    off_t res;
+
+    if (!headless_output) {
+        return 0;
+    }
+    fd = fileno(headless_output);
+    res = lseek(fd, 0, SEEK_CUR);
+    ftruncate(fd, 0);
+    lseek(fd, 0, SEEK_SET);
+    return MAX(res, 0);
+}
+
+static void
+place_view_cols(void)
+{
+    // set the offsets of the columns of the view from the first one, and of
+    // the end of the last one
+    int nb_cols;
+
+    nb_cols = view.xforce + MAX(view.xlen, 0);
+    if (nb_cols + 1 > col_xs_capacity) {
+        col_xs_capacity = nb_cols + 1;
+        col_xs = realloc(col_xs, col_xs_capacity*sizeof(*col_xs));
+    }
+    col_xs[0] = 0;
+    for (int j = 0; j < nb_cols; j++) {
+        col_xs[j + 1] = col_xs[j] + col_width(view.sheet_id,
+            get_view_col(view, j));
+    }
+}
+
+static int
+present_silently(void)
+{
+    // present the back buffer to termbox's front buffer only, the output
+    // being discarded
+    int fd, resize_fd, rv, saved;
+
+    tb_get_fds(&fd, &resize_fd);
+    if ((saved = dup(fd)) < 0) {
+        return TB_ERR;
+    }
+    dup2(null_fd, fd);
+    rv = tb_present();
+    dup2(saved, fd);
+    close(saved);
+    return rv;
+}
+
+static void
+print_col_header(int j)
+{
+    // of the j-th column of the view, if any, its name being centered, and
+    // cut to its last letters if too long
+    char name[16];
+    int len, width, x;
+
+    if (j < 0) {
+        return;
+    }
+    x = get_view_col(view, j);
+    width = col_xs[j + 1] - col_xs[j];
+    len = col_name(x, name);
+    fit_cell_buf(name + MAX(0, len - width), MIN(len, width), width,
+        MAX(0, (width - len)/2));
+    tb_print(rows_nb_width + col_xs[j], CELL_DATA_HEIGHT,
+        TB_COLOR_FG_HEADERS,
+        x == cursor.col ? TB_COLOR_BG_CURSOR : TB_COLOR_BG_HEADERS,
+        cell_buf);
+}
+
+static void
+print_row_number(int i)
+{
+    // of the i-th row of the view, if any
+#if ROWS_NB_WIDTH
+    char buf[32];
+    int len;
+    int64_t y;
+
+    if (i < 0) {
+        return;
+    }
+    y = get_view_row(view, i);
+    len = format_integer(y + 1, buf);
+    fit_cell_buf(buf, len, rows_nb_width, MAX(0, rows_nb_width - 1 - len));
+    tb_print(0, CELL_DATA_HEIGHT + 1 + i, TB_COLOR_FG_HEADERS,
+        y == cursor.row ? TB_COLOR_BG_CURSOR : TB_COLOR_BG_HEADERS, cell_buf);
+#else
+    (void) i;
+#endif // ROWS_NB_WIDTH
+}
+
+static void
+print_view_cell(int index)
+{
+    // missing cells are shown as a centered "miss"
+    int i, j, width;
+    uintattr_t fg;
+    struct address address;
+
+    i = index/(view.xforce + view.xlen);
+    j = index%(view.xforce + view.xlen);
+    width = col_xs[j + 1] - col_xs[j];
+    address = get_view_address(view, index);
+    if (hits[index]) {
+        fit_cell_buf(cells[index].ch, strlen(cells[index].ch), width, 0);
+        fg = cells[index].fg;
+    } else {
+        fit_cell_buf("miss", 4, width, MAX(0, (width - 4)/2));
+        fg = TB_COLOR_FG_MISS;
+    }
+    tb_print(rows_nb_width + col_xs[j], CELL_DATA_HEIGHT + 1 + i, fg,
+        get_cell_bg(address.col, address.row), cell_buf);
+}
+
+static void
+save_presented(void)
+{
+    // copy the back buffer just presented, which termbox's front buffer now
+    // matches, for scroll_terminal
+    int length;
+
+    length = tb_width()*tb_height();
+    if (length != presented_length) {
+        presented = realloc(presented, length*sizeof(*presented));
+        spare_back = realloc(spare_back, length*sizeof(*spare_back));
+        presented_length = length;
+    }
+    memcpy(presented, tb_cell_buffer(), length*sizeof(*presented));
+}
+
+static int
+scroll_grid(const struct view *old, const struct view *new)
+{
+    // shift the non-frozen rows on the terminal when only ymin changed, so
+    // that only the rows scrolled in are printed, return a non-null result
+    // if done
+    int64_t dy;
+
+    dy = shown_before(new->hidden, AXIS_ROWS, new->ymin) -
+        shown_before(old->hidden, AXIS_ROWS, old->ymin);
+    if (is_grid_damaged || !dy ||
+        old->sheet_id != new->sheet_id || old->xforce != new->xforce ||
+        old->xlen != new->xlen || old->xmin != new->xmin ||
+        old->yforce != new->yforce || old->ylen != new->ylen ||
+        llabs(dy) >= new->ylen || !scroll_terminal(CELL_DATA_HEIGHT + 1 +
+        new->yforce, new->ylen, dy)) {
+        return 0;
+    }
+    exposed_first = dy > 0 ? new->yforce + new->ylen - dy : new->yforce;
+    exposed_end = exposed_first + llabs(dy);
+    return 1;
+}
+
+static int
+scroll_terminal(int y, int h, int n)
+{
+    // scroll the rows y to y + h - 1 by n rows (up if n > 0, down if n < 0)
+    // with a scroll region, return a non-null result if done
+    // termbox cannot scroll: its front buffer is set to the last frame
+    // scrolled by a silent present, and its back buffer is scrolled alike,
+    // so that the next frame only sends the rows scrolled in
+    int length, rv, width;
+    struct tb_cell *back;
+    const struct tb_cell blank = {
+        .ch = ' ',
+        .fg = TB_COLOR_FG_DEFAULT,
+        .bg = TB_COLOR_BG_DEFAULT,
+    };
+    const struct tb_cell invalid = {.ch = -1, .fg = -1, .bg = -1};
+
+    length = (width = tb_width())*tb_height();
+    if (!can_scroll || length != presented_length ||
+        !(back = tb_cell_buffer())) {
+        return 0;
+    }
+
+    // rows scrolled in are invalid in the front buffer, so that the next
+    // frame sends them whatever they hold
+    memcpy(spare_back, back, length*sizeof(*back));
+    memcpy(back, presented, length*sizeof(*back));
+    shift_rows(back, width, y, h, n, invalid);
+    rv = present_silently();
+    memcpy(presented, back, length*sizeof(*back));
+    memcpy(back, spare_back, length*sizeof(*back));
+    if (rv != TB_OK) {
+        tb_invalidate();
+        return 0;
+    }
+    shift_rows(back, width, y, h, n, blank);
+
+    // rows scrolled in take the current attributes, which are reset, so
+    // termbox must set them again
+    tb_sendf("\x1b[m\x1b[%d;%dr\x1b[%dH", y + 1, y + h, n > 0 ? y + h : y + 1);
+    for (int i = 0; i < abs(n); i++) {
+        tb_send(n > 0 ? "\033D" : "\033M", 2);
+    }
+    tb_send("\x1b[r", 3);
+    tb_set_output_mode(tb_set_output_mode(TB_OUTPUT_CURRENT));
+    return 1;
+}
+
+static void
+shift_rows(struct tb_cell *buf, int width, int y, int h, int n,
+    struct tb_cell exposed)
+{
+    // shift the rows y to y + h - 1 of buf by n rows up (down if n < 0),
+    // the rows scrolled in being filled with exposed
+    int first;
+
+    memmove(&buf[(n > 0 ? y : y - n)*width], &buf[(n > 0 ? y + n : y)*width],
+        (h - abs(n))*width*sizeof(*buf));
+    first = n > 0 ? y + h - n : y;
+    for (int i = first*width; i < (first + abs(n))*width; i++) {
+        buf[i] = exposed;
+    }
+}
+
+static int
+supports_scroll_regions(void)
+{
+    // by TERM, for terminals known to have scroll regions (DECSTBM) and to
+    // scroll them (IND, RI)
+    static const char *terms[] = {
+        "alacritty", "foot", "kitty", "linux", "rxvt", "screen", "st",
+        "tmux", "vt1", "vt2", "vt3", "vt4", "vt5", "wezterm", "xterm",
+    };
+    const char *term;
+
+    if (!(term = getenv("TERM"))) {
+        return 0;
+    }
+    for (size_t i = 0; i < sizeof(terms)/sizeof(*terms); i++) {
+        if (!strncmp(term, terms[i], strlen(terms[i]))) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
 static void
 transfer_view_knowledge(struct view *old, struct view *new)
 {
-    // use old buffers to create new ones
-    int view_length;
-    struct cell_display *new_cells;
-    int *new_hits;
+    // move the cells of old still in new to their new position, through
+    // spare buffers swapped with the current ones, and only reallocated when
+    // the view grows
+    int i_old, *j_olds, k, old_width, view_length, width;
+    char *tmp_damaged;
+    int *tmp_hits;
+    struct cell_display *tmp_cells;
 
-    // allocate new buffers
-    view_length = get_view_length(*new);
-    new_cells = malloc(view_length*sizeof(*new_cells));
-    new_hits = calloc(view_length, sizeof(*new_hits));
+    view_length = MAX(get_view_length(*new), 0);
+    if (view_length > buffers_capacity) {
+        buffers_capacity = view_length;
+        cells = realloc(cells, buffers_capacity*sizeof(*cells));
+        hits = realloc(hits, buffers_capacity*sizeof(*hits));
+        spare_cells = realloc(spare_cells,
+            buffers_capacity*sizeof(*spare_cells));
+        spare_hits = realloc(spare_hits, buffers_capacity*sizeof(*spare_hits));
+        damaged = realloc(damaged, buffers_capacity);
+        spare_damaged = realloc(spare_damaged, buffers_capacity);
+    }
+    memset(spare_damaged, 0, view_length);
+    memset(spare_hits, 0, view_length*sizeof(*spare_hits));
 
-    // copy known cells
-    if (old->sheet_id != new->sheet_id) {
-        goto end_copy;
+    // copy known cells, frozen rows and columns included, the columns of old
+    // being matched once
+    if (old->sheet_id == new->sheet_id) {
+        width = new->xforce + new->xlen;
+        old_width = old->xforce + old->xlen;
+        j_olds = malloc(MAX(width, 1)*sizeof(*j_olds));
+        for (int j = 0; j < width; j++) {
+            j_olds[j] = get_view_col_index(*old, get_view_col(*new, j));
+        }
+        for (int i = 0; i < new->yforce + new->ylen; i++) {
+            if ((i_old = get_view_row_index(*old,
+                get_view_row(*new, i))) < 0) {
+                continue;
+            }
+            for (int j = 0; j < width; j++) {
+                k = i_old*old_width + j_olds[j];
+                if (j_olds[j] < 0 || !hits[k]) {
+                    continue;
+                }
+                spare_cells[i*width + j] = cells[k];
+                spare_damaged[i*width + j] = damaged[k];
+                spare_hits[i*width + j] = 1;
+            }
+        }
+        free(j_olds);
     }
-    // TODO
-end_copy:
 
-    // destroy old buffers
-    free(cells); cells = new_cells;
-    free(hits); hits = new_hits;
+    tmp_cells = cells; cells = spare_cells; spare_cells = tmp_cells;
+    tmp_damaged = damaged; damaged = spare_damaged; spare_damaged = tmp_damaged;
+    tmp_hits = hits; hits = spare_hits; spare_hits = tmp_hits;
 }
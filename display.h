@@ -1,17 +1,33 @@
 #ifndef DISPLAY_H
 #define DISPLAY_H
 
+#include <stdint.h>
+
+#include "hidden.h"
 #include "types.h"
 
+struct frame_stats {
+    int cell_frames, frames; // cell frames present the cells drawn meanwhile
+    long bytes; // written to the terminal
+    double max_time, time; // s spent printing and presenting the grid
+};
+
 struct cell_display display_cell(const struct cell_content *cell);
-void draw_cell(const struct cell_content *cell);
+void draw_cell(struct address address, const struct cell_display *display);
 
+void clamp_cursor(void);
 void deinit_termbox(void);
 int init_termbox(void);
 void move_to_cursor(void);
+void resize_cursor_col(int width);
+void set_lines_hidden(enum axis axis, int64_t first, int64_t end,
+    int hidden);
 int set_force(int x, int y);
 int set_term_size(int width, int height);
 
+int frame_fd(void);
+struct frame_stats get_frame_stats(void);
+int present_frame(void);
 void print_cell_data(void);
 void print_command_status_line(void);
 void print_grid(void);
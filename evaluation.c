@@ -0,0 +1,802 @@
+// formulas are evaluated lazily: a modification only marks the dependent
+// formulas as dirty, and they are computed on demand (see evaluate) or in the
+// background, from the oldest to the most recent (see evaluate_next_dirty_cell)
+// the aggregate of each referenced range is kept up to date by applying the
+// value changes of its cells as deltas, instead of scanning it again
+// the ranges intersecting an area (the ones to invalidate, or whose aggregate
+// to update) are found from an index of their columns
+
+#include <math.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "config.h"
+#include "evaluation.h"
+#include "kernels.h"
+#include "lookup.h"
+#include "storage.h"
+#include "types.h"
+
+struct column_entry {
+    // column of a registered range, valid while the range keeps its stamp
+    sheet_id sheet_id;
+    int col, range, stamp;
+    int64_t row, max_end; // largest end row of the column up to the entry
+};
+
+struct range_entry {
+    // formulas cells whose range is the same
+    struct area range;
+    struct address *dependents;
+    int nb_dependents, capacity;
+    int next; // index of the next entry of the same bucket, or -1
+    // if is_aggregated, aggregate (except min and max if !is_extremum_valid),
+    // nb_dirty and nb_errors describe the cells of range
+    int is_aggregated, is_extremum_valid, nb_dirty, nb_errors;
+    double compensation; // of aggregate.sum, see add_to_sum
+    struct aggregate aggregate;
+    // built by the first lookup on range, requires is_aggregated
+    struct lookup_index *index;
+    int stamp; // of its column entries
+};
+
+static void add_to_sum(struct range_entry *entry, double x);
+static int append_found(int **found, int *capacity, int n, int range);
+static void build_aggregate(struct range_entry *entry);
+static void build_column_index(void);
+static int compare_column_entries(const void *a, const void *b);
+static struct value compute(const struct formula *formula);
+static void define_cells(const struct definition *definition);
+static void drop_aggregate(struct range_entry *entry);
+static int evaluate_precedent(struct address address, void *arg);
+static int find_column_entry(sheet_id sheet_id, int col, int64_t row,
+    int is_by_end);
+static int find_ranges(struct area area, int **found, int *capacity);
+static struct range_entry *find_range_entry(struct area range);
+static int *get_bucket(struct area range);
+static void index_range(int i);
+static void invalidate_dependents(struct area area);
+static void link_range_entry(int i);
+static void mark_dirty(struct address address);
+static void register_formula(struct address address, struct area range);
+static void set_cell_flags(struct address address, int flags);
+static void set_cell_value(struct address address, struct value value);
+static void unlink_range_entry(int i);
+static void unregister_formula(struct address address, struct area range);
+static void update_aggregate(struct range_entry *entry, struct value old,
+    struct value new);
+
+static int nb_aggregated, nb_buckets, nb_ranges, ranges_capacity;
+static int nb_columns, columns_capacity, nb_listed, listed_capacity;
+static int found_capacity, nb_pending, nb_stale, last_stamp;
+static int *found; // indexes of the ranges returned by find_ranges
+static struct column_entry *columns; // by sheet, column then first row
+// registered since the columns were indexed, or wider than
+// INDEX_MAX_COLS, tested one by one
+static struct column_entry *listed;
+static int *buckets; // heads of the chains of range entries, by range hash
+static size_t dirty_head, dirty_tail, dirty_capacity;
+static struct address *dirty_queue;
+static struct range_entry *ranges;
+
+void
+apply_definition(const struct definition *definition)
+{
+    int n;
+    struct area area;
+
+    area = definition->area;
+
+    // large definitions are cheaper to aggregate and index again than to
+    // apply by deltas
+    if (nb_aggregated && (area.row_span > 1 || area.col_span > 1)) {
+        n = find_ranges(area, &found, &found_capacity);
+        for (int i = 0; i < n; i++) {
+            drop_aggregate(&ranges[found[i]]);
+        }
+    }
+    define_cells(definition);
+    invalidate_dependents(area);
+}
+
+void
+apply_values(struct area area, const struct value *values)
+{
+    // set the cells of area to values, given column by column, in bulk
+    int n, nb_formulas, formulas_capacity;
+    struct address address, *formulas;
+
+    if (nb_aggregated) {
+        n = find_ranges(area, &found, &found_capacity);
+        for (int i = 0; i < n; i++) {
+            drop_aggregate(&ranges[found[i]]);
+        }
+    }
+
+    // remove the overwritten formulas, found from the registry rather than
+    // from every cell of area
+    formulas = NULL;
+    nb_formulas = formulas_capacity = 0;
+    for (int i = 0; i < nb_ranges; i++) {
+        for (int j = 0; j < ranges[i].nb_dependents; j++) {
+            address = ranges[i].dependents[j];
+            if (!address_in_area(address, area)) {
+                continue;
+            }
+            if (nb_formulas == formulas_capacity) {
+                formulas_capacity = formulas_capacity ?
+                    2*formulas_capacity : 16;
+                formulas = realloc(formulas,
+                    formulas_capacity*sizeof(*formulas));
+            }
+            formulas[nb_formulas++] = address;
+        }
+    }
+    for (int i = 0; i < nb_formulas; i++) {
+        unregister_formula(formulas[i],
+            storage_get_formula(formulas[i])->range);
+        storage_set_formula(formulas[i], NULL);
+    }
+    free(formulas);
+
+    address.sheet_id = area.sheet_id;
+    address.row = area.row;
+    for (int j = 0; j < area.col_span; j++) {
+        address.col = area.col + j;
+        storage_set_values(address, values + (size_t) j*area.row_span,
+            area.row_span, CELL_UNSENT);
+    }
+    invalidate_dependents(area);
+}
+
+struct value
+evaluate(struct address address)
+{
+    // return the up-to-date value at address, after having computed its
+    // dirty precedents if needed
+    int flags;
+    struct value value;
+
+    flags = storage_get_flags(address);
+    if (!(flags & CELL_DIRTY)) {
+        return storage_get_value(address);
+    } else if (flags & CELL_EVALUATING) {
+        return (struct value) {.type = VALUE_ERROR, .as.error = ERROR_CYCLE};
+    }
+
+    storage_set_flags(address, flags | CELL_EVALUATING);
+    value = compute(storage_get_formula(address));
+    flags = storage_get_flags(address) & ~(CELL_DIRTY | CELL_EVALUATING);
+    if (!value_equal(storage_get_value(address), value)) {
+        set_cell_value(address, value);
+        flags |= CELL_UNSENT;
+    }
+    set_cell_flags(address, flags);
+    return value;
+}
+
+int
+evaluate_next_dirty_cell(void)
+{
+    // return a null result if there is no dirty cell left
+    struct address address;
+
+    while (dirty_head < dirty_tail) {
+        address = dirty_queue[dirty_head++];
+        if (storage_get_flags(address) & CELL_DIRTY) {
+            evaluate(address);
+            return 1;
+        }
+    }
+    dirty_head = dirty_tail = 0;
+    return 0;
+}
+
+int
+has_dirty_cells(void)
+{
+    return dirty_head < dirty_tail;
+}
+
+void
+load_definition(const struct definition *definition)
+{
+    // apply_definition, for definitions loaded before any evaluation: the
+    // dependents are dirty already
+    define_cells(definition);
+}
+
+void
+load_formula(struct address address, const struct formula *formula,
+    int is_dirty)
+{
+    // set the formula of a cell loaded with its last computed value, only
+    // computed again if is_dirty
+    storage_set_formula(address, formula);
+    register_formula(address, formula->range);
+    if (is_dirty) {
+        mark_dirty(address);
+    }
+}
+
+static void
+add_to_sum(struct range_entry *entry, double x)
+{
+    // Neumaier summation, so that deltas do not accumulate rounding errors
+    double t;
+
+    t = entry->aggregate.sum + x;
+    if (fabs(entry->aggregate.sum) >= fabs(x)) {
+        entry->compensation += (entry->aggregate.sum - t) + x;
+    } else {
+        entry->compensation += (x - t) + entry->aggregate.sum;
+    }
+    entry->aggregate.sum = t;
+}
+
+static int
+append_found(int **found, int *capacity, int n, int range)
+{
+    // append range to the n indexes of *found, return their new number
+    if (n == *capacity) {
+        *capacity = *capacity ? 2**capacity : 16;
+        *found = realloc(*found, *capacity*sizeof(**found));
+    }
+    (*found)[n] = range;
+    return n + 1;
+}
+
+static void
+build_aggregate(struct range_entry *entry)
+{
+    // the cells of the range must not be dirty
+    struct value error;
+
+    nb_aggregated += !entry->is_aggregated;
+    aggregate_init(&entry->aggregate);
+    storage_aggregate(entry->range, &entry->aggregate);
+    entry->compensation = 0;
+    entry->nb_errors = storage_find_error(entry->range, &error);
+    entry->nb_dirty = 0;
+    entry->is_aggregated = entry->is_extremum_valid = 1;
+}
+
+static void
+build_column_index(void)
+{
+    // index the columns of the ranges again, without the stale entries
+    struct area range;
+
+    nb_columns = nb_listed = nb_pending = nb_stale = 0;
+    for (int i = 0; i < nb_ranges; i++) {
+        index_range(i);
+    }
+    for (int i = 0; i < nb_listed; ) {
+        range = ranges[listed[i].range].range;
+        if (range.col_span > INDEX_MAX_COLS) {
+            i++;
+            continue;
+        }
+        if (nb_columns + range.col_span > columns_capacity) {
+            columns_capacity = MAX(2*columns_capacity,
+                nb_columns + range.col_span);
+            columns = realloc(columns, columns_capacity*sizeof(*columns));
+        }
+        for (int j = 0; j < range.col_span; j++) {
+            columns[nb_columns++] = (struct column_entry) {
+                .sheet_id = range.sheet_id,
+                .col = range.col + j,
+                .range = listed[i].range,
+                .stamp = listed[i].stamp,
+                .row = range.row,
+            };
+        }
+        listed[i] = listed[--nb_listed];
+    }
+    qsort(columns, nb_columns, sizeof(*columns), compare_column_entries);
+    for (int i = 0; i < nb_columns; i++) {
+        range = ranges[columns[i].range].range;
+        columns[i].max_end = range.row + range.row_span;
+        if (i && columns[i - 1].sheet_id == columns[i].sheet_id &&
+            columns[i - 1].col == columns[i].col) {
+            columns[i].max_end = MAX(columns[i].max_end,
+                columns[i - 1].max_end);
+        }
+    }
+    nb_pending = 0;
+}
+
+static int
+compare_column_entries(const void *a, const void *b)
+{
+    const struct column_entry *x = a, *y = b;
+
+    if (x->sheet_id != y->sheet_id) {
+        return x->sheet_id < y->sheet_id ? -1 : 1;
+    } else if (x->col != y->col) {
+        return x->col < y->col ? -1 : 1;
+    }
+    return (x->row > y->row) - (x->row < y->row);
+}
+
+static struct value
+compute(const struct formula *formula)
+{
+    int64_t position;
+    struct aggregate *aggregate;
+    struct range_entry *entry;
+    struct value value;
+
+    // compute dirty precedents first
+    entry = find_range_entry(formula->range);
+    if (!entry->is_aggregated || entry->nb_dirty) {
+        if (storage_visit_flagged(formula->range, CELL_DIRTY,
+            evaluate_precedent, NULL)) {
+            return (struct value) {
+                .type = VALUE_ERROR,
+                .as.error = ERROR_CYCLE,
+            };
+        }
+    }
+
+    // make sure the aggregate is usable, and check for errors
+    if (!entry->is_aggregated || (!entry->is_extremum_valid &&
+        (formula->function == FUNCTION_MAX ||
+        formula->function == FUNCTION_MIN))) {
+        build_aggregate(entry);
+    }
+    if (entry->nb_errors && formula->function != FUNCTION_MATCH_APPROX &&
+        formula->function != FUNCTION_MATCH_EXACT) {
+        storage_find_error(formula->range, &value);
+        return value;
+    }
+
+    aggregate = &entry->aggregate;
+    value.type = VALUE_NUMBER;
+    switch (formula->function) {
+    case FUNCTION_MATCH_APPROX:
+    case FUNCTION_MATCH_EXACT:
+        if (!entry->index) {
+            entry->index = lookup_index_create(entry->range);
+        }
+        if (formula->function == FUNCTION_MATCH_EXACT) {
+            position = lookup_exact(entry->index, formula->key);
+        } else if (formula->key.type == VALUE_NUMBER) {
+            position = lookup_approx(entry->index, formula->key.as.number);
+        } else {
+            position = -1;
+        }
+        if (position < 0) {
+            return (struct value) {.type = VALUE_ERROR, .as.error = ERROR_NA};
+        }
+        value.as.number = position + 1;
+        break;
+    case FUNCTION_AVERAGE:
+        if (!aggregate->count) {
+            return (struct value) {.type = VALUE_ERROR, .as.error = ERROR_DIV0};
+        }
+        value.as.number = (aggregate->sum + entry->compensation)/
+            aggregate->count;
+        break;
+    case FUNCTION_COUNT:
+        value.as.number = aggregate->count;
+        break;
+    case FUNCTION_MAX:
+        value.as.number = aggregate->count ? aggregate->max : 0;
+        break;
+    case FUNCTION_MIN:
+        value.as.number = aggregate->count ? aggregate->min : 0;
+        break;
+    default:
+        value.as.number = aggregate->sum + entry->compensation;
+        break;
+    }
+    return value;
+}
+
+static void
+define_cells(const struct definition *definition)
+{
+    // store definition, without invalidating its dependents
+    int flags, is_formula;
+    const struct formula *old;
+    struct address address;
+    struct area area;
+
+    area = definition->area;
+    is_formula = definition->formula.function != FUNCTION_NONE;
+
+    address.sheet_id = area.sheet_id;
+    for (int j = 0; j < area.col_span; j++) {
+        address.col = area.col + j;
+        for (int64_t i = 0; i < area.row_span; i++) {
+            address.row = area.row + i;
+            if ((old = storage_get_formula(address))) {
+                unregister_formula(address, old->range);
+            }
+            if (is_formula) {
+                storage_set_formula(address, &definition->formula);
+                register_formula(address, definition->formula.range);
+                mark_dirty(address);
+                continue;
+            }
+            storage_set_formula(address, NULL);
+            flags = storage_get_flags(address) & ~CELL_DIRTY;
+            if (!value_equal(storage_get_value(address), definition->value)) {
+                set_cell_value(address, definition->value);
+                flags |= CELL_UNSENT;
+            }
+            set_cell_flags(address, flags);
+        }
+    }
+}
+
+static void
+drop_aggregate(struct range_entry *entry)
+{
+    nb_aggregated -= entry->is_aggregated;
+    entry->is_aggregated = 0;
+    lookup_index_destroy(entry->index); entry->index = NULL;
+}
+
+static int
+evaluate_precedent(struct address address, void *arg)
+{
+    // return a non-null result if a cycle is detected
+    if (storage_get_flags(address) & CELL_EVALUATING) {
+        return 1;
+    }
+    evaluate(address);
+    return 0;
+}
+
+static int
+find_column_entry(sheet_id sheet_id, int col, int64_t row, int is_by_end)
+{
+    // return the index of the first column entry from (sheet_id, col, row)
+    // on, by first row or by largest end row so far: both increase
+    int high, low, mid;
+    int64_t key;
+    const struct column_entry *entry;
+
+    low = 0;
+    high = nb_columns;
+    while (low < high) {
+        mid = low + (high - low)/2;
+        entry = &columns[mid];
+        key = is_by_end ? entry->max_end : entry->row;
+        if (entry->sheet_id < sheet_id || (entry->sheet_id == sheet_id &&
+            (entry->col < col || (entry->col == col && key < row)))) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+    return low;
+}
+
+static int
+find_ranges(struct area area, int **found, int *capacity)
+{
+    // set *found (of length *capacity) to the indexes of the ranges
+    // intersecting area, return their number
+    int first, last, n;
+    struct area range;
+    const struct column_entry *entry;
+
+    // wide areas are cheaper to test against every range
+    n = 0;
+    if (area.col_span > INDEX_MAX_COLS) {
+        for (int i = 0; i < nb_ranges; i++) {
+            if (area_intersect(area, ranges[i].range)) {
+                n = append_found(found, capacity, n, i);
+            }
+        }
+        return n;
+    }
+
+    // index again once the listed or stale entries cost more than it
+    if ((int64_t) nb_pending*nb_pending > nb_columns ||
+        2*nb_stale > nb_columns + nb_listed) {
+        build_column_index();
+    }
+    for (int i = 0; i < nb_listed; i++) {
+        if (listed[i].range < nb_ranges &&
+            ranges[listed[i].range].stamp == listed[i].stamp &&
+            area_intersect(area, ranges[listed[i].range].range)) {
+            n = append_found(found, capacity, n, listed[i].range);
+        }
+    }
+    for (int j = 0; j < area.col_span; j++) {
+        first = find_column_entry(area.sheet_id, area.col + j, area.row + 1,
+            1);
+        last = find_column_entry(area.sheet_id, area.col + j,
+            area.row + area.row_span, 0);
+        for (int i = first; i < last; i++) {
+            entry = &columns[i];
+            if (entry->range >= nb_ranges ||
+                ranges[entry->range].stamp != entry->stamp) {
+                continue;
+            }
+            // each range is found once, from its first column in area
+            range = ranges[entry->range].range;
+            if (area_intersect(area, range) &&
+                area.col + j == MAX(area.col, range.col)) {
+                n = append_found(found, capacity, n, entry->range);
+            }
+        }
+    }
+    return n;
+}
+
+static struct range_entry *
+find_range_entry(struct area range)
+{
+    // return NULL if range is not referenced by any formula
+    if (!nb_buckets) {
+        return NULL;
+    }
+    for (int i = *get_bucket(range); i >= 0; i = ranges[i].next) {
+        if (area_equal(ranges[i].range, range)) {
+            return &ranges[i];
+        }
+    }
+    return NULL;
+}
+
+static int *
+get_bucket(struct area range)
+{
+    uint64_t h;
+
+    h = (uint64_t) (unsigned) range.sheet_id*0x9e3779b97f4a7c15u;
+    h ^= address_key((struct address) {.row = range.row, .col = range.col})*
+        0xc2b2ae3d27d4eb4fu;
+    h ^= (uint64_t) range.row_span*0xff51afd7ed558ccdu;
+    h ^= (uint64_t) (unsigned) range.col_span*0xc4ceb9fe1a85ec53u;
+    return &buckets[(h ^ (h >> 29)) & (nb_buckets - 1)];
+}
+
+static void
+index_range(int i)
+{
+    // list the range i, its columns being indexed later
+    if (nb_listed == listed_capacity) {
+        listed_capacity = listed_capacity ? 2*listed_capacity : 16;
+        listed = realloc(listed, listed_capacity*sizeof(*listed));
+    }
+    ranges[i].stamp = ++last_stamp;
+    listed[nb_listed++] = (struct column_entry) {
+        .range = i,
+        .stamp = ranges[i].stamp,
+    };
+    nb_pending += ranges[i].range.col_span <= INDEX_MAX_COLS;
+}
+
+static void
+invalidate_dependents(struct area area)
+{
+    // mark as dirty every formula depending, even indirectly, on area
+    // the ranges are found in a buffer of their own, as marking cells dirty
+    // looks up the aggregated ranges holding them
+    int n, nb_pending, pending_capacity, ranges_found_capacity;
+    int *ranges_found;
+    struct address dependent;
+    struct area *pending;
+    const struct range_entry *entry;
+
+    pending_capacity = 16;
+    pending = malloc(pending_capacity*sizeof(*pending));
+    pending[0] = area;
+    nb_pending = 1;
+    ranges_found = NULL;
+    ranges_found_capacity = 0;
+    while (nb_pending) {
+        area = pending[--nb_pending];
+        n = find_ranges(area, &ranges_found, &ranges_found_capacity);
+        for (int i = 0; i < n; i++) {
+            entry = &ranges[ranges_found[i]];
+            for (int j = 0; j < entry->nb_dependents; j++) {
+                dependent = entry->dependents[j];
+                if (storage_get_flags(dependent) & CELL_DIRTY) {
+                    continue; // dependents were already invalidated
+                }
+                mark_dirty(dependent);
+                if (nb_pending == pending_capacity) {
+                    pending_capacity *= 2;
+                    pending = realloc(pending,
+                        pending_capacity*sizeof(*pending));
+                }
+                pending[nb_pending++] = area_of_address(dependent);
+            }
+        }
+    }
+    free(ranges_found);
+    free(pending);
+}
+
+static void
+link_range_entry(int i)
+{
+    int *bucket;
+
+    bucket = get_bucket(ranges[i].range);
+    ranges[i].next = *bucket;
+    *bucket = i;
+}
+
+static void
+mark_dirty(struct address address)
+{
+    set_cell_flags(address, storage_get_flags(address) | CELL_DIRTY);
+
+    // compact or grow the queue if needed
+    if (dirty_tail == dirty_capacity) {
+        if (dirty_head > dirty_capacity/2) {
+            memmove(dirty_queue, dirty_queue + dirty_head,
+                (dirty_tail - dirty_head)*sizeof(*dirty_queue));
+            dirty_tail -= dirty_head;
+            dirty_head = 0;
+        } else {
+            dirty_capacity = dirty_capacity ? 2*dirty_capacity : 1 << 10;
+            dirty_queue = realloc(dirty_queue,
+                dirty_capacity*sizeof(*dirty_queue));
+        }
+    }
+    dirty_queue[dirty_tail++] = address;
+}
+
+static void
+register_formula(struct address address, struct area range)
+{
+    struct range_entry *entry;
+
+    // find the entry of range, or create it
+    if (!(entry = find_range_entry(range))) {
+        if (nb_ranges == ranges_capacity) {
+            ranges_capacity = ranges_capacity ? 2*ranges_capacity : 16;
+            ranges = realloc(ranges, ranges_capacity*sizeof(*ranges));
+        }
+        entry = &ranges[nb_ranges++];
+        *entry = (struct range_entry) {.range = range};
+
+        // keep the chains short
+        if (nb_ranges > nb_buckets) {
+            nb_buckets = nb_buckets ? 2*nb_buckets : 16;
+            buckets = realloc(buckets, nb_buckets*sizeof(*buckets));
+            memset(buckets, -1, nb_buckets*sizeof(*buckets));
+            for (int i = 0; i < nb_ranges; i++) {
+                link_range_entry(i);
+            }
+        } else {
+            link_range_entry(nb_ranges - 1);
+        }
+        index_range(nb_ranges - 1);
+    }
+
+    // append address to the dependents
+    if (entry->nb_dependents == entry->capacity) {
+        entry->capacity = entry->capacity ? 2*entry->capacity : 4;
+        entry->dependents = realloc(entry->dependents,
+            entry->capacity*sizeof(*entry->dependents));
+    }
+    entry->dependents[entry->nb_dependents++] = address;
+}
+
+static void
+set_cell_flags(struct address address, int flags)
+{
+    // keep track of the dirty cells of aggregated ranges
+    int delta, n;
+
+    delta = (flags & CELL_DIRTY) - (storage_get_flags(address) & CELL_DIRTY);
+    n = delta && nb_aggregated ? find_ranges(area_of_address(address),
+        &found, &found_capacity) : 0;
+    for (int i = 0; i < n; i++) {
+        if (ranges[found[i]].is_aggregated) {
+            ranges[found[i]].nb_dirty += delta;
+        }
+    }
+    storage_set_flags(address, flags);
+}
+
+static void
+set_cell_value(struct address address, struct value value)
+{
+    // keep the aggregates and indexes of ranges up to date
+    int n;
+    struct range_entry *entry;
+    struct value old;
+
+    old = storage_get_value(address);
+    n = nb_aggregated ? find_ranges(area_of_address(address),
+        &found, &found_capacity) : 0;
+    for (int i = 0; i < n; i++) {
+        entry = &ranges[found[i]];
+        if (!entry->is_aggregated) {
+            continue;
+        }
+        update_aggregate(entry, old, value);
+        if (entry->index) {
+            lookup_index_update(entry->index, address, old, value);
+        }
+    }
+    storage_set_value(address, value);
+}
+
+static void
+unlink_range_entry(int i)
+{
+    int *p;
+
+    p = get_bucket(ranges[i].range);
+    while (*p != i) {
+        p = &ranges[*p].next;
+    }
+    *p = ranges[i].next;
+}
+
+static void
+unregister_formula(struct address address, struct area range)
+{
+    struct range_entry *entry;
+
+    if (!(entry = find_range_entry(range))) {
+        return;
+    }
+    for (int i = 0; i < entry->nb_dependents; i++) {
+        if (address_equal(entry->dependents[i], address)) {
+            entry->dependents[i] = entry->dependents[--entry->nb_dependents];
+            break;
+        }
+    }
+    if (!entry->nb_dependents) {
+        // remove empty entries, moving the last one in their place, the
+        // column entries of both being stale
+        drop_aggregate(entry);
+        free(entry->dependents);
+        unlink_range_entry(entry - ranges);
+        nb_stale += entry->range.col_span > INDEX_MAX_COLS ? 1 :
+            entry->range.col_span;
+        if (entry - ranges != --nb_ranges) {
+            unlink_range_entry(nb_ranges);
+            *entry = ranges[nb_ranges];
+            link_range_entry(entry - ranges);
+            nb_stale += entry->range.col_span > INDEX_MAX_COLS ? 1 :
+                entry->range.col_span;
+            index_range(entry - ranges);
+        }
+    }
+}
+
+static void
+update_aggregate(struct range_entry *entry, struct value old,
+    struct value new)
+{
+    struct aggregate *aggregate;
+
+    aggregate = &entry->aggregate;
+    entry->nb_errors += (new.type == VALUE_ERROR) - (old.type == VALUE_ERROR);
+    if (old.type == VALUE_NUMBER) {
+        add_to_sum(entry, -old.as.number);
+        aggregate->count--;
+        if (old.as.number <= aggregate->min ||
+            old.as.number >= aggregate->max) {
+            // the extremum can not be found again without a scan
+            entry->is_extremum_valid = 0;
+        }
+    }
+    if (new.type == VALUE_NUMBER) {
+        add_to_sum(entry, new.as.number);
+        aggregate->count++;
+        aggregate->min = MIN(aggregate->min, new.as.number);
+        aggregate->max = MAX(aggregate->max, new.as.number);
+    }
+    if (!aggregate->count) {
+        aggregate_init(aggregate);
+        entry->compensation = 0;
+        entry->is_extremum_valid = 1;
+    }
+}
@@ -0,0 +1,15 @@
+#ifndef EVALUATION_H
+#define EVALUATION_H
+
+#include "types.h"
+
+void apply_definition(const struct definition *definition);
+void apply_values(struct area area, const struct value *values);
+struct value evaluate(struct address address);
+int evaluate_next_dirty_cell(void);
+int has_dirty_cells(void);
+void load_definition(const struct definition *definition);
+void load_formula(struct address address, const struct formula *formula,
+    int is_dirty);
+
+#endif // EVALUATION_H
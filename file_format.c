@@ -0,0 +1,790 @@
+// textual grid file format
+//
+// a file is a sequence of lines, each line being either:
+// * empty, or a comment starting with '#'
+// * "sheet ID", to set the sheet of the following definitions (0 initially)
+// * a definition "AREA CONTENT", or "AREA" to clear the area
+//
+// AREA is a cell ("B12") or a rectangle ("B12:C20"), possibly prefixed by a
+// sheet ("2!B12:C20") in formulas ranges when it differs from the current one
+// CONTENT is either:
+// * a literal: a number ("-1.5e3"), a boolean ("TRUE" or "FALSE") or a
+//   double-quoted string, '"' and '\' being escaped with '\', and newlines
+//   written as "\n"
+// * a formula: "=FUNCTION(RANGE)", or "=FUNCTION(RANGE, KEY)" for MATCH_*
+//   functions, KEY being a literal
+
+#include <ctype.h>
+#include <inttypes.h>
+#include <math.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "file_format.h"
+#include "string_pool.h"
+#include "types.h"
+
+#define BIGNUM_LIMBS                        40 // of 32 bits, > 1130 bits
+#define NB_POWERS                           16 // of ten, up to 1e15
+
+struct bignum {
+    // unsigned integer, large enough for the exact digits of doubles
+    int nb_limbs;
+    uint32_t limbs[BIGNUM_LIMBS]; // least significant first
+};
+
+static void bignum_add(struct bignum *res, const struct bignum *a,
+    const struct bignum *b);
+static int bignum_compare(const struct bignum *a, const struct bignum *b);
+static void bignum_multiply(struct bignum *a, uint32_t factor);
+static void bignum_set(struct bignum *a, uint64_t x, int shift);
+static void bignum_subtract(struct bignum *a, const struct bignum *b);
+static int find_decimals(double magnitude);
+static uint64_t mix(uint64_t hash, uint64_t x);
+static const char *parse_cell(const char *p, const char *end, int64_t *row,
+    int *col);
+static const char *parse_int(const char *p, const char *end, int *res);
+static const char *parse_literal(const char *p, const char *end,
+    struct value *value);
+static int shortest_digits(double magnitude, char digits[], int *exponent);
+static const char *skip_spaces(const char *p, const char *end);
+static int write_area(FILE *fp, struct area area, sheet_id current_sheet);
+static int write_literal(FILE *fp, struct value value);
+
+static const double powers[NB_POWERS] = {
+    1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11, 1e12,
+    1e13, 1e14, 1e15,
+};
+static const char *function_names[] = {
+    [FUNCTION_AVERAGE] = "AVERAGE",
+    [FUNCTION_COUNT] = "COUNT",
+    [FUNCTION_MATCH_APPROX] = "MATCH_APPROX",
+    [FUNCTION_MATCH_EXACT] = "MATCH_EXACT",
+    [FUNCTION_MAX] = "MAX",
+    [FUNCTION_MIN] = "MIN",
+    [FUNCTION_SUM] = "SUM",
+};
+
+double
+decimal_mantissa(double magnitude, int *exponent)
+{
+    // return the mantissa in [1, 10) of the finite positive magnitude
+    // written with an exponent, set in exponent, a few ulps off at most
+    double mantissa;
+    int binary_exponent, k;
+
+    // 78913/2^18 is just below log10(2): the estimate is fixed up after
+    frexp(magnitude, &binary_exponent);
+    k = binary_exponent - 1;
+    k = k >= 0 ? k*78913 >> 18 : -(-k*78913 >> 18) - 1;
+    for (mantissa = magnitude, *exponent = k; k >= NB_POWERS; k -= 15) {
+        mantissa /= powers[15];
+    }
+    for (; k <= -NB_POWERS; k += 15) {
+        mantissa *= powers[15];
+    }
+    mantissa = k >= 0 ? mantissa/powers[k] : mantissa*powers[-k];
+    for (; mantissa >= 10; (*exponent)++) {
+        mantissa /= 10;
+    }
+    for (; mantissa < 1; (*exponent)--) {
+        mantissa *= 10;
+    }
+    return mantissa;
+}
+
+uint64_t
+definition_hash(const struct definition *definition)
+{
+    // identical definitions have the same hash, whatever their spelling
+    double number;
+    int nb_areas;
+    uint64_t bits, hash;
+    const struct area *areas[2];
+    const struct value *value;
+
+    areas[0] = &definition->area;
+    areas[1] = &definition->formula.range;
+    nb_areas = definition->formula.function == FUNCTION_NONE ? 1 : 2;
+    hash = 0;
+    for (int i = 0; i < nb_areas; i++) {
+        hash = mix(hash, areas[i]->sheet_id);
+        hash = mix(hash, areas[i]->row);
+        hash = mix(hash, areas[i]->col);
+        hash = mix(hash, areas[i]->row_span);
+        hash = mix(hash, areas[i]->col_span);
+    }
+    hash = mix(hash, definition->formula.function);
+    value = definition->formula.function == FUNCTION_NONE ?
+        &definition->value : &definition->formula.key;
+    hash = mix(hash, value->type);
+    switch (value->type) {
+    case VALUE_BOOLEAN:
+        return mix(hash, value->as.boolean);
+    case VALUE_ERROR:
+        return mix(hash, value->as.error);
+    case VALUE_NUMBER:
+        number = value->as.number == 0 ? 0 : value->as.number;
+        memcpy(&bits, &number, sizeof(bits));
+        return mix(hash, bits);
+    case VALUE_STRING:
+        return mix(hash, value->as.string->hash);
+    default:
+        return hash;
+    }
+}
+
+void
+file_layout_append(struct file_layout *layout, struct file_line line)
+{
+    if (layout->nb_lines == layout->capacity) {
+        layout->capacity = layout->capacity ? 2*layout->capacity : 1 << 10;
+        layout->lines = realloc(layout->lines,
+            layout->capacity*sizeof(*layout->lines));
+    }
+    layout->lines[layout->nb_lines++] = line;
+}
+
+int
+format_exponent(int exponent, char buf[])
+{
+    // write the exponent part of a number ("e+05", "e-300") in buf (of
+    // length 8) as printf does, and return its length
+    int len;
+
+    len = 0;
+    buf[len++] = 'e';
+    buf[len++] = exponent < 0 ? '-' : '+';
+    if (-10 < exponent && exponent < 10) {
+        buf[len++] = '0';
+    }
+    return len + format_integer(exponent < 0 ? -exponent : exponent,
+        buf + len);
+}
+
+int
+format_fixed(double number, int nb_decimals, char buf[])
+{
+    // write number rounded to nb_decimals decimals in buf (of length 32),
+    // trailing zeros being removed, and return its length
+    // number scaled by 10^nb_decimals must be less than 1e15
+    char digits[24];
+    int len, nb_digits;
+    uint64_t mantissa;
+
+    mantissa = fabs(number)*powers[nb_decimals] + 0.5;
+    for (; nb_decimals && mantissa%10 == 0; nb_decimals--) {
+        mantissa /= 10;
+    }
+
+    // digits in reverse order, padded for the leading zeros
+    len = nb_digits = 0;
+    do {
+        digits[nb_digits++] = '0' + mantissa%10;
+        mantissa /= 10;
+    } while (mantissa);
+    while (nb_digits <= nb_decimals) {
+        digits[nb_digits++] = '0';
+    }
+    if (signbit(number)) {
+        buf[len++] = '-';
+    }
+    for (int i = nb_digits - 1; i >= 0; i--) {
+        buf[len++] = digits[i];
+        if (i == nb_decimals && i) {
+            buf[len++] = '.';
+        }
+    }
+    buf[len] = '\0';
+    return len;
+}
+
+int
+format_integer(int64_t n, char buf[])
+{
+    // write n in buf (of length 32) and return its length
+    char digits[24];
+    int len, nb_digits;
+    uint64_t magnitude;
+
+    len = nb_digits = 0;
+    magnitude = n < 0 ? -(uint64_t) n : (uint64_t) n;
+    do {
+        digits[nb_digits++] = '0' + magnitude%10;
+        magnitude /= 10;
+    } while (magnitude);
+    if (n < 0) {
+        buf[len++] = '-';
+    }
+    while (nb_digits) {
+        buf[len++] = digits[--nb_digits];
+    }
+    buf[len] = '\0';
+    return len;
+}
+
+int
+format_number(double number, char buf[])
+{
+    // write the shortest representation read back as number in buf (of
+    // length 32), laid out as by printf("%.15g"), and return its length
+    // numbers of at most 15 significant digits are written as the smallest
+    // number of decimals giving back number by an exact division (see
+    // parse_number in csv.c), which is common, the others from their exact
+    // shortest digits (see shortest_digits)
+    char digits[24];
+    int exponent, len, nb_decimals, nb_digits;
+    double magnitude;
+
+    magnitude = fabs(number);
+    if ((!magnitude || magnitude >= 1e-5) &&
+        (nb_decimals = find_decimals(magnitude)) >= 0) {
+        return format_fixed(number, nb_decimals, buf);
+    }
+    len = 0;
+    if (signbit(number)) {
+        buf[len++] = '-';
+    }
+    if (!isfinite(number)) {
+        memcpy(buf + len, isnan(number) ? "nan" : "inf", 4);
+        return len + 3;
+    }
+
+    // number is 0.DIGITS times 10^exponent, printed with an exponent if it
+    // is below 1e-4, or past the precision of %.15g (or %.16g, %.17g)
+    nb_digits = shortest_digits(magnitude, digits, &exponent);
+    if (exponent <= -4 || exponent > MAX(nb_digits, 15)) {
+        buf[len++] = digits[0];
+        if (nb_digits > 1) {
+            buf[len++] = '.';
+            memcpy(buf + len, digits + 1, nb_digits - 1);
+            len += nb_digits - 1;
+        }
+        return len + format_exponent(exponent - 1, buf + len);
+    } else if (exponent <= 0) {
+        memcpy(buf + len, "0.", 2);
+        memset(buf + len + 2, '0', -exponent);
+        len += 2 - exponent;
+        memcpy(buf + len, digits, nb_digits);
+        len += nb_digits;
+    } else {
+        for (int i = 0; i < MAX(nb_digits, exponent); i++) {
+            if (i == exponent) {
+                buf[len++] = '.';
+            }
+            buf[len++] = i < nb_digits ? digits[i] : '0';
+        }
+    }
+    buf[len] = '\0';
+    return len;
+}
+
+int
+formula_equal(const struct formula *a, const struct formula *b)
+{
+    return a->function == b->function && area_equal(a->range, b->range) &&
+        value_equal(a->key, b->key);
+}
+
+const char *
+parse_area(const char *p, const char *end, sheet_id current_sheet,
+    struct area *area)
+{
+    // return a pointer after the parsed area, or NULL on failure
+    int col;
+    int64_t row;
+    const char *q;
+
+    area->sheet_id = current_sheet;
+    if (p < end && isdigit((unsigned char) *p)) {
+        if (!(p = parse_int(p, end, &area->sheet_id)) || p == end ||
+            *p++ != '!') {
+            return NULL;
+        }
+    }
+    if (!(p = parse_cell(p, end, &area->row, &area->col))) {
+        return NULL;
+    }
+    area->row_span = area->col_span = 1;
+    if (p < end && *p == ':') {
+        if (!(q = parse_cell(p + 1, end, &row, &col)) || row < area->row ||
+            col < area->col) {
+            return NULL;
+        }
+        area->row_span = row - area->row + 1;
+        area->col_span = col - area->col + 1;
+        p = q;
+    }
+    return p;
+}
+
+enum line_type
+parse_line(const char *line, const char *end, sheet_id current_sheet,
+    struct definition *definition)
+{
+    // parse the line [line, end) (without newline) in place
+    // strings of the parsed definition are new references
+    int function;
+    const char *p;
+    struct formula *formula;
+
+    *definition = (struct definition) {0};
+    formula = &definition->formula;
+    p = skip_spaces(line, end);
+    if (p == end || *p == '#') {
+        return LINE_BLANK;
+    } else if (end - p > 6 && !memcmp(p, "sheet ", 6)) {
+        p = parse_int(skip_spaces(p + 6, end), end,
+            &definition->area.sheet_id);
+        return p && skip_spaces(p, end) == end ? LINE_SHEET : LINE_INVALID;
+    }
+
+    // area, then content
+    if (!(p = parse_area(p, end, current_sheet, &definition->area)) ||
+        (p < end && !isspace((unsigned char) *p))) {
+        return LINE_INVALID;
+    }
+    p = skip_spaces(p, end);
+    if (p == end) {
+        return LINE_DEFINITION; // cleared area
+    } else if (*p == '=') {
+        for (function = FUNCTION_NONE + 1; function <= FUNCTION_SUM;
+            function++) {
+            size_t len = strlen(function_names[function]);
+            if (end - p > (ptrdiff_t) len + 1 &&
+                !memcmp(p + 1, function_names[function], len) &&
+                p[1 + len] == '(') {
+                break;
+            }
+        }
+        if (function > FUNCTION_SUM) {
+            return LINE_INVALID;
+        }
+        formula->function = function;
+        p += 2 + strlen(function_names[function]);
+        if (!(p = parse_area(skip_spaces(p, end), end,
+            definition->area.sheet_id, &formula->range))) {
+            return LINE_INVALID;
+        }
+        p = skip_spaces(p, end);
+        if (function == FUNCTION_MATCH_APPROX ||
+            function == FUNCTION_MATCH_EXACT) {
+            if (p == end || *p != ',' ||
+                !(p = parse_literal(skip_spaces(p + 1, end), end,
+                &formula->key))) {
+                return LINE_INVALID;
+            }
+            p = skip_spaces(p, end);
+        }
+        if (p == end || *p++ != ')') {
+            value_unref(formula->key);
+            return LINE_INVALID;
+        }
+    } else if (!(p = parse_literal(p, end, &definition->value))) {
+        return LINE_INVALID;
+    }
+    if (skip_spaces(p, end) != end) {
+        value_unref(definition->value);
+        value_unref(formula->key);
+        return LINE_INVALID;
+    }
+    return LINE_DEFINITION;
+}
+
+int
+write_definition(FILE *fp, const struct definition *definition)
+{
+    // return the number of bytes written
+    int len;
+    const struct formula *formula;
+
+    len = write_area(fp, definition->area, definition->area.sheet_id);
+    formula = &definition->formula;
+    if (formula->function == FUNCTION_NONE &&
+        definition->value.type == VALUE_EMPTY) {
+        fputc('\n', fp);
+        return len + 1;
+    }
+    fputc(' ', fp);
+    if (formula->function == FUNCTION_NONE) {
+        len += write_literal(fp, definition->value);
+    } else {
+        len += fprintf(fp, "=%s(", function_names[formula->function]);
+        len += write_area(fp, formula->range, definition->area.sheet_id);
+        if (formula->function == FUNCTION_MATCH_APPROX ||
+            formula->function == FUNCTION_MATCH_EXACT) {
+            fputs(", ", fp);
+            len += 2 + write_literal(fp, formula->key);
+        }
+        fputc(')', fp);
+        len++;
+    }
+    fputc('\n', fp);
+    return len + 2;
+}
+
+int
+write_sheet(FILE *fp, sheet_id sheet_id)
+{
+    return fprintf(fp, "sheet %d\n", sheet_id);
+}
+
+static void
+bignum_add(struct bignum *res, const struct bignum *a,
+    const struct bignum *b)
+{
+    // res = a + b, res may be a or b
+    uint64_t carry;
+    int n;
+
+    n = MAX(a->nb_limbs, b->nb_limbs);
+    carry = 0;
+    for (int i = 0; i < n; i++) {
+        carry += (uint64_t) (i < a->nb_limbs ? a->limbs[i] : 0) +
+            (i < b->nb_limbs ? b->limbs[i] : 0);
+        res->limbs[i] = carry;
+        carry >>= 32;
+    }
+    if (carry) {
+        res->limbs[n++] = carry;
+    }
+    res->nb_limbs = n;
+}
+
+static int
+bignum_compare(const struct bignum *a, const struct bignum *b)
+{
+    // limbs past nb_limbs are never null
+    if (a->nb_limbs != b->nb_limbs) {
+        return a->nb_limbs < b->nb_limbs ? -1 : 1;
+    }
+    for (int i = a->nb_limbs - 1; i >= 0; i--) {
+        if (a->limbs[i] != b->limbs[i]) {
+            return a->limbs[i] < b->limbs[i] ? -1 : 1;
+        }
+    }
+    return 0;
+}
+
+static void
+bignum_multiply(struct bignum *a, uint32_t factor)
+{
+    uint64_t carry;
+
+    carry = 0;
+    for (int i = 0; i < a->nb_limbs; i++) {
+        carry += (uint64_t) a->limbs[i]*factor;
+        a->limbs[i] = carry;
+        carry >>= 32;
+    }
+    if (carry) {
+        a->limbs[a->nb_limbs++] = carry;
+    }
+}
+
+static void
+bignum_set(struct bignum *a, uint64_t x, int shift)
+{
+    // a = x*2^shift
+    memset(a, 0, sizeof(*a));
+    a->limbs[shift/32] = x << shift%32;
+    x = shift%32 ? x >> (32 - shift%32) : x >> 32;
+    a->limbs[shift/32 + 1] = x;
+    a->limbs[shift/32 + 2] = x >> 32;
+    for (a->nb_limbs = shift/32 + 3; a->nb_limbs &&
+        !a->limbs[a->nb_limbs - 1]; a->nb_limbs--) {
+        continue;
+    }
+}
+
+static void
+bignum_subtract(struct bignum *a, const struct bignum *b)
+{
+    // a -= b, b being at most a
+    int64_t borrow;
+
+    borrow = 0;
+    for (int i = 0; i < a->nb_limbs; i++) {
+        borrow += (int64_t) a->limbs[i] - (i < b->nb_limbs ? b->limbs[i] : 0);
+        a->limbs[i] = borrow;
+        borrow = borrow < 0 ? -1 : 0;
+    }
+    while (a->nb_limbs && !a->limbs[a->nb_limbs - 1]) {
+        a->nb_limbs--;
+    }
+}
+
+static int
+find_decimals(double magnitude)
+{
+    // return the fewest decimals giving back magnitude by an exact division,
+    // or -1 if it takes more than 15 significant digits
+    double scaled;
+    uint64_t mantissa;
+
+    for (int i = 0; i < NB_POWERS; i++) {
+        if ((scaled = magnitude*powers[i]) >= 1e15) {
+            break;
+        }
+        mantissa = scaled + 0.5;
+        if ((double) mantissa/powers[i] == magnitude) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+static uint64_t
+mix(uint64_t hash, uint64_t x)
+{
+    hash = (hash ^ x)*UINT64_C(0x9e3779b97f4a7c15);
+    return hash ^ hash >> 29;
+}
+
+static const char *
+parse_cell(const char *p, const char *end, int64_t *row, int *col)
+{
+    // parse a cell such as "AB12", return NULL on failure or if out of the
+    // address space, digits being read no further than the bounds
+    int64_t x, y;
+    const char *start;
+
+    for (x = 0; p < end && *p >= 'A' && *p <= 'Z' && x <= NB_COLUMNS; p++) {
+        x = 26*x + *p - 'A' + 1;
+    }
+    start = p;
+    for (y = 0; p < end && isdigit((unsigned char) *p) && y <= NB_ROWS; p++) {
+        y = 10*y + *p - '0';
+    }
+    if (!x || x > NB_COLUMNS || p == start || y < 1 || y > NB_ROWS) {
+        return NULL;
+    }
+    *row = y - 1;
+    *col = x - 1;
+    return p;
+}
+
+static const char *
+parse_int(const char *p, const char *end, int *res)
+{
+    // parse a non-negative integer, return NULL on failure
+    const char *start;
+
+    start = p;
+    for (*res = 0; p < end && isdigit((unsigned char) *p); p++) {
+        *res = 10*(*res) + *p - '0';
+    }
+    return p == start ? NULL : p;
+}
+
+static const char *
+parse_literal(const char *p, const char *end, struct value *value)
+{
+    // return a pointer after the parsed literal, or NULL on failure
+    // strings are only copied if they contain escape sequences
+    char buf[64], *num_end, *unescaped;
+    size_t len;
+    const char *q;
+
+    if (p == end) {
+        return NULL;
+    } else if (end - p >= 4 && !memcmp(p, "TRUE", 4)) {
+        *value = (struct value) {.type = VALUE_BOOLEAN, .as.boolean = 1};
+        return p + 4;
+    } else if (end - p >= 5 && !memcmp(p, "FALSE", 5)) {
+        *value = (struct value) {.type = VALUE_BOOLEAN, .as.boolean = 0};
+        return p + 5;
+    } else if (*p == '"') {
+        for (q = ++p; q < end && *q != '"'; q++) {
+            q += *q == '\\';
+        }
+        if (q >= end) {
+            return NULL;
+        }
+        if (!memchr(p, '\\', q - p)) {
+            value->as.string = string_intern(p, q - p);
+        } else {
+            unescaped = malloc(q - p);
+            for (len = 0; p < q; p++) {
+                if (*p == '\\') {
+                    p++;
+                    unescaped[len++] = *p == 'n' ? '\n' : *p;
+                } else {
+                    unescaped[len++] = *p;
+                }
+            }
+            value->as.string = string_intern(unescaped, len);
+            free(unescaped);
+        }
+        value->type = VALUE_STRING;
+        return q + 1;
+    }
+
+    // numbers are copied, as the line is not null-terminated
+    len = MIN((size_t) (end - p), sizeof(buf) - 1);
+    memcpy(buf, p, len);
+    buf[len] = '\0';
+    value->as.number = strtod(buf, &num_end);
+    if (num_end == buf) {
+        return NULL;
+    }
+    value->type = VALUE_NUMBER;
+    return p + (num_end - buf);
+}
+
+static int
+shortest_digits(double magnitude, char digits[], int *exponent)
+{
+    // write in digits the fewest digits DIGITS such that 0.DIGITS times
+    // 10^exponent reads back as the finite positive magnitude, and return
+    // their number (at most 17)
+    // free-format algorithm of Burger and Dybvig ("Printing floating-point
+    // numbers quickly and accurately", 1996): magnitude is r/s, and the
+    // numbers reading back as it are within (r - m-)/s and (r + m+)/s,
+    // bounds included if the mantissa is even as reads round to even
+    int binary_exponent, high, is_even, k, low, nb_digits;
+    uint64_t mantissa;
+    struct bignum m_minus, m_plus, r, s, sum;
+
+    // magnitude = mantissa*2^binary_exponent, with 53 bits unless subnormal
+    mantissa = ldexp(frexp(magnitude, &binary_exponent), 53);
+    binary_exponent -= 53;
+    for (; binary_exponent < -1074; binary_exponent++) {
+        mantissa >>= 1;
+    }
+    is_even = !(mantissa & 1);
+    if (binary_exponent >= 0) {
+        // the gap below powers of two is half the one above
+        k = mantissa == (uint64_t) 1 << 52;
+        bignum_set(&r, mantissa, binary_exponent + 1 + k);
+        bignum_set(&s, 2, k);
+        bignum_set(&m_plus, 1, binary_exponent + k);
+        bignum_set(&m_minus, 1, binary_exponent);
+    } else {
+        k = binary_exponent > -1074 && mantissa == (uint64_t) 1 << 52;
+        bignum_set(&r, mantissa, 1 + k);
+        bignum_set(&s, 1, 1 + k - binary_exponent);
+        bignum_set(&m_plus, 1, k);
+        bignum_set(&m_minus, 1, 0);
+    }
+
+    // scale by 10^k, k estimated from the binary exponent then fixed up
+    for (nb_digits = 0; mantissa >> nb_digits; nb_digits++) {
+        continue;
+    }
+    // 78913/2^18 is just below log10(2): the estimate is a few too low
+    k = binary_exponent + nb_digits - 1;
+    k = k >= 0 ? k*78913 >> 18 : -(-k*78913 >> 18) - 1;
+    for (int i = 0; i < k; i++) {
+        bignum_multiply(&s, 10);
+    }
+    for (int i = 0; i < -k; i++) {
+        bignum_multiply(&r, 10);
+        bignum_multiply(&m_plus, 10);
+        bignum_multiply(&m_minus, 10);
+    }
+    // comparisons include the bounds if is_even: a < b + is_even is a <= b
+    for (;; k++) {
+        bignum_add(&sum, &r, &m_plus);
+        if (bignum_compare(&sum, &s) < !is_even) {
+            break;
+        }
+        bignum_multiply(&s, 10);
+    }
+    *exponent = k;
+
+    // generate digits until the rest is within the bounds
+    nb_digits = 0;
+    do {
+        bignum_multiply(&r, 10);
+        bignum_multiply(&m_plus, 10);
+        bignum_multiply(&m_minus, 10);
+        digits[nb_digits] = '0';
+        while (bignum_compare(&r, &s) >= 0) {
+            bignum_subtract(&r, &s);
+            digits[nb_digits]++;
+        }
+        bignum_add(&sum, &r, &m_plus);
+        low = bignum_compare(&r, &m_minus) < is_even;
+        high = bignum_compare(&sum, &s) > -is_even;
+        if (low && high) {
+            // the closest of both, the even one on ties as printf
+            bignum_add(&sum, &r, &r);
+            high = bignum_compare(&sum, &s) + (digits[nb_digits] & 1) > 0;
+        }
+        digits[nb_digits++] += high;
+    } while (!low && !high);
+    return nb_digits;
+}
+
+static const char *
+skip_spaces(const char *p, const char *end)
+{
+    while (p < end && (*p == ' ' || *p == '\t' || *p == '\r')) {
+        p++;
+    }
+    return p;
+}
+
+static int
+write_area(FILE *fp, struct area area, sheet_id current_sheet)
+{
+    char buf[16];
+    int len;
+
+    len = 0;
+    if (area.sheet_id != current_sheet) {
+        len += fprintf(fp, "%d!", area.sheet_id);
+    }
+    len += fwrite(buf, 1, col_name(area.col, buf), fp);
+    len += fprintf(fp, "%" PRId64, area.row + 1);
+    if (area.row_span > 1 || area.col_span > 1) {
+        fputc(':', fp);
+        len += 1 + fwrite(buf, 1, col_name(area.col + area.col_span - 1, buf),
+            fp);
+        len += fprintf(fp, "%" PRId64, area.row + area.row_span);
+    }
+    return len;
+}
+
+static int
+write_literal(FILE *fp, struct value value)
+{
+    char buf[32];
+    int len;
+    const char *p;
+
+    len = 0;
+    switch (value.type) {
+    case VALUE_BOOLEAN:
+        len = fprintf(fp, "%s", value.as.boolean ? "TRUE" : "FALSE");
+        break;
+    case VALUE_NUMBER:
+        len = fwrite(buf, 1, format_number(value.as.number, buf), fp);
+        break;
+    case VALUE_STRING:
+        fputc('"', fp);
+        for (p = value.as.string->data; *p; p++) {
+            if (*p == '"' || *p == '\\') {
+                fputc('\\', fp);
+                fputc(*p, fp);
+                len++;
+            } else if (*p == '\n') {
+                fputs("\\n", fp);
+                len++;
+            } else {
+                fputc(*p, fp);
+            }
+        }
+        fputc('"', fp);
+        len += 2 + (p - value.as.string->data);
+        break;
+    default:
+        // errors and empty cells are never written as literals
+        break;
+    }
+    return len;
+}
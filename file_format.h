@@ -0,0 +1,51 @@
+#ifndef FILE_FORMAT_H
+#define FILE_FORMAT_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <sys/types.h>
+#include <time.h>
+
+#include "types.h"
+
+enum line_type {
+    LINE_BLANK, // empty line or comment
+    LINE_DEFINITION,
+    LINE_INVALID,
+    LINE_SHEET, // sheet stored in definition->area.sheet_id
+};
+
+struct file_line {
+    // definition line of a grid file
+    off_t offset;
+    size_t length; // newline included
+    struct area area;
+    int is_clear; // "AREA" line
+    uint64_t hash; // of the definition, see definition_hash
+};
+
+struct file_layout {
+    // definition lines of a grid file, in file order
+    struct file_line *lines;
+    int nb_lines, capacity;
+    sheet_id last_sheet; // current sheet at the end of the file
+    off_t size;
+    struct timespec mtime; // of the file described
+};
+
+double decimal_mantissa(double magnitude, int *exponent);
+uint64_t definition_hash(const struct definition *definition);
+void file_layout_append(struct file_layout *layout, struct file_line line);
+int format_exponent(int exponent, char buf[]);
+int format_fixed(double number, int nb_decimals, char buf[]);
+int format_integer(int64_t n, char buf[]);
+int format_number(double number, char buf[]);
+int formula_equal(const struct formula *a, const struct formula *b);
+const char *parse_area(const char *p, const char *end, sheet_id current_sheet,
+    struct area *area);
+enum line_type parse_line(const char *line, const char *end,
+    sheet_id current_sheet, struct definition *definition);
+int write_definition(FILE *fp, const struct definition *definition);
+int write_sheet(FILE *fp, sheet_id sheet_id);
+
+#endif // FILE_FORMAT_H
@@ -0,0 +1,321 @@
+// hidden rows and columns of the sheets, kept as sorted ranges, so that the
+// n-th shown row or column (its ordinal), and the ordinal of a row or column,
+// are found in O(log k) for k ranges, whatever the number of hidden lines
+// each change publishes a new immutable snapshot, retiring the previous one: a
+// view holds the snapshot it was computed with, so that threads map its
+// positions to addresses without locking, consistently with each other, and
+// retired snapshots are freed once no view holds them
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "hidden.h"
+#include "types.h"
+#include "widths.h"
+
+struct range {
+    int64_t first, end; // hidden lines, ranges being disjoint and not adjacent
+    int64_t nb_before; // hidden lines in the previous ranges
+};
+struct ranges {
+    struct range *ranges;
+    int nb_ranges;
+};
+struct hidden {
+    sheet_id sheet_id;
+    struct ranges axes[2];
+    int nb_holders, is_retired;
+};
+
+static struct hidden *find_hidden(sheet_id sheet_id);
+static void free_snapshot(struct hidden *hidden);
+static int is_in_range(const struct ranges *r, int64_t x);
+static int last_range_before(const struct ranges *r, int64_t x);
+static int last_range_shown_before(const struct ranges *r, int64_t n);
+static int64_t line_of(const struct ranges *r, int64_t n);
+static int64_t ordinal_of(const struct ranges *r, int64_t x);
+
+static int nb_snapshots;
+static pthread_mutex_t hidden_mutex = PTHREAD_MUTEX_INITIALIZER;
+static struct hidden **snapshots; // current and held ones, latest last
+
+void
+free_hidden(void)
+{
+    pthread_mutex_lock(&hidden_mutex);
+    while (nb_snapshots) {
+        free_snapshot(snapshots[nb_snapshots - 1]);
+    }
+    free(snapshots);
+    snapshots = NULL;
+    nb_snapshots = 0;
+    pthread_mutex_unlock(&hidden_mutex);
+}
+
+const struct hidden *
+get_hidden(sheet_id sheet_id)
+{
+    // return the current snapshot of sheet_id, NULL if nothing was ever
+    // hidden in it, valid until the next set_hidden unless held
+    const struct hidden *res;
+
+    pthread_mutex_lock(&hidden_mutex);
+    res = find_hidden(sheet_id);
+    pthread_mutex_unlock(&hidden_mutex);
+    return res;
+}
+
+void
+hold_hidden(const struct hidden *hidden)
+{
+    // keep hidden alive until released, see release_hidden
+    if (hidden) {
+        pthread_mutex_lock(&hidden_mutex);
+        ((struct hidden *) hidden)->nb_holders++;
+        pthread_mutex_unlock(&hidden_mutex);
+    }
+}
+
+int64_t
+next_shown(const struct hidden *hidden, enum axis axis, int64_t x,
+    int64_t n)
+{
+    // return the line n shown lines after x (before if n < 0), -1 standing
+    // for the headers, before the first shown line
+    int64_t ordinal;
+    const struct ranges *r;
+
+    if (!hidden || !(r = &hidden->axes[axis])->nb_ranges) {
+        return MAX(-1, x + n);
+    }
+    ordinal = (x < 0 ? -1 : ordinal_of(r, x)) + n;
+    return ordinal < 0 ? -1 : line_of(r, ordinal);
+}
+
+int64_t
+nth_shown(const struct hidden *hidden, enum axis axis, int64_t n)
+{
+    // return the shown line of ordinal n
+    return hidden ? line_of(&hidden->axes[axis], n) : n;
+}
+
+void
+release_hidden(const struct hidden *hidden)
+{
+    // free hidden if retired and no longer held
+    if (!hidden) {
+        return;
+    }
+    pthread_mutex_lock(&hidden_mutex);
+    if (!--((struct hidden *) hidden)->nb_holders && hidden->is_retired) {
+        free_snapshot((struct hidden *) hidden);
+    }
+    pthread_mutex_unlock(&hidden_mutex);
+}
+
+void
+set_hidden(sheet_id sheet_id, enum axis axis, int64_t first, int64_t end,
+    int hidden)
+{
+    // hide (or show) the lines of [first, end), merging ranges into a new
+    // snapshot
+    int nb;
+    enum axis other_axis;
+    struct hidden *new, *old;
+    struct range *res;
+    struct ranges r, *other;
+
+    first = MAX(0, first);
+    if (first >= end) {
+        return;
+    }
+    pthread_mutex_lock(&hidden_mutex);
+    old = find_hidden(sheet_id);
+    r = old ? old->axes[axis] : (struct ranges) {0};
+
+    // parts of the ranges before first, the new range, parts after end
+    res = malloc((r.nb_ranges + 2)*sizeof(*res));
+    nb = 0;
+    for (int k = 0; k < r.nb_ranges && r.ranges[k].first < first; k++) {
+        res[nb++] = (struct range) {
+            .first = r.ranges[k].first,
+            .end = MIN(r.ranges[k].end, first),
+        };
+    }
+    if (hidden) {
+        res[nb++] = (struct range) {.first = first, .end = end};
+    }
+    for (int k = 0; k < r.nb_ranges; k++) {
+        if (r.ranges[k].end > end) {
+            res[nb++] = (struct range) {
+                .first = MAX(r.ranges[k].first, end),
+                .end = r.ranges[k].end,
+            };
+        }
+    }
+
+    // merge overlapping and adjacent ranges, count hidden lines
+    r = (struct ranges) {.ranges = res};
+    for (int k = 0; k < nb; k++) {
+        if (r.nb_ranges && res[k].first <= res[r.nb_ranges - 1].end) {
+            res[r.nb_ranges - 1].end = MAX(res[r.nb_ranges - 1].end,
+                res[k].end);
+            continue;
+        }
+        res[k].nb_before = !r.nb_ranges ? 0 :
+            res[r.nb_ranges - 1].nb_before + res[r.nb_ranges - 1].end -
+            res[r.nb_ranges - 1].first;
+        res[r.nb_ranges++] = res[k];
+    }
+
+    // publish the snapshot, the other axis being copied
+    new = malloc(sizeof(*new));
+    new->sheet_id = sheet_id;
+    new->nb_holders = new->is_retired = 0;
+    new->axes[axis] = r;
+    other_axis = axis == AXIS_COLS ? AXIS_ROWS : AXIS_COLS;
+    other = &new->axes[other_axis];
+    r = old ? old->axes[other_axis] : (struct ranges) {0};
+    other->nb_ranges = r.nb_ranges;
+    other->ranges = malloc((r.nb_ranges + 1)*sizeof(*r.ranges));
+    for (int k = 0; k < r.nb_ranges; k++) {
+        other->ranges[k] = r.ranges[k];
+    }
+    snapshots = realloc(snapshots, (nb_snapshots + 1)*sizeof(*snapshots));
+    snapshots[nb_snapshots++] = new;
+    if (old) {
+        old->is_retired = 1;
+        if (!old->nb_holders) {
+            free_snapshot(old);
+        }
+    }
+    pthread_mutex_unlock(&hidden_mutex);
+
+    // hidden columns take no room
+    if (axis == AXIS_COLS) {
+        set_cols_hidden(sheet_id, MIN(first, NB_COLUMNS), MIN(end, NB_COLUMNS),
+            hidden);
+    }
+}
+
+int64_t
+shown_before(const struct hidden *hidden, enum axis axis, int64_t x)
+{
+    // return the number of shown lines before x, that is the ordinal of x if
+    // shown, else of the next shown line
+    return hidden ? ordinal_of(&hidden->axes[axis], x) : x;
+}
+
+int64_t
+shown_between(const struct hidden *hidden, enum axis axis, int64_t first,
+    int64_t x)
+{
+    // return the number of shown lines in [first, x), or -1 if x is hidden
+    const struct ranges *r;
+
+    if (!hidden || !(r = &hidden->axes[axis])->nb_ranges) {
+        return x - first;
+    }
+    return is_in_range(r, x) ? -1 : ordinal_of(r, x) - ordinal_of(r, first);
+}
+
+static struct hidden *
+find_hidden(sheet_id sheet_id)
+{
+    // return the latest snapshot of sheet_id, or NULL
+    for (int i = nb_snapshots - 1; i >= 0; i--) {
+        if (snapshots[i]->sheet_id == sheet_id) {
+            return snapshots[i];
+        }
+    }
+    return NULL;
+}
+
+static void
+free_snapshot(struct hidden *hidden)
+{
+    // remove hidden from the snapshots, keeping their order
+    int i;
+
+    for (i = nb_snapshots - 1; snapshots[i] != hidden; i--) {
+        continue;
+    }
+    for (nb_snapshots--; i < nb_snapshots; i++) {
+        snapshots[i] = snapshots[i + 1];
+    }
+    free(hidden->axes[AXIS_COLS].ranges);
+    free(hidden->axes[AXIS_ROWS].ranges);
+    free(hidden);
+}
+
+static int
+is_in_range(const struct ranges *r, int64_t x)
+{
+    int k;
+
+    return (k = last_range_before(r, x + 1)) >= 0 && x < r->ranges[k].end;
+}
+
+static int
+last_range_before(const struct ranges *r, int64_t x)
+{
+    // return the index of the last range starting before x, or -1
+    int lo, hi, mid;
+
+    for (lo = -1, hi = r->nb_ranges - 1; lo < hi;) {
+        mid = hi - (hi - lo)/2;
+        if (r->ranges[mid].first < x) {
+            lo = mid;
+        } else {
+            hi = mid - 1;
+        }
+    }
+    return lo;
+}
+
+static int
+last_range_shown_before(const struct ranges *r, int64_t n)
+{
+    // return the index of the last range with at most n shown lines before
+    // it, or -1
+    int lo, hi, mid;
+
+    for (lo = -1, hi = r->nb_ranges - 1; lo < hi;) {
+        mid = hi - (hi - lo)/2;
+        if (r->ranges[mid].first - r->ranges[mid].nb_before <= n) {
+            lo = mid;
+        } else {
+            hi = mid - 1;
+        }
+    }
+    return lo;
+}
+
+static int64_t
+line_of(const struct ranges *r, int64_t n)
+{
+    // return the shown line of ordinal n
+    int k;
+    const struct range *range;
+
+    if ((k = last_range_shown_before(r, n)) < 0) {
+        return n;
+    }
+    range = &r->ranges[k];
+    return n + range->nb_before + range->end - range->first;
+}
+
+static int64_t
+ordinal_of(const struct ranges *r, int64_t x)
+{
+    // return the number of shown lines before x
+    int k;
+    const struct range *range;
+
+    if ((k = last_range_before(r, x)) < 0) {
+        return x;
+    }
+    range = &r->ranges[k];
+    return x - (range->nb_before + MIN(x, range->end) - range->first);
+}
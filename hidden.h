@@ -0,0 +1,27 @@
+#ifndef HIDDEN_H
+#define HIDDEN_H
+
+#include <stdint.h>
+
+#include "types.h"
+
+enum axis {
+    AXIS_COLS,
+    AXIS_ROWS,
+};
+
+void free_hidden(void);
+const struct hidden *get_hidden(sheet_id sheet_id);
+void hold_hidden(const struct hidden *hidden);
+int64_t next_shown(const struct hidden *hidden, enum axis axis, int64_t x,
+    int64_t n);
+int64_t nth_shown(const struct hidden *hidden, enum axis axis, int64_t n);
+void release_hidden(const struct hidden *hidden);
+void set_hidden(sheet_id sheet_id, enum axis axis, int64_t first,
+    int64_t end, int hidden);
+int64_t shown_before(const struct hidden *hidden, enum axis axis,
+    int64_t x);
+int64_t shown_between(const struct hidden *hidden, enum axis axis,
+    int64_t first, int64_t x);
+
+#endif // HIDDEN_H
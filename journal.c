@@ -0,0 +1,206 @@
+// write-ahead journal: local modifications are appended to the journal, in
+// the grid file format, before being applied; they are made durable by
+// groups, once JOURNAL_GROUP_SIZE bytes are pending or JOURNAL_GROUP_DELAY
+// milliseconds after the first pending one, so that typing does not wait for
+// the disk; after a crash, the journal is replayed over the grid file, and it
+// is compacted after each save
+// only used by the state manager
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "config.h"
+#include "file_format.h"
+#include "journal.h"
+#include "types.h"
+
+static FILE *fp;
+static char *journal_path;
+static off_t committed, size; // written bytes, pending ones included
+static sheet_id current_sheet; // -1 if unknown
+static struct timespec deadline;
+
+static int sync_directory(const char *path);
+
+void
+journal_append(const struct definition *definition)
+{
+    if (!fp) {
+        return;
+    }
+    if (committed == size) {
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_nsec += JOURNAL_GROUP_DELAY*1000000L;
+        deadline.tv_sec += deadline.tv_nsec/1000000000L;
+        deadline.tv_nsec %= 1000000000L;
+    }
+    if (definition->area.sheet_id != current_sheet) {
+        current_sheet = definition->area.sheet_id;
+        size += write_sheet(fp, current_sheet);
+    }
+    size += write_definition(fp, definition);
+    if (size - committed >= JOURNAL_GROUP_SIZE) {
+        journal_commit();
+    }
+}
+
+void
+journal_close(void)
+{
+    if (fp) {
+        journal_commit();
+        fclose(fp);
+        fp = NULL;
+    }
+    free(journal_path);
+    journal_path = NULL;
+}
+
+int
+journal_commit(void)
+{
+    // make the pending modifications durable, return a non-null result on
+    // failure
+    if (!fp || committed == size) {
+        return 0;
+    } else if (fflush(fp) || fdatasync(fileno(fp))) {
+        return -1;
+    }
+    committed = size;
+    return 0;
+}
+
+int
+journal_compact(off_t offset)
+{
+    // remove the first offset bytes, return a non-null result on failure
+    char buf[1 << 16], *new_path;
+    int res;
+    size_t n;
+    FILE *old_fp, *new_fp;
+
+    if (!fp || fflush(fp)) {
+        return -1;
+    }
+    new_path = malloc(strlen(journal_path) + sizeof(".new"));
+    sprintf(new_path, "%s.new", journal_path);
+    if (!(new_fp = fopen(new_path, "w"))) {
+        free(new_path);
+        return -1;
+    } else if (!(old_fp = fopen(journal_path, "r")) ||
+        fseeko(old_fp, offset, SEEK_SET)) {
+        res = -1;
+    } else {
+        // the remaining modifications follow the last save, and are few
+        while ((n = fread(buf, 1, sizeof(buf), old_fp))) {
+            fwrite(buf, 1, n, new_fp);
+        }
+        res = ferror(old_fp);
+    }
+    if (old_fp) {
+        fclose(old_fp);
+    }
+    res = fflush(new_fp) || ferror(new_fp) || fsync(fileno(new_fp)) || res;
+    res = fclose(new_fp) || res;
+    if (res || rename(new_path, journal_path)) {
+        unlink(new_path);
+        free(new_path);
+        return -1;
+    }
+    free(new_path);
+
+    // keep on appending to the compacted journal, all synced
+    fclose(fp);
+    fp = fopen(journal_path, "a");
+    size -= offset;
+    committed = size;
+    return sync_directory(journal_path);
+}
+
+const struct timespec *
+journal_deadline(void)
+{
+    // return the time at which pending modifications should be committed, or
+    // NULL if there are none
+    return fp && committed < size ? &deadline : NULL;
+}
+
+off_t
+journal_mark(void)
+{
+    // return the current offset, from which the journal can be replayed on
+    // its own
+    current_sheet = -1;
+    return size;
+}
+
+void
+journal_poll(void)
+{
+    // commit if the delay of the pending modifications expired
+    struct timespec now;
+
+    if (!journal_deadline()) {
+        return;
+    }
+    clock_gettime(CLOCK_REALTIME, &now);
+    if (now.tv_sec > deadline.tv_sec || (now.tv_sec == deadline.tv_sec &&
+        now.tv_nsec >= deadline.tv_nsec)) {
+        journal_commit();
+    }
+}
+
+int
+journal_open(const char *path)
+{
+    // open path for appending, return a non-null result on failure
+    struct stat st;
+
+    journal_close();
+    if (!(fp = fopen(path, "a"))) {
+        return -1;
+    }
+    journal_path = malloc(strlen(path) + 1);
+    strcpy(journal_path, path);
+    size = committed = fstat(fileno(fp), &st) ? 0 : st.st_size;
+    current_sheet = -1;
+
+    // a crash may have left a partial line
+    if (size) {
+        fputc('\n', fp);
+        size++;
+    }
+    return 0;
+}
+
+static int
+sync_directory(const char *path)
+{
+    // make the renames in the directory containing path durable, return a
+    // non-null result on failure
+    char *dir_path, *slash;
+    int fd, res;
+
+    dir_path = malloc(strlen(path) + sizeof("."));
+    strcpy(dir_path, path);
+    if (!(slash = strrchr(dir_path, '/'))) {
+        strcpy(dir_path, ".");
+    } else if (slash == dir_path) {
+        slash[1] = '\0';
+    } else {
+        *slash = '\0';
+    }
+    fd = open(dir_path, O_RDONLY);
+    free(dir_path);
+    if (fd < 0) {
+        return -1;
+    }
+    res = fsync(fd);
+    close(fd);
+    return res;
+}
@@ -0,0 +1,18 @@
+#ifndef JOURNAL_H
+#define JOURNAL_H
+
+#include <sys/types.h>
+#include <time.h>
+
+#include "types.h"
+
+void journal_append(const struct definition *definition);
+void journal_close(void);
+int journal_commit(void);
+int journal_compact(off_t offset);
+const struct timespec *journal_deadline(void);
+off_t journal_mark(void);
+int journal_open(const char *path);
+void journal_poll(void);
+
+#endif // JOURNAL_H
@@ -0,0 +1,302 @@
+// aggregate kernels over the typed arrays of storage tiles, where each bit of
+// masks selects the corresponding number, by words of 64 numbers, and byte
+// scanning kernels for text parsing
+// the implementations are chosen at runtime depending on the CPU features
+
+#include <math.h>
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "kernels.h"
+#include "types.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define KERNELS_X86
+#include <immintrin.h>
+#endif // __GNUC__ && (__x86_64__ || __i386__)
+
+typedef void aggregate_kernel(struct aggregate *aggregate,
+    const double *numbers, const uint64_t *masks, int nb_words);
+typedef size_t count_kernel(const char *p, const char *end, char c);
+typedef const char *find_kernel(const char *p, const char *end, char a,
+    char b);
+
+static aggregate_kernel aggregate_scalar;
+static count_kernel count_scalar;
+static find_kernel find_scalar;
+#ifdef KERNELS_X86
+static aggregate_kernel aggregate_avx2, aggregate_sse2;
+static count_kernel count_avx2, count_sse2;
+static find_kernel find_avx2, find_sse2;
+#endif // KERNELS_X86
+static void select_kernels(void);
+
+static aggregate_kernel *aggregate_impl;
+static count_kernel *count_impl;
+static find_kernel *find_impl;
+static pthread_once_t kernels_selected = PTHREAD_ONCE_INIT;
+
+void
+aggregate_init(struct aggregate *aggregate)
+{
+    *aggregate = (struct aggregate) {
+        .count = 0,
+        .sum = 0,
+        .min = INFINITY,
+        .max = -INFINITY,
+    };
+}
+
+void
+aggregate_numbers(struct aggregate *aggregate, const double *numbers,
+    const uint64_t *masks, int nb_words)
+{
+    // numbers must be of length 64*nb_words
+    pthread_once(&kernels_selected, select_kernels);
+    aggregate_impl(aggregate, numbers, masks, nb_words);
+}
+
+size_t
+count_byte(const char *p, const char *end, char c)
+{
+    // return the number of occurrences of c in [p, end)
+    pthread_once(&kernels_selected, select_kernels);
+    return count_impl(p, end, c);
+}
+
+const char *
+find_either(const char *p, const char *end, char a, char b)
+{
+    // return the first occurrence of a or b in [p, end), or end
+    pthread_once(&kernels_selected, select_kernels);
+    return find_impl(p, end, a, b);
+}
+
+static void
+aggregate_scalar(struct aggregate *aggregate, const double *numbers,
+    const uint64_t *masks, int nb_words)
+{
+    int bit;
+    uint64_t mask;
+    double number;
+
+    for (int w = 0; w < nb_words; w++) {
+        for (mask = masks[w]; mask; mask &= mask - 1) {
+            bit = __builtin_ctzll(mask);
+            number = numbers[64*w + bit];
+            aggregate->sum += number;
+            aggregate->min = MIN(aggregate->min, number);
+            aggregate->max = MAX(aggregate->max, number);
+            aggregate->count++;
+        }
+    }
+}
+
+static size_t
+count_scalar(const char *p, const char *end, char c)
+{
+    size_t count;
+
+    for (count = 0; p < end; p++) {
+        count += *p == c;
+    }
+    return count;
+}
+
+static const char *
+find_scalar(const char *p, const char *end, char a, char b)
+{
+    while (p < end && *p != a && *p != b) {
+        p++;
+    }
+    return p;
+}
+
+#ifdef KERNELS_X86
+__attribute__((target("avx2"))) static void
+aggregate_avx2(struct aggregate *aggregate, const double *numbers,
+    const uint64_t *masks, int nb_words)
+{
+    uint64_t mask;
+    double res[4];
+    __m256d sum, min, max, v, sel, inf, ninf;
+    __m256i bits;
+    const double *p;
+
+    sum = _mm256_setzero_pd();
+    min = inf = _mm256_set1_pd(INFINITY);
+    max = ninf = _mm256_set1_pd(-INFINITY);
+    bits = _mm256_set_epi64x(8, 4, 2, 1);
+    for (int w = 0; w < nb_words; w++) {
+        if (!(mask = masks[w])) {
+            continue;
+        }
+        aggregate->count += __builtin_popcountll(mask);
+        p = numbers + 64*w;
+        if (mask == UINT64_MAX) {
+            for (int k = 0; k < 64; k += 4) {
+                v = _mm256_loadu_pd(p + k);
+                sum = _mm256_add_pd(sum, v);
+                min = _mm256_min_pd(min, v);
+                max = _mm256_max_pd(max, v);
+            }
+            continue;
+        }
+        for (int k = 0; k < 64; k += 4, mask >>= 4) {
+            if (!(mask & 15)) {
+                continue;
+            }
+            sel = _mm256_castsi256_pd(_mm256_cmpeq_epi64(bits,
+                _mm256_and_si256(bits, _mm256_set1_epi64x(mask & 15))));
+            v = _mm256_loadu_pd(p + k);
+            sum = _mm256_add_pd(sum, _mm256_and_pd(v, sel));
+            min = _mm256_min_pd(min, _mm256_blendv_pd(inf, v, sel));
+            max = _mm256_max_pd(max, _mm256_blendv_pd(ninf, v, sel));
+        }
+    }
+
+    // reduce lanes
+    _mm256_storeu_pd(res, sum);
+    aggregate->sum += (res[0] + res[1]) + (res[2] + res[3]);
+    _mm256_storeu_pd(res, min);
+    aggregate->min = MIN(aggregate->min, MIN(MIN(res[0], res[1]),
+        MIN(res[2], res[3])));
+    _mm256_storeu_pd(res, max);
+    aggregate->max = MAX(aggregate->max, MAX(MAX(res[0], res[1]),
+        MAX(res[2], res[3])));
+}
+
+__attribute__((target("sse2"))) static void
+aggregate_sse2(struct aggregate *aggregate, const double *numbers,
+    const uint64_t *masks, int nb_words)
+{
+    uint64_t mask;
+    double res[2];
+    __m128d sum, min, max, v, sel, inf, ninf;
+    const double *p;
+
+    sum = _mm_setzero_pd();
+    min = inf = _mm_set1_pd(INFINITY);
+    max = ninf = _mm_set1_pd(-INFINITY);
+    for (int w = 0; w < nb_words; w++) {
+        if (!(mask = masks[w])) {
+            continue;
+        }
+        aggregate->count += __builtin_popcountll(mask);
+        p = numbers + 64*w;
+        if (mask == UINT64_MAX) {
+            for (int k = 0; k < 64; k += 2) {
+                v = _mm_loadu_pd(p + k);
+                sum = _mm_add_pd(sum, v);
+                min = _mm_min_pd(min, v);
+                max = _mm_max_pd(max, v);
+            }
+            continue;
+        }
+        for (int k = 0; k < 64; k += 2, mask >>= 2) {
+            if (!(mask & 3)) {
+                continue;
+            }
+            sel = _mm_castsi128_pd(_mm_set_epi64x(-(long long) (mask >> 1 & 1),
+                -(long long) (mask & 1)));
+            v = _mm_and_pd(_mm_loadu_pd(p + k), sel);
+            sum = _mm_add_pd(sum, v);
+            min = _mm_min_pd(min, _mm_or_pd(v, _mm_andnot_pd(sel, inf)));
+            max = _mm_max_pd(max, _mm_or_pd(v, _mm_andnot_pd(sel, ninf)));
+        }
+    }
+
+    // reduce lanes
+    _mm_storeu_pd(res, sum);
+    aggregate->sum += res[0] + res[1];
+    _mm_storeu_pd(res, min);
+    aggregate->min = MIN(aggregate->min, MIN(res[0], res[1]));
+    _mm_storeu_pd(res, max);
+    aggregate->max = MAX(aggregate->max, MAX(res[0], res[1]));
+}
+
+__attribute__((target("avx2"))) static size_t
+count_avx2(const char *p, const char *end, char c)
+{
+    size_t count;
+    __m256i v;
+
+    v = _mm256_set1_epi8(c);
+    for (count = 0; end - p >= 32; p += 32) {
+        count += __builtin_popcount(_mm256_movemask_epi8(_mm256_cmpeq_epi8(v,
+            _mm256_loadu_si256((const __m256i *) p))));
+    }
+    return count + count_scalar(p, end, c);
+}
+
+__attribute__((target("sse2"))) static size_t
+count_sse2(const char *p, const char *end, char c)
+{
+    size_t count;
+    __m128i v;
+
+    v = _mm_set1_epi8(c);
+    for (count = 0; end - p >= 16; p += 16) {
+        count += __builtin_popcount(_mm_movemask_epi8(_mm_cmpeq_epi8(v,
+            _mm_loadu_si128((const __m128i *) p))));
+    }
+    return count + count_scalar(p, end, c);
+}
+
+__attribute__((target("avx2"))) static const char *
+find_avx2(const char *p, const char *end, char a, char b)
+{
+    unsigned mask;
+    __m256i va, vb, v;
+
+    va = _mm256_set1_epi8(a);
+    vb = _mm256_set1_epi8(b);
+    for (; end - p >= 32; p += 32) {
+        v = _mm256_loadu_si256((const __m256i *) p);
+        if ((mask = _mm256_movemask_epi8(_mm256_or_si256(
+            _mm256_cmpeq_epi8(v, va), _mm256_cmpeq_epi8(v, vb))))) {
+            return p + __builtin_ctz(mask);
+        }
+    }
+    return find_scalar(p, end, a, b);
+}
+
+__attribute__((target("sse2"))) static const char *
+find_sse2(const char *p, const char *end, char a, char b)
+{
+    unsigned mask;
+    __m128i va, vb, v;
+
+    va = _mm_set1_epi8(a);
+    vb = _mm_set1_epi8(b);
+    for (; end - p >= 16; p += 16) {
+        v = _mm_loadu_si128((const __m128i *) p);
+        if ((mask = _mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(v, va),
+            _mm_cmpeq_epi8(v, vb))))) {
+            return p + __builtin_ctz(mask);
+        }
+    }
+    return find_scalar(p, end, a, b);
+}
+#endif // KERNELS_X86
+
+static void
+select_kernels(void)
+{
+    aggregate_impl = aggregate_scalar;
+    count_impl = count_scalar;
+    find_impl = find_scalar;
+#ifdef KERNELS_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        aggregate_impl = aggregate_avx2;
+        count_impl = count_avx2;
+        find_impl = find_avx2;
+    } else if (__builtin_cpu_supports("sse2")) {
+        aggregate_impl = aggregate_sse2;
+        count_impl = count_sse2;
+        find_impl = find_sse2;
+    }
+#endif // KERNELS_X86
+}
@@ -0,0 +1,18 @@
+#ifndef KERNELS_H
+#define KERNELS_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+struct aggregate {
+    long count; // numbers only
+    double sum, min, max;
+};
+
+void aggregate_init(struct aggregate *aggregate);
+void aggregate_numbers(struct aggregate *aggregate, const double *numbers,
+    const uint64_t *masks, int nb_words);
+size_t count_byte(const char *p, const char *end, char c);
+const char *find_either(const char *p, const char *end, char a, char b);
+
+#endif // KERNELS_H
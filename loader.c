@@ -0,0 +1,359 @@
+// streaming loader: files are mapped in memory and split in chunks at record
+// boundaries, parsed in place by worker threads while the calling thread
+// applies the parsed chunks in order, so that memory usage is bounded by the
+// LOADER_WINDOW chunks in flight
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "config.h"
+#include "evaluation.h"
+#include "file_format.h"
+#include "loader.h"
+#include "string_pool.h"
+#include "types.h"
+
+#define UNKNOWN_SHEET                       (-1)
+
+struct chunk {
+    // definitions of area.row_span 0 are sheet switches, UNKNOWN_SHEET
+    // stands for the sheet of the previous chunk
+    struct definition *definitions;
+    struct file_line *lines; // of the definitions, areas filled when applied
+    int nb_definitions, nb_invalid;
+};
+
+struct grid_load {
+    const char *data;
+    int nb_invalid, definitions_capacity;
+    sheet_id current_sheet;
+    struct file_layout *layout;
+    struct definition **definitions; // kept instead of loaded, if not NULL
+};
+
+struct pipeline {
+    const char *const *bounds;
+    void *(*parse)(const char *start, const char *end, int i, void *arg);
+    void *arg;
+    void **parsed;
+    char *is_parsed;
+    int nb_chunks, next_chunk, nb_applied;
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+};
+
+static void apply_chunk(void *parsed, void *arg);
+static void *parse_chunk(const char *start, const char *end, int i,
+    void *arg);
+static void *parse_routine(void *arg);
+static int read_grid(const char *path, struct file_layout *layout,
+    struct definition **definitions);
+
+int
+load_file(const char *path, struct file_layout *layout)
+{
+    // load the definitions of path, and describe them in layout (if not
+    // NULL), return the number of invalid lines, or -1 if the file could not
+    // be read (a missing file is an empty one)
+    return read_grid(path, layout, NULL);
+}
+
+int
+map_file(const char *path, const char **data, struct stat *st)
+{
+    // map path read-only in memory (data is NULL for an empty file), return
+    // a non-null result on failure
+    int fd;
+    void *map;
+
+    if ((fd = open(path, O_RDONLY)) < 0) {
+        return -1;
+    } else if (fstat(fd, st)) {
+        close(fd);
+        return -1;
+    } else if (!st->st_size) {
+        close(fd);
+        *data = NULL;
+        return 0;
+    }
+    map = mmap(NULL, st->st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        return -1;
+    }
+    madvise(map, st->st_size, MADV_SEQUENTIAL);
+    *data = map;
+    return 0;
+}
+
+int
+parse_file(const char *path, struct file_layout *layout,
+    struct definition **definitions)
+{
+    // load_file, with the definitions kept in *definitions instead of being
+    // loaded, one per line of layout (the array and the references of the
+    // definitions are owned by the caller)
+    return read_grid(path, layout, definitions);
+}
+
+void
+process_chunks(const char *const *bounds, int nb_chunks,
+    void *(*parse)(const char *start, const char *end, int i, void *arg),
+    void (*apply)(void *parsed, void *arg), void *arg)
+{
+    // parse the chunks [bounds[i], bounds[i + 1]) on worker threads, and
+    // apply them in order on the calling thread
+    int nb_threads;
+    long nb_cpus;
+    pthread_t *threads;
+    struct pipeline pipeline = {
+        .bounds = bounds,
+        .parse = parse,
+        .arg = arg,
+        .nb_chunks = nb_chunks,
+    };
+
+    pipeline.parsed = malloc(MAX(nb_chunks, 1)*sizeof(*pipeline.parsed));
+    pipeline.is_parsed = calloc(MAX(nb_chunks, 1), 1);
+    pthread_mutex_init(&pipeline.mutex, NULL);
+    pthread_cond_init(&pipeline.cond, NULL);
+
+    // a single chunk is parsed without spawning workers
+    nb_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    nb_threads = MIN(MIN(nb_chunks - 1, LOADER_WINDOW),
+        nb_cpus > 0 ? (int) nb_cpus : 1);
+    threads = malloc(MAX(nb_threads, 1)*sizeof(*threads));
+    for (int i = 0; i < nb_threads; i++) {
+        pthread_create(&threads[i], NULL, parse_routine, &pipeline);
+    }
+    if (nb_threads <= 0 && nb_chunks) {
+        pipeline.parsed[0] = parse(bounds[0], bounds[1], 0, arg);
+        pipeline.is_parsed[0] = 1;
+    }
+
+    for (int i = 0; i < nb_chunks; i++) {
+        pthread_mutex_lock(&pipeline.mutex);
+        while (!pipeline.is_parsed[i]) {
+            pthread_cond_wait(&pipeline.cond, &pipeline.mutex);
+        }
+        pthread_mutex_unlock(&pipeline.mutex);
+        apply(pipeline.parsed[i], arg);
+        pthread_mutex_lock(&pipeline.mutex);
+        pipeline.nb_applied++;
+        pthread_cond_broadcast(&pipeline.cond);
+        pthread_mutex_unlock(&pipeline.mutex);
+    }
+
+    for (int i = 0; i < nb_threads; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    free(threads);
+    pthread_cond_destroy(&pipeline.cond);
+    pthread_mutex_destroy(&pipeline.mutex);
+    free(pipeline.is_parsed);
+    free(pipeline.parsed);
+}
+
+int
+replay_journal(const char *path, struct file_layout *layout)
+{
+    // apply the modifications journaled in path over the loaded grid, one
+    // per line of layout, return the number of invalid lines or -1 if the
+    // journal can not be read (a missing journal is an empty one)
+    int res;
+    struct definition *definitions;
+
+    res = parse_file(path, layout, &definitions);
+    for (int i = 0; i < layout->nb_lines; i++) {
+        apply_definition(&definitions[i]);
+        value_unref(definitions[i].value);
+        value_unref(definitions[i].formula.key);
+    }
+    free(definitions);
+    return res;
+}
+
+static void
+apply_chunk(void *parsed, void *arg)
+{
+    int n;
+    struct chunk *chunk;
+    struct definition *definition;
+    struct grid_load *load;
+
+    chunk = parsed;
+    load = arg;
+    for (int i = 0; i < chunk->nb_definitions; i++) {
+        definition = &chunk->definitions[i];
+        if (!definition->area.row_span) {
+            load->current_sheet = definition->area.sheet_id;
+            continue;
+        }
+        if (definition->area.sheet_id == UNKNOWN_SHEET) {
+            definition->area.sheet_id = load->current_sheet;
+        }
+        if (definition->formula.range.sheet_id == UNKNOWN_SHEET) {
+            definition->formula.range.sheet_id = load->current_sheet;
+        }
+        if (load->definitions) {
+            n = load->layout->nb_lines;
+            if (n == load->definitions_capacity) {
+                load->definitions_capacity = n ? 2*n : 1 << 10;
+                *load->definitions = realloc(*load->definitions,
+                    load->definitions_capacity*sizeof(**load->definitions));
+            }
+            (*load->definitions)[n] = *definition;
+        } else {
+            load_definition(definition);
+        }
+        if (load->layout) {
+            chunk->lines[i].area = definition->area;
+            chunk->lines[i].is_clear =
+                definition->formula.function == FUNCTION_NONE &&
+                definition->value.type == VALUE_EMPTY;
+            chunk->lines[i].hash = definition_hash(definition);
+            file_layout_append(load->layout, chunk->lines[i]);
+        }
+        if (!load->definitions) {
+            value_unref(definition->value);
+            value_unref(definition->formula.key);
+        }
+    }
+    load->nb_invalid += chunk->nb_invalid;
+    free(chunk->definitions);
+    free(chunk->lines);
+    free(chunk);
+}
+
+static void *
+parse_chunk(const char *start, const char *end, int i, void *arg)
+{
+    int capacity;
+    const char *line, *line_end;
+    sheet_id current_sheet;
+    struct chunk *chunk;
+    struct definition definition;
+    struct grid_load *load;
+
+    load = arg;
+    chunk = calloc(1, sizeof(*chunk));
+
+    // the first sheet of the other chunks is only known once the previous
+    // ones are parsed
+    current_sheet = i ? UNKNOWN_SHEET : 0;
+    capacity = 0;
+    for (line = start; line < end; line = line_end + 1) {
+        if (!(line_end = memchr(line, '\n', end - line))) {
+            line_end = end;
+        }
+        switch (parse_line(line, line_end, current_sheet, &definition)) {
+        case LINE_BLANK:
+            continue;
+        case LINE_INVALID:
+            chunk->nb_invalid++;
+            continue;
+        case LINE_SHEET:
+            current_sheet = definition.area.sheet_id;
+            definition.area.row_span = 0;
+            break;
+        case LINE_DEFINITION:
+            break;
+        }
+        if (chunk->nb_definitions == capacity) {
+            capacity = capacity ? 2*capacity : 1 << 10;
+            chunk->definitions = realloc(chunk->definitions,
+                capacity*sizeof(*chunk->definitions));
+            chunk->lines = realloc(chunk->lines,
+                capacity*sizeof(*chunk->lines));
+        }
+        chunk->lines[chunk->nb_definitions].offset = line - load->data;
+        chunk->lines[chunk->nb_definitions].length = line_end - line +
+            (line_end < end);
+        chunk->definitions[chunk->nb_definitions++] = definition;
+    }
+    return chunk;
+}
+
+static int
+read_grid(const char *path, struct file_layout *layout,
+    struct definition **definitions)
+{
+    int nb_chunks;
+    const char *data, **bounds, *nominal;
+    struct grid_load load = {.layout = layout, .definitions = definitions};
+    struct stat st;
+
+    if (layout) {
+        free(layout->lines);
+        *layout = (struct file_layout) {0};
+    }
+    if (definitions) {
+        *definitions = NULL;
+    }
+    if (map_file(path, &data, &st)) {
+        return errno == ENOENT ? 0 : -1;
+    }
+    if (layout) {
+        layout->size = st.st_size;
+        layout->mtime = st.st_mtim;
+    }
+    if (!data) {
+        return 0;
+    }
+
+    // split at the first line boundary after each multiple of the chunk size
+    nb_chunks = (st.st_size + LOADER_CHUNK_SIZE - 1)/LOADER_CHUNK_SIZE;
+    bounds = malloc((nb_chunks + 1)*sizeof(*bounds));
+    bounds[0] = data;
+    for (int i = 1; i < nb_chunks; i++) {
+        nominal = data + (size_t) i*LOADER_CHUNK_SIZE - 1;
+        bounds[i] = memchr(nominal, '\n', data + st.st_size - nominal);
+        bounds[i] = bounds[i] ? bounds[i] + 1 : data + st.st_size;
+    }
+    bounds[nb_chunks] = data + st.st_size;
+
+    load.data = data;
+    process_chunks(bounds, nb_chunks, parse_chunk, apply_chunk, &load);
+    if (layout) {
+        layout->last_sheet = load.current_sheet;
+    }
+    free(bounds);
+    munmap((void *) data, st.st_size);
+    return load.nb_invalid;
+}
+
+static void *
+parse_routine(void *arg)
+{
+    // parse the next chunk, unless LOADER_WINDOW chunks are waiting to be
+    // applied
+    int i;
+    struct pipeline *pipeline;
+    void *parsed;
+
+    pipeline = arg;
+    pthread_mutex_lock(&pipeline->mutex);
+    while (pipeline->next_chunk < pipeline->nb_chunks) {
+        if (pipeline->next_chunk >= pipeline->nb_applied + LOADER_WINDOW) {
+            pthread_cond_wait(&pipeline->cond, &pipeline->mutex);
+            continue;
+        }
+        i = pipeline->next_chunk++;
+        pthread_mutex_unlock(&pipeline->mutex);
+        parsed = pipeline->parse(pipeline->bounds[i], pipeline->bounds[i + 1],
+            i, pipeline->arg);
+        pthread_mutex_lock(&pipeline->mutex);
+        pipeline->parsed[i] = parsed;
+        pipeline->is_parsed[i] = 1;
+        pthread_cond_broadcast(&pipeline->cond);
+    }
+    pthread_mutex_unlock(&pipeline->mutex);
+    return NULL;
+}
@@ -0,0 +1,17 @@
+#ifndef LOADER_H
+#define LOADER_H
+
+#include <sys/stat.h>
+
+#include "file_format.h"
+
+int load_file(const char *path, struct file_layout *layout);
+int map_file(const char *path, const char **data, struct stat *st);
+int parse_file(const char *path, struct file_layout *layout,
+    struct definition **definitions);
+void process_chunks(const char *const *bounds, int nb_chunks,
+    void *(*parse)(const char *start, const char *end, int i, void *arg),
+    void (*apply)(void *parsed, void *arg), void *arg);
+int replay_journal(const char *path, struct file_layout *layout);
+
+#endif // LOADER_H
@@ -0,0 +1,453 @@
+// indexes over the values of a range, built on first use and then patched
+// on each cell change, lazily: first positions of removed values are only
+// searched again when looked up, and sorted entries are merged by batches
+// positions are 0-based, and follow the order of the cells of the range by
+// columns
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "lookup.h"
+#include "storage.h"
+#include "string_pool.h"
+#include "types.h"
+
+#define INITIAL_NB_SLOTS                    (1 << 6)
+
+struct hash_slot {
+    struct value value; // VALUE_EMPTY for unused slots
+    // first position of value (a lower bound of it if is_stale), negative if
+    // none
+    int64_t position, nb_cells;
+    int is_stale;
+};
+struct find_position_arg {
+    struct area range;
+    struct value value;
+    int64_t position; // of the first cell holding value, or -1
+};
+struct sorted_entry {
+    double number;
+    int64_t position;
+    int is_removed; // since the last merge
+};
+struct lookup_index {
+    struct area range;
+    // exact matches, built on first use if !hash_slots
+    struct hash_slot *hash_slots;
+    size_t nb_slots, nb_used_slots;
+    // approximate matches, built on first use if !is_sorted_built; the
+    // entries inserted since the last merge are pending, unsorted
+    int is_sorted_built, nb_sorted, sorted_capacity, nb_removed;
+    int nb_pending, pending_capacity;
+    struct sorted_entry *sorted, *pending;
+};
+
+static int add_to_hash(struct address address, struct value value, void *arg);
+static int add_to_sorted(struct address address, struct value value,
+    void *arg);
+static int compare_sorted_entries(const void *a, const void *b);
+static int64_t find_position(struct lookup_index *index, struct value value,
+    int64_t start);
+static struct hash_slot *find_slot(struct lookup_index *index,
+    struct value value);
+static int64_t get_position(struct area range, struct address address);
+static uint64_t hash_value(struct value value);
+static void insert_sorted(struct lookup_index *index, double number,
+    int64_t position);
+static int match_position(struct address address, struct value value,
+    void *arg);
+static void merge_sorted(struct lookup_index *index);
+static void remove_sorted(struct lookup_index *index, double number,
+    int64_t position);
+static int search_sorted(struct lookup_index *index, double number,
+    int64_t position);
+
+int64_t
+lookup_approx(struct lookup_index *index, double key)
+{
+    // return the position of the largest number lower or equal to key (the
+    // last one if there are several), or a negative result if there is none
+    int i;
+    const struct sorted_entry *best;
+
+    if (!index->is_sorted_built) {
+        storage_visit_values(index->range, add_to_sorted, index);
+        if (index->nb_sorted) {
+            qsort(index->sorted, index->nb_sorted, sizeof(*index->sorted),
+                compare_sorted_entries);
+        }
+        index->is_sorted_built = 1;
+    }
+    i = search_sorted(index, key, INT64_MAX);
+    while (i > 0 && index->sorted[i - 1].is_removed) {
+        i--;
+    }
+    best = i > 0 ? &index->sorted[i - 1] : NULL;
+    for (i = 0; i < index->nb_pending; i++) {
+        if (index->pending[i].number <= key && (!best ||
+            compare_sorted_entries(&index->pending[i], best) > 0)) {
+            best = &index->pending[i];
+        }
+    }
+    return best ? best->position : -1;
+}
+
+int64_t
+lookup_exact(struct lookup_index *index, struct value key)
+{
+    // return the first position of key, or a negative result if not found
+    struct hash_slot *slot;
+
+    if (!index->hash_slots) {
+        index->nb_slots = INITIAL_NB_SLOTS;
+        index->hash_slots = calloc(index->nb_slots,
+            sizeof(*index->hash_slots));
+        storage_visit_values(index->range, add_to_hash, index);
+    }
+    if (key.type == VALUE_EMPTY) {
+        return -1;
+    }
+    slot = find_slot(index, key);
+    if (slot->is_stale) {
+        slot->position = find_position(index, key, slot->position);
+        slot->is_stale = 0;
+    }
+    return slot->position;
+}
+
+struct lookup_index *
+lookup_index_create(struct area range)
+{
+    struct lookup_index *index;
+
+    index = calloc(1, sizeof(*index));
+    index->range = range;
+    return index;
+}
+
+void
+lookup_index_destroy(struct lookup_index *index)
+{
+    if (!index) {
+        return;
+    }
+    for (size_t i = 0; index->hash_slots && i < index->nb_slots; i++) {
+        value_unref(index->hash_slots[i].value);
+    }
+    free(index->hash_slots);
+    free(index->sorted);
+    free(index->pending);
+    free(index);
+}
+
+void
+lookup_index_update(struct lookup_index *index, struct address address,
+    struct value old, struct value new)
+{
+    // patch the built indexes for the change of the cell at address (which
+    // must be in range) from old to new, before the change is stored
+    int64_t position;
+    struct hash_slot *slot;
+
+    position = get_position(index->range, address);
+    if (index->hash_slots) {
+        slot = find_slot(index, old);
+        if (old.type != VALUE_EMPTY && !--slot->nb_cells) {
+            slot->position = -1;
+            slot->is_stale = 0;
+        } else if (old.type != VALUE_EMPTY && slot->position == position) {
+            // the new first position can only be after the changed one
+            slot->position = position + 1;
+            slot->is_stale = 1;
+        }
+        add_to_hash(address, new, index);
+    }
+    if (index->is_sorted_built) {
+        if (old.type == VALUE_NUMBER) {
+            remove_sorted(index, old.as.number, position);
+        }
+        if (new.type == VALUE_NUMBER) {
+            insert_sorted(index, new.as.number, position);
+        }
+    }
+}
+
+static int
+add_to_hash(struct address address, struct value value, void *arg)
+{
+    int64_t position;
+    size_t old_nb_slots;
+    struct hash_slot *old_slots, *slot;
+    struct lookup_index *index;
+
+    index = arg;
+    if (value.type == VALUE_EMPTY) {
+        return 0;
+    }
+    position = get_position(index->range, address);
+    slot = find_slot(index, value);
+    if (slot->value.type == VALUE_EMPTY) {
+        value_ref(value);
+        slot->value = value;
+        slot->position = position;
+        index->nb_used_slots++;
+    } else if (slot->position < 0 || position < slot->position) {
+        // before a lower bound, position is the first one
+        slot->position = position;
+        slot->is_stale = 0;
+    }
+    slot->nb_cells++;
+
+    // keep the load factor under 1/2
+    if (2*index->nb_used_slots <= index->nb_slots) {
+        return 0;
+    }
+    old_slots = index->hash_slots;
+    old_nb_slots = index->nb_slots;
+    index->nb_slots *= 2;
+    index->hash_slots = calloc(index->nb_slots, sizeof(*index->hash_slots));
+    for (size_t i = 0; i < old_nb_slots; i++) {
+        if (old_slots[i].value.type != VALUE_EMPTY) {
+            *find_slot(index, old_slots[i].value) = old_slots[i];
+        }
+    }
+    free(old_slots);
+    return 0;
+}
+
+static int
+add_to_sorted(struct address address, struct value value, void *arg)
+{
+    struct lookup_index *index;
+
+    index = arg;
+    if (value.type != VALUE_NUMBER) {
+        return 0;
+    }
+    if (index->nb_sorted == index->sorted_capacity) {
+        index->sorted_capacity = index->sorted_capacity ?
+            2*index->sorted_capacity : 64;
+        index->sorted = realloc(index->sorted,
+            index->sorted_capacity*sizeof(*index->sorted));
+    }
+    index->sorted[index->nb_sorted++] = (struct sorted_entry) {
+        .number = value.as.number,
+        .position = get_position(index->range, address),
+    };
+    return 0;
+}
+
+static int
+compare_sorted_entries(const void *a, const void *b)
+{
+    const struct sorted_entry *x = a, *y = b;
+
+    if (x->number != y->number) {
+        return x->number < y->number ? -1 : 1;
+    }
+    return (x->position > y->position) - (x->position < y->position);
+}
+
+static int64_t
+find_position(struct lookup_index *index, struct value value,
+    int64_t start)
+{
+    // return the first position of value from start, or a negative result,
+    // from the stored cells of the rest of the column of start, then of the
+    // next columns
+    struct area area, range;
+    struct find_position_arg find_position_arg;
+
+    range = index->range;
+    if (start >= range.row_span*range.col_span) {
+        return -1;
+    }
+    find_position_arg = (struct find_position_arg) {
+        .range = range,
+        .value = value,
+        .position = -1,
+    };
+    area = (struct area) {
+        .sheet_id = range.sheet_id,
+        .row = range.row + start%range.row_span,
+        .col = range.col + start/range.row_span,
+        .row_span = range.row_span - start%range.row_span,
+        .col_span = 1,
+    };
+    if (!storage_visit_values(area, match_position, &find_position_arg)) {
+        area.row = range.row;
+        area.row_span = range.row_span;
+        area.col_span = range.col + range.col_span - ++area.col;
+        storage_visit_values(area, match_position, &find_position_arg);
+    }
+    return find_position_arg.position;
+}
+
+static struct hash_slot *
+find_slot(struct lookup_index *index, struct value value)
+{
+    // return the slot of value, or the unused slot where it would be inserted
+    size_t i;
+
+    i = hash_value(value) & (index->nb_slots - 1);
+    while (index->hash_slots[i].value.type != VALUE_EMPTY &&
+        !value_equal(index->hash_slots[i].value, value)) {
+        i = (i + 1) & (index->nb_slots - 1);
+    }
+    return &index->hash_slots[i];
+}
+
+static int64_t
+get_position(struct area range, struct address address)
+{
+    return (address.col - range.col)*range.row_span + address.row - range.row;
+}
+
+static uint64_t
+hash_value(struct value value)
+{
+    uint64_t h;
+    double number;
+
+    switch (value.type) {
+    case VALUE_BOOLEAN:
+        h = value.as.boolean;
+        break;
+    case VALUE_ERROR:
+        h = value.as.error;
+        break;
+    case VALUE_STRING:
+        h = (uintptr_t) value.as.string; // interned
+        break;
+    default:
+        number = value.as.number == 0 ? 0 : value.as.number; // -0 == 0
+        memcpy(&h, &number, sizeof(h));
+        break;
+    }
+    // murmur3 finalizer, as the low bits of numbers are often null
+    h ^= value.type;
+    h = (h ^ (h >> 33))*0xff51afd7ed558ccdu;
+    h = (h ^ (h >> 33))*0xc4ceb9fe1a85ec53u;
+    return h ^ (h >> 33);
+}
+
+static void
+insert_sorted(struct lookup_index *index, double number, int64_t position)
+{
+    int i;
+
+    i = search_sorted(index, number, position);
+    if (i < index->nb_sorted && index->sorted[i].number == number &&
+        index->sorted[i].position == position) {
+        index->sorted[i].is_removed = 0;
+        index->nb_removed--;
+        return;
+    }
+    if (index->nb_pending == index->pending_capacity) {
+        index->pending_capacity = index->pending_capacity ?
+            2*index->pending_capacity : 16;
+        index->pending = realloc(index->pending,
+            index->pending_capacity*sizeof(*index->pending));
+    }
+    index->pending[index->nb_pending++] = (struct sorted_entry) {
+        .number = number,
+        .position = position,
+    };
+    merge_sorted(index);
+}
+
+static int
+match_position(struct address address, struct value value, void *arg)
+{
+    struct find_position_arg *find_position_arg;
+
+    find_position_arg = arg;
+    if (!value_equal(value, find_position_arg->value)) {
+        return 0;
+    }
+    find_position_arg->position = get_position(find_position_arg->range,
+        address);
+    return 1;
+}
+
+static void
+merge_sorted(struct lookup_index *index)
+{
+    // merge the pending entries with the sorted ones, without the removed
+    // ones, once scanning them costs more than the merge (k^2 > n)
+    int i, j, n;
+    int64_t k;
+    struct sorted_entry *merged;
+
+    k = index->nb_pending + index->nb_removed;
+    if (k*k <= index->nb_sorted) {
+        return;
+    }
+    if (index->nb_pending) {
+        qsort(index->pending, index->nb_pending, sizeof(*index->pending),
+            compare_sorted_entries);
+    }
+    n = index->nb_sorted - index->nb_removed + index->nb_pending;
+    merged = malloc(MAX(n, 1)*sizeof(*merged));
+    for (i = j = n = 0; i < index->nb_sorted || j < index->nb_pending; ) {
+        if (i < index->nb_sorted && index->sorted[i].is_removed) {
+            i++;
+        } else if (j == index->nb_pending || (i < index->nb_sorted &&
+            compare_sorted_entries(&index->sorted[i],
+            &index->pending[j]) < 0)) {
+            merged[n++] = index->sorted[i++];
+        } else {
+            merged[n++] = index->pending[j++];
+        }
+    }
+    free(index->sorted);
+    index->sorted = merged;
+    index->sorted_capacity = MAX(n, 1);
+    index->nb_sorted = n;
+    index->nb_pending = index->nb_removed = 0;
+}
+
+static void
+remove_sorted(struct lookup_index *index, double number, int64_t position)
+{
+    int i;
+
+    i = search_sorted(index, number, position);
+    if (i < index->nb_sorted && index->sorted[i].number == number &&
+        index->sorted[i].position == position) {
+        index->sorted[i].is_removed = 1;
+        index->nb_removed++;
+        merge_sorted(index);
+        return;
+    }
+    for (i = 0; i < index->nb_pending; i++) {
+        if (index->pending[i].number == number &&
+            index->pending[i].position == position) {
+            index->pending[i] = index->pending[--index->nb_pending];
+            return;
+        }
+    }
+}
+
+static int
+search_sorted(struct lookup_index *index, double number, int64_t position)
+{
+    // return the index of the first entry not lower than (number, position)
+    int lo, hi, mid;
+    struct sorted_entry key;
+
+    key = (struct sorted_entry) {.number = number, .position = position};
+    lo = 0;
+    hi = index->nb_sorted;
+    while (lo < hi) {
+        mid = lo + (hi - lo)/2;
+        if (compare_sorted_entries(&index->sorted[mid], &key) < 0) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
@@ -0,0 +1,17 @@
+#ifndef LOOKUP_H
+#define LOOKUP_H
+
+#include <stdint.h>
+
+#include "types.h"
+
+struct lookup_index;
+
+int64_t lookup_approx(struct lookup_index *index, double key);
+int64_t lookup_exact(struct lookup_index *index, struct value key);
+struct lookup_index *lookup_index_create(struct area range);
+void lookup_index_destroy(struct lookup_index *index);
+void lookup_index_update(struct lookup_index *index, struct address address,
+    struct value old, struct value new);
+
+#endif // LOOKUP_H
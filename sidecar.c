@@ -0,0 +1,590 @@
+// sidecar cache: the cells of a large grid file are dumped next to it along
+// with their formulas, last computed values and the layout of the file, as
+// plain arrays mapped back as is when the file is opened again, so that it is
+// neither parsed nor computed again
+// a sidecar is only used if the size, modification time and hash of the grid
+// file are still the ones it was written for, and if its checksum matches
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "config.h"
+#include "evaluation.h"
+#include "file_format.h"
+#include "loader.h"
+#include "sidecar.h"
+#include "storage.h"
+#include "string_pool.h"
+#include "types.h"
+
+#define BYTE_ORDER_MARK                     0x01020304
+#define MAGIC                               "gridsc03"
+#define MIX                                 UINT64_C(0x9e3779b97f4a7c15)
+
+struct header {
+    // each section is an array starting at the given offset, 8-byte aligned
+    char magic[8];
+    uint32_t byte_order;
+    int32_t last_sheet;
+    uint64_t size, hash; // of the grid file
+    int64_t mtime_sec, mtime_nsec;
+    uint64_t checksum; // of the sections
+    uint64_t nb_lines, lines;
+    uint64_t nb_runs, runs;
+    uint64_t nb_cells, types, numbers;
+    uint64_t nb_formulas, formulas;
+    uint64_t nb_strings, strings, nb_chars, chars;
+};
+struct line_record {
+    int64_t offset, length;
+    struct area area;
+    int32_t is_clear;
+    uint64_t hash;
+};
+struct run_record {
+    // consecutive cells of a column, stored in the cell sections after the
+    // ones of the previous runs
+    int64_t row;
+    int32_t sheet_id, col, nb;
+};
+struct formula_record {
+    double key; // see cell_number
+    struct area range;
+    int64_t row;
+    int32_t sheet_id, col, function, key_type, is_dirty;
+};
+struct string_record {
+    uint64_t offset, length; // in the chars section
+};
+
+struct dump {
+    // content of a sidecar, built from a snapshot
+    const struct snapshot *snapshot;
+    struct run_record *runs;
+    size_t nb_runs, runs_capacity;
+    unsigned char *types;
+    double *numbers; // see cell_number
+    size_t nb_cells, cells_capacity;
+    struct formula_record *formulas;
+    size_t nb_formulas, formulas_capacity;
+    // strings are numbered by order of appearance, slots being an open
+    // addressing table of their numbers plus one (0 for free slots)
+    const struct string **strings;
+    size_t nb_strings, strings_capacity, nb_chars;
+    size_t *slots, nb_slots;
+};
+
+static char *cache_path(const char *path);
+static double cell_number(struct dump *dump, struct value value);
+static struct value cell_value(int type, double number,
+    const struct string *const *strings, size_t nb_strings);
+static int dump_cell(struct address address, struct value value,
+    const struct formula *formula, void *arg);
+static uint64_t hash_data(const char *data, size_t size);
+static int section_fits(uint64_t offset, uint64_t nb, size_t size,
+    size_t sidecar_size);
+static size_t string_number(struct dump *dump, const struct string *string);
+static int validate(const char *sidecar, size_t size, const char *data,
+    const struct stat *st);
+static int write_dump(const struct dump *dump, struct header *header,
+    const struct file_layout *layout, const char *path);
+static uint64_t write_section(FILE *fp, const void *data, size_t size,
+    uint64_t *end);
+
+int
+sidecar_load(const char *path, struct file_layout *layout)
+{
+    // load the content of path from its sidecar, and describe it in layout
+    // (if not NULL), return a non-null result if there is no valid sidecar,
+    // nothing being loaded then
+    char *sidecar_path;
+    const char *data, *sidecar;
+    int res;
+    size_t cell, nb;
+    const struct formula_record *formulas;
+    const struct header *header;
+    const struct line_record *lines;
+    const struct run_record *runs;
+    const struct string_record *records;
+    const struct string **strings;
+    struct address address;
+    struct formula formula;
+    struct stat st, sidecar_st;
+    struct value values[TILE_ROWS];
+
+    if (map_file(path, &data, &st) || !data) {
+        return -1;
+    }
+    sidecar_path = cache_path(path);
+    sidecar = NULL;
+    res = map_file(sidecar_path, &sidecar, &sidecar_st) || !sidecar ||
+        validate(sidecar, sidecar_st.st_size, data, &st);
+    free(sidecar_path);
+    munmap((void *) data, st.st_size);
+    if (res) {
+        if (sidecar) {
+            munmap((void *) sidecar, sidecar_st.st_size);
+        }
+        return -1;
+    }
+    header = (const struct header *) sidecar;
+
+    // each string is interned once, the cells taking their own references
+    records = (const struct string_record *) (sidecar + header->strings);
+    strings = malloc(MAX(header->nb_strings, 1)*sizeof(*strings));
+    for (size_t i = 0; i < header->nb_strings; i++) {
+        strings[i] = string_intern(sidecar + header->chars + records[i].offset,
+            records[i].length);
+    }
+
+    // values are set by runs, and formulas are set over them
+    runs = (const struct run_record *) (sidecar + header->runs);
+    cell = 0;
+    for (size_t i = 0; i < header->nb_runs; i++) {
+        address.sheet_id = runs[i].sheet_id;
+        address.row = runs[i].row;
+        address.col = runs[i].col;
+        for (int j = 0; j < runs[i].nb; j += nb) {
+            nb = MIN(TILE_ROWS, runs[i].nb - j);
+            for (size_t k = 0; k < nb; k++) {
+                values[k] = cell_value(
+                    ((const unsigned char *) sidecar + header->types)[cell],
+                    ((const double *) (sidecar + header->numbers))[cell],
+                    strings, header->nb_strings);
+                cell++;
+            }
+            storage_set_values(address, values, nb, CELL_UNSENT);
+            address.row += nb;
+        }
+    }
+    formulas = (const struct formula_record *) (sidecar + header->formulas);
+    for (size_t i = 0; i < header->nb_formulas; i++) {
+        address.sheet_id = formulas[i].sheet_id;
+        address.row = formulas[i].row;
+        address.col = formulas[i].col;
+        formula = (struct formula) {
+            .function = formulas[i].function,
+            .range = formulas[i].range,
+            .key = cell_value(formulas[i].key_type, formulas[i].key, strings,
+                header->nb_strings),
+        };
+        load_formula(address, &formula, formulas[i].is_dirty);
+    }
+    for (size_t i = 0; i < header->nb_strings; i++) {
+        string_unref(strings[i]);
+    }
+    free(strings);
+
+    if (layout) {
+        free(layout->lines);
+        *layout = (struct file_layout) {
+            .last_sheet = header->last_sheet,
+            .size = st.st_size,
+            .mtime = st.st_mtim,
+        };
+        lines = (const struct line_record *) (sidecar + header->lines);
+        for (size_t i = 0; i < header->nb_lines; i++) {
+            file_layout_append(layout, (struct file_line) {
+                .offset = lines[i].offset,
+                .length = lines[i].length,
+                .area = lines[i].area,
+                .is_clear = lines[i].is_clear,
+                .hash = lines[i].hash,
+            });
+        }
+    }
+    munmap((void *) sidecar, sidecar_st.st_size);
+    return 0;
+}
+
+int
+sidecar_write(const struct snapshot *snapshot, const char *path,
+    const struct file_layout *layout)
+{
+    // dump snapshot, holding the content of path as described by layout, to
+    // the sidecar of path, return a non-null result on failure
+    char *new_path, *sidecar_path;
+    const char *data;
+    int res;
+    struct dump dump = {.snapshot = snapshot};
+    struct header header = {0};
+    struct stat st;
+
+    data = NULL;
+    sidecar_path = cache_path(path);
+    if (map_file(path, &data, &st) || st.st_size != layout->size ||
+        st.st_mtim.tv_sec != layout->mtime.tv_sec ||
+        st.st_mtim.tv_nsec != layout->mtime.tv_nsec) {
+        res = -1; // modified by another program
+    } else if (!SIDECAR_MIN_SIZE || st.st_size < SIDECAR_MIN_SIZE) {
+        unlink(sidecar_path); // would be stale
+        res = 0;
+    } else {
+        header.size = st.st_size;
+        header.hash = hash_data(data, st.st_size);
+        header.mtime_sec = st.st_mtim.tv_sec;
+        header.mtime_nsec = st.st_mtim.tv_nsec;
+        snapshot_visit_cells(snapshot, dump_cell, &dump);
+        new_path = malloc(strlen(sidecar_path) + sizeof(".new"));
+        sprintf(new_path, "%s.new", sidecar_path);
+        if ((res = write_dump(&dump, &header, layout, new_path) ||
+            rename(new_path, sidecar_path))) {
+            unlink(new_path);
+        }
+        free(new_path);
+        free(dump.runs);
+        free(dump.types);
+        free(dump.numbers);
+        free(dump.formulas);
+        free(dump.strings);
+        free(dump.slots);
+    }
+    if (data) {
+        munmap((void *) data, st.st_size);
+    }
+    free(sidecar_path);
+    return res;
+}
+
+static char *
+cache_path(const char *path)
+{
+    char *sidecar_path;
+
+    sidecar_path = malloc(strlen(path) + sizeof(".cache"));
+    sprintf(sidecar_path, "%s.cache", path);
+    return sidecar_path;
+}
+
+static double
+cell_number(struct dump *dump, struct value value)
+{
+    // the payload of value, strings being replaced by their number
+    switch (value.type) {
+    case VALUE_EMPTY:
+        break;
+    case VALUE_BOOLEAN:
+        return value.as.boolean;
+    case VALUE_ERROR:
+        return value.as.error;
+    case VALUE_NUMBER:
+        return value.as.number;
+    case VALUE_STRING:
+        return string_number(dump, value.as.string);
+    }
+    return 0;
+}
+
+static struct value
+cell_value(int type, double number, const struct string *const *strings,
+    size_t nb_strings)
+{
+    // inverse of cell_number, invalid cells being empty
+    switch (type) {
+    case VALUE_BOOLEAN:
+        return (struct value) {.type = type, .as.boolean = number != 0};
+    case VALUE_ERROR:
+        return (struct value) {.type = type, .as.error = number};
+    case VALUE_NUMBER:
+        return (struct value) {.type = type, .as.number = number};
+    case VALUE_STRING:
+        if (number >= 0 && number < nb_strings) {
+            return (struct value) {
+                .type = type,
+                .as.string = strings[(size_t) number],
+            };
+        }
+        break;
+    }
+    return (struct value) {.type = VALUE_EMPTY};
+}
+
+static int
+dump_cell(struct address address, struct value value,
+    const struct formula *formula, void *arg)
+{
+    struct dump *dump;
+    struct run_record *run;
+
+    dump = arg;
+    if (!formula && value.type == VALUE_ERROR) {
+        return 0; // not written to grid files
+    }
+
+    // extend the last run if possible
+    run = dump->nb_runs ? &dump->runs[dump->nb_runs - 1] : NULL;
+    if (!run || run->sheet_id != address.sheet_id ||
+        run->col != address.col || run->row + run->nb != address.row) {
+        if (dump->nb_runs == dump->runs_capacity) {
+            dump->runs_capacity = dump->runs_capacity ?
+                2*dump->runs_capacity : 1 << 10;
+            dump->runs = realloc(dump->runs,
+                dump->runs_capacity*sizeof(*dump->runs));
+        }
+        run = &dump->runs[dump->nb_runs++];
+        *run = (struct run_record) {
+            .sheet_id = address.sheet_id,
+            .row = address.row,
+            .col = address.col,
+        };
+    }
+    run->nb++;
+    if (dump->nb_cells == dump->cells_capacity) {
+        dump->cells_capacity = dump->cells_capacity ?
+            2*dump->cells_capacity : 1 << 16;
+        dump->types = realloc(dump->types,
+            dump->cells_capacity*sizeof(*dump->types));
+        dump->numbers = realloc(dump->numbers,
+            dump->cells_capacity*sizeof(*dump->numbers));
+    }
+    dump->types[dump->nb_cells] = value.type;
+    dump->numbers[dump->nb_cells++] = cell_number(dump, value);
+
+    if (!formula) {
+        return 0;
+    }
+    if (dump->nb_formulas == dump->formulas_capacity) {
+        dump->formulas_capacity = dump->formulas_capacity ?
+            2*dump->formulas_capacity : 1 << 10;
+        dump->formulas = realloc(dump->formulas,
+            dump->formulas_capacity*sizeof(*dump->formulas));
+    }
+    dump->formulas[dump->nb_formulas++] = (struct formula_record) {
+        .key = cell_number(dump, formula->key),
+        .range = formula->range,
+        .sheet_id = address.sheet_id,
+        .row = address.row,
+        .col = address.col,
+        .function = formula->function,
+        .key_type = formula->key.type,
+        .is_dirty = !!(snapshot_get_flags(dump->snapshot, address) &
+            CELL_DIRTY),
+    };
+    return 0;
+}
+
+static uint64_t
+hash_data(const char *data, size_t size)
+{
+    // multiply-xorshift over four interleaved lanes of 64-bit words, so that
+    // hashing is far cheaper than parsing
+    uint64_t h[4] = {1, 2, 3, 4}, res, w;
+    size_t i;
+
+    for (i = 0; i + 32 <= size; i += 32) {
+        for (int k = 0; k < 4; k++) {
+            memcpy(&w, data + i + 8*k, 8);
+            h[k] = (h[k] ^ w)*MIX;
+            h[k] ^= h[k] >> 29;
+        }
+    }
+    for (; i < size; i++) {
+        h[0] = (h[0] ^ (unsigned char) data[i])*MIX;
+        h[0] ^= h[0] >> 29;
+    }
+    res = size;
+    for (int k = 0; k < 4; k++) {
+        res = (res ^ h[k])*MIX;
+        res ^= res >> 29;
+    }
+    return res;
+}
+
+static int
+section_fits(uint64_t offset, uint64_t nb, size_t size, size_t sidecar_size)
+{
+    return offset%8 == 0 && offset <= sidecar_size &&
+        nb <= (sidecar_size - offset)/size;
+}
+
+static size_t
+string_number(struct dump *dump, const struct string *string)
+{
+    // number of string, given on its first appearance
+    size_t i, mask;
+
+    // keep the table at most half full
+    if (2*dump->nb_strings >= dump->nb_slots) {
+        free(dump->slots);
+        dump->nb_slots = dump->nb_slots ? 2*dump->nb_slots : 1 << 10;
+        dump->slots = calloc(dump->nb_slots, sizeof(*dump->slots));
+        mask = dump->nb_slots - 1;
+        for (size_t j = 0; j < dump->nb_strings; j++) {
+            for (i = dump->strings[j]->hash & mask; dump->slots[i];
+                i = (i + 1) & mask) {
+                continue;
+            }
+            dump->slots[i] = j + 1;
+        }
+    }
+
+    mask = dump->nb_slots - 1;
+    for (i = string->hash & mask; dump->slots[i]; i = (i + 1) & mask) {
+        if (dump->strings[dump->slots[i] - 1] == string) {
+            return dump->slots[i] - 1;
+        }
+    }
+    if (dump->nb_strings == dump->strings_capacity) {
+        dump->strings_capacity = dump->strings_capacity ?
+            2*dump->strings_capacity : 1 << 10;
+        dump->strings = realloc(dump->strings,
+            dump->strings_capacity*sizeof(*dump->strings));
+    }
+    dump->strings[dump->nb_strings] = string;
+    dump->nb_chars += string->length;
+    dump->slots[i] = ++dump->nb_strings;
+    return dump->nb_strings - 1;
+}
+
+static int
+validate(const char *sidecar, size_t size, const char *data,
+    const struct stat *st)
+{
+    // return a non-null result if sidecar is not a well-formed one, written
+    // for the file of content data and status st, hashes being checked last
+    uint64_t nb_cells;
+    const struct header *header;
+    const struct run_record *runs;
+    const struct string_record *records;
+
+    header = (const struct header *) sidecar;
+    if (size < sizeof(*header) || memcmp(header->magic, MAGIC, 8) ||
+        header->byte_order != BYTE_ORDER_MARK ||
+        header->size != (uint64_t) st->st_size ||
+        header->mtime_sec != st->st_mtim.tv_sec ||
+        header->mtime_nsec != st->st_mtim.tv_nsec ||
+        !section_fits(header->lines, header->nb_lines,
+            sizeof(struct line_record), size) ||
+        !section_fits(header->runs, header->nb_runs,
+            sizeof(struct run_record), size) ||
+        !section_fits(header->types, header->nb_cells, 1, size) ||
+        !section_fits(header->numbers, header->nb_cells, sizeof(double),
+            size) ||
+        !section_fits(header->formulas, header->nb_formulas,
+            sizeof(struct formula_record), size) ||
+        !section_fits(header->strings, header->nb_strings,
+            sizeof(struct string_record), size) ||
+        !section_fits(header->chars, header->nb_chars, 1, size)) {
+        return -1;
+    }
+    runs = (const struct run_record *) (sidecar + header->runs);
+    nb_cells = 0;
+    for (size_t i = 0; i < header->nb_runs; i++) {
+        if (runs[i].nb < 0) {
+            return -1;
+        }
+        nb_cells += runs[i].nb;
+    }
+    records = (const struct string_record *) (sidecar + header->strings);
+    for (size_t i = 0; i < header->nb_strings; i++) {
+        if (records[i].offset > header->nb_chars ||
+            records[i].length > header->nb_chars - records[i].offset) {
+            return -1;
+        }
+    }
+    return nb_cells != header->nb_cells ||
+        header->checksum != hash_data(sidecar + sizeof(*header),
+        size - sizeof(*header)) ||
+        header->hash != hash_data(data, st->st_size);
+}
+
+static int
+write_dump(const struct dump *dump, struct header *header,
+    const struct file_layout *layout, const char *path)
+{
+    // write the sidecar of header and dump to path, return a non-null result
+    // on failure
+    char *chars;
+    int res;
+    uint64_t end;
+    void *map;
+    FILE *fp;
+    struct line_record *lines;
+    struct string_record *records;
+
+    if (!(fp = fopen(path, "w+"))) {
+        return -1;
+    }
+    memcpy(header->magic, MAGIC, 8);
+    header->byte_order = BYTE_ORDER_MARK;
+    header->last_sheet = layout->last_sheet;
+    header->nb_lines = layout->nb_lines;
+    header->nb_runs = dump->nb_runs;
+    header->nb_cells = dump->nb_cells;
+    header->nb_formulas = dump->nb_formulas;
+    header->nb_strings = dump->nb_strings;
+    header->nb_chars = dump->nb_chars;
+
+    // the header is written again once the offsets and checksum are known
+    end = 0;
+    write_section(fp, header, sizeof(*header), &end);
+    lines = malloc(MAX(layout->nb_lines, 1)*sizeof(*lines));
+    for (int i = 0; i < layout->nb_lines; i++) {
+        lines[i] = (struct line_record) {
+            .offset = layout->lines[i].offset,
+            .length = layout->lines[i].length,
+            .area = layout->lines[i].area,
+            .is_clear = layout->lines[i].is_clear,
+            .hash = layout->lines[i].hash,
+        };
+    }
+    header->lines = write_section(fp, lines,
+        layout->nb_lines*sizeof(*lines), &end);
+    free(lines);
+    header->runs = write_section(fp, dump->runs,
+        dump->nb_runs*sizeof(*dump->runs), &end);
+    header->types = write_section(fp, dump->types,
+        dump->nb_cells*sizeof(*dump->types), &end);
+    header->numbers = write_section(fp, dump->numbers,
+        dump->nb_cells*sizeof(*dump->numbers), &end);
+    header->formulas = write_section(fp, dump->formulas,
+        dump->nb_formulas*sizeof(*dump->formulas), &end);
+    records = malloc(MAX(dump->nb_strings, 1)*sizeof(*records));
+    chars = malloc(MAX(dump->nb_chars, 1));
+    for (size_t i = 0, offset = 0; i < dump->nb_strings; i++) {
+        records[i].offset = offset;
+        records[i].length = dump->strings[i]->length;
+        memcpy(chars + offset, dump->strings[i]->data, records[i].length);
+        offset += records[i].length;
+    }
+    header->strings = write_section(fp, records,
+        dump->nb_strings*sizeof(*records), &end);
+    header->chars = write_section(fp, chars, dump->nb_chars, &end);
+    free(records);
+    free(chars);
+
+    res = fflush(fp) || (map = mmap(NULL, end, PROT_READ, MAP_SHARED,
+        fileno(fp), 0)) == MAP_FAILED;
+    if (!res) {
+        header->checksum = hash_data((const char *) map + sizeof(*header),
+            end - sizeof(*header));
+        munmap(map, end);
+    }
+    res = res || fseek(fp, 0, SEEK_SET) ||
+        fwrite(header, sizeof(*header), 1, fp) != 1;
+    res = fflush(fp) || ferror(fp) || fsync(fileno(fp)) || res;
+    return fclose(fp) || res;
+}
+
+static uint64_t
+write_section(FILE *fp, const void *data, size_t size, uint64_t *end)
+{
+    // write data at *end, padded to 8 bytes, and return its offset
+    // errors are left to ferror
+    static const char padding[8];
+    uint64_t offset;
+
+    offset = *end;
+    if (size) {
+        fwrite(data, 1, size, fp);
+    }
+    fwrite(padding, 1, (8 - size%8)%8, fp);
+    *end += size + (8 - size%8)%8;
+    return offset;
+}
@@ -0,0 +1,12 @@
+#ifndef SIDECAR_H
+#define SIDECAR_H
+
+#include "file_format.h"
+
+struct snapshot;
+
+int sidecar_load(const char *path, struct file_layout *layout);
+int sidecar_write(const struct snapshot *snapshot, const char *path,
+    const struct file_layout *layout);
+
+#endif // SIDECAR_H
@@ -1,60 +1,645 @@
 #include <semaphore.h>
 #include <stddef.h>
-#include <unistd.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
 
 #include "client.h"
+#include "config.h"
+#include "csv.h"
+#include "evaluation.h"
+#include "file_format.h"
+#include "hidden.h"
+#include "journal.h"
+#include "loader.h"
 #include "pthread_queue.h"
+#include "sidecar.h"
+#include "storage.h"
+#include "string_pool.h"
 #include "thread_management.h"
 #include "types.h"
+#include "watcher.h"
 
+static void add_change(struct area area);
+static void evaluate_in_background(void);
+static void finish_export(struct export *export);
+static void finish_save(struct save *save);
+static struct area intersection(struct area a, struct area b);
+static void load(void);
+static int merge_by_sheet(struct area *areas, int nb_areas);
+static void process_appended_rows(struct appended_rows appended);
+static void process_export_request(struct export_request export_request);
+static void process_file_change(struct stat st);
+static void process_import_request(struct import_request import_request);
+static void process_local_modif(struct definition *definition);
 static void process_view_request(struct view_request view_request);
+static void push_appended_rows(int64_t first, int64_t end);
+static void push_file_change(const struct stat *st);
+static void reload(const struct stat *st);
+static void send_view_updates(const int *hits);
+static void send_viewed_cells(const int *hits);
+static void send_viewed_rows(int64_t first, int64_t end);
+static void start_save(void);
+
+static int changes_capacity, is_save_pending, is_saving, nb_changes,
+    nb_exports;
+static int is_reload_pending; // the grid file changed during a save
+static int is_cache_stale; // the sidecar does not hold the current content
+static int sent_cols_end; // of the viewed cells sent, as sent_rows_end
+static int64_t sent_rows_end;
+static struct area *changes; // modified since the last save
+static off_t journal_offset; // of the modifications following the save
+static struct view current_view = {.sheet_id = -1};
+
+static void
+add_change(struct area area)
+{
+    if (nb_changes == changes_capacity) {
+        changes_capacity = changes_capacity ? 2*changes_capacity : 16;
+        changes = realloc(changes, changes_capacity*sizeof(*changes));
+    }
+    changes[nb_changes++] = area;
+    is_cache_stale = 1;
+}
+
+static void
+evaluate_in_background(void)
+{
+    // evaluate a batch of dirty cells, unless pre-empted by a view request
+    is_cache_stale = 1;
+    for (int i = 0; i < EVALUATION_BATCH_SIZE; i++) {
+        if (pthread_queue_is_non_empty(&view_requests) ||
+            !evaluate_next_dirty_cell()) {
+            break;
+        }
+    }
+    send_view_updates(NULL);
+}
+
+static void
+finish_export(struct export *export)
+{
+    storage_release_snapshot(export->snapshot);
+    free(export->path);
+    free(export);
+    nb_exports--;
+}
+
+static void
+finish_save(struct save *save)
+{
+    // the changes of a failed save are kept for the next one, while the
+    // journal only needs the ones of a successful save
+    struct stat st;
+
+    if (save->is_failed) {
+        for (int i = 0; i < save->nb_changes; i++) {
+            add_change(save->changes[i]);
+        }
+    } else {
+        journal_compact(journal_offset);
+    }
+    storage_release_snapshot(save->snapshot);
+    free(save->changes);
+    free(save);
+    is_saving = 0;
+    if (is_reload_pending && !stat(file_path, &st)) {
+        is_reload_pending = 0;
+        reload(&st);
+    }
+    if (is_save_pending) {
+        start_save();
+    }
+}
+
+static struct area
+intersection(struct area a, struct area b)
+{
+    // of intersecting areas
+    struct area res;
+
+    res.sheet_id = a.sheet_id;
+    res.row = MAX(a.row, b.row);
+    res.col = MAX(a.col, b.col);
+    res.row_span = MIN(a.row + a.row_span, b.row + b.row_span) - res.row;
+    res.col_span = MIN(a.col + a.col_span, b.col + b.col_span) - res.col;
+    return res;
+}
+
+static void
+load(void)
+{
+    // load the grid file (from its sidecar if up to date), then replay the
+    // modifications of its journal
+    char *journal_path;
+    struct file_layout journal_layout = {0};
+
+    if (sidecar_load(file_path, &file_layout)) {
+        load_file(file_path, &file_layout);
+        is_cache_stale = 1;
+    }
+
+    // the values loaded from a sidecar were computed before the journaled
+    // modifications, so their dependents are invalidated
+    journal_path = malloc(strlen(file_path) + sizeof(".journal"));
+    sprintf(journal_path, "%s.journal", file_path);
+    replay_journal(journal_path, &journal_layout);
+    for (int i = 0; i < journal_layout.nb_lines; i++) {
+        add_change(journal_layout.lines[i].area);
+    }
+    free(journal_layout.lines);
+    journal_open(journal_path);
+    free(journal_path);
+}
+
+static int
+merge_by_sheet(struct area *areas, int nb_areas)
+{
+    // replace areas by their bounding box on each sheet, return their number
+    int i, nb_merged;
+    struct area *merged;
+
+    nb_merged = 0;
+    for (int j = 0; j < nb_areas; j++) {
+        for (i = 0; i < nb_merged; i++) {
+            if (areas[i].sheet_id == areas[j].sheet_id) {
+                break;
+            }
+        }
+        if (i == nb_merged) {
+            areas[nb_merged++] = areas[j];
+            continue;
+        }
+        merged = &areas[i];
+        merged->row_span = MAX(merged->row + merged->row_span,
+            areas[j].row + areas[j].row_span);
+        merged->col_span = MAX(merged->col + merged->col_span,
+            areas[j].col + areas[j].col_span);
+        merged->row = MIN(merged->row, areas[j].row);
+        merged->col = MIN(merged->col, areas[j].col);
+        merged->row_span -= merged->row;
+        merged->col_span -= merged->col;
+    }
+    return nb_merged;
+}
+
+static void
+process_appended_rows(struct appended_rows appended)
+{
+    // rows never sent are sent on request, and the ones in view were sent
+    struct appended_rows newer;
+
+    while (!pthread_queue_pop(&appended_rows, &newer)) {
+        appended.first = MIN(appended.first, newer.first);
+        appended.end = MAX(appended.end, newer.end);
+    }
+    send_viewed_rows(appended.first, MIN(appended.end, sent_rows_end));
+}
+
+static void
+process_export_request(struct export_request export_request)
+{
+    // exported values are up to date, and written in the background
+    struct export *export;
+
+    while (evaluate_next_dirty_cell()) {
+        continue;
+    }
+    send_view_updates(NULL);
+    export = malloc(sizeof(*export));
+    *export = (struct export) {
+        .snapshot = storage_snapshot(),
+        .area.sheet_id = export_request.sheet_id,
+        .path = export_request.path,
+        .delimiter = csv_delimiter(export_request.path),
+    };
+    nb_exports++;
+    pthread_queue_push(&exports, export);
+}
+
+static void
+process_file_change(struct stat st)
+{
+    // only the newest state matters, and the writer owns file_layout while
+    // saving
+    struct stat newer;
+
+    while (!pthread_queue_pop(&file_changes, &newer)) {
+        st = newer;
+    }
+    if (is_saving) {
+        is_reload_pending = 1;
+    } else {
+        reload(&st);
+    }
+}
+
+static void
+process_import_request(struct import_request import_request)
+{
+    // imports are not journaled, but saved right away
+    struct area area;
+
+    if (!viewed_path && !csv_import(import_request.path, import_request.origin,
+        csv_delimiter(import_request.path), &area) && area.row_span) {
+        add_change(area);
+        send_view_updates(NULL);
+        start_save();
+    }
+    free(import_request.path);
+}
+
+static void
+process_local_modif(struct definition *definition)
+{
+    // apply every pending modification before updating the view, once
+    // journaled, viewed files being read-only
+    do {
+        if (!viewed_path) {
+            journal_append(definition);
+            apply_definition(definition);
+            add_change(definition->area);
+        }
+        value_unref(definition->value);
+        value_unref(definition->formula.key);
+        free(definition);
+    } while (!pthread_queue_pop(&local_modifs, &definition));
+    send_view_updates(NULL);
+}
 
 static void
 process_view_request(struct view_request view_request)
 {
-    // TODO
-    static int nb;
+    // only the newest view request is served, older ones are outdated
+    struct view_request newer;
+
+    while (!pthread_queue_pop(&view_requests, &newer)) {
+        release_hidden(view_request.view.hidden);
+        free(view_request.hits);
+        view_request = newer;
+    }
+    release_hidden(current_view.hidden);
+    current_view = view_request.view;
+    send_view_updates(view_request.hits);
+    free(view_request.hits);
+}
+
+static void
+push_appended_rows(int64_t first, int64_t end)
+{
+    // called by the indexer of the followed file
+    struct appended_rows appended = {.first = first, .end = end};
+
+    pthread_queue_push(&appended_rows, &appended);
+}
+
+static void
+push_file_change(const struct stat *st)
+{
+    // called by the watcher of the grid file
+    pthread_queue_push(&file_changes, st);
+}
+
+static void
+reload(const struct stat *st)
+{
+    // apply the definitions of the grid file modified by another program
+    // that differ from the loaded ones, as modifications: the areas of the
+    // lines around the common first and last ones are cleared, and defined
+    // again by the new lines intersecting them, in file order
+    int first, k, last, nb_areas, nb_bounds, nb_new, nb_old;
+    struct area *areas, *bounds;
+    struct definition clear, *definitions, modif;
+    struct file_layout layout = {0};
+    const struct file_line *new, *old;
+
+    // the file saved last is known already
+    if (st->st_size == file_layout.size &&
+        st->st_mtim.tv_sec == file_layout.mtime.tv_sec &&
+        st->st_mtim.tv_nsec == file_layout.mtime.tv_nsec) {
+        return;
+    } else if (parse_file(file_path, &layout, &definitions) < 0) {
+        free(layout.lines);
+        free(definitions);
+        return;
+    }
+    old = file_layout.lines;
+    new = layout.lines;
+    nb_old = file_layout.nb_lines;
+    nb_new = layout.nb_lines;
+    for (first = 0; first < MIN(nb_old, nb_new) &&
+        old[first].hash == new[first].hash; first++) {
+        continue;
+    }
+    for (last = 0; last < MIN(nb_old, nb_new) - first &&
+        old[nb_old - 1 - last].hash == new[nb_new - 1 - last].hash; last++) {
+        continue;
+    }
+
+    // a few areas are kept apart, as a file rewritten by another program
+    // may differ everywhere
+    nb_areas = 0;
+    areas = malloc(MAX(nb_old + nb_new - 2*(first + last), 1)*
+        sizeof(*areas));
+    for (int i = first; i < nb_old - last; i++) {
+        areas[nb_areas++] = old[i].area;
+    }
+    for (int i = first; i < nb_new - last; i++) {
+        areas[nb_areas++] = new[i].area;
+    }
+    if (nb_areas > RELOAD_MAX_AREAS) {
+        nb_areas = merge_by_sheet(areas, nb_areas);
+    }
+    bounds = malloc(MAX(nb_areas, 1)*sizeof(*bounds));
+    memcpy(bounds, areas, nb_areas*sizeof(*bounds));
+    nb_bounds = merge_by_sheet(bounds, nb_areas);
+
+    // the new file is not journaled, nor saved again
+    for (int i = 0; i < nb_areas; i++) {
+        clear = (struct definition) {.area = areas[i]};
+        apply_definition(&clear);
+    }
+    for (int i = 0; i < nb_new; i++) {
+        for (k = 0; k < nb_bounds && !area_intersect(new[i].area, bounds[k]);
+            k++) {
+            continue;
+        }
+        if (k == nb_bounds) {
+            continue;
+        }
+        modif = definitions[i];
+        for (int j = 0; j < nb_areas; j++) {
+            if (area_intersect(new[i].area, areas[j])) {
+                modif.area = intersection(new[i].area, areas[j]);
+                apply_definition(&modif);
+            }
+        }
+    }
+    for (int i = 0; i < nb_new; i++) {
+        value_unref(definitions[i].value);
+        value_unref(definitions[i].formula.key);
+    }
+    free(definitions);
+    free(bounds);
+    free(areas);
+    free(file_layout.lines);
+    file_layout = layout;
+    is_cache_stale = 1;
+    send_view_updates(NULL);
+}
+
+static void
+send_view_updates(const int *hits)
+{
+    // send the cells of the current view that are missing from the cache
+    // (according to hits, if not NULL), or unknown to the cache manager
+    // dirty cells are computed on demand, with their precedents
+    int *cols, flags, index, width;
+    struct cell_content cell_update;
+
+    if (current_view.sheet_id < 0) {
+        return;
+    } else if (viewed_path) {
+        send_viewed_cells(hits);
+        return;
+    }
+
+    // the columns of the view are matched once, rows and columns being
+    // mapped through the hidden lines
+    width = current_view.xforce + current_view.xlen;
+    cols = malloc(MAX(width, 1)*sizeof(*cols));
+    for (int j = 0; j < width; j++) {
+        cols[j] = get_view_col(current_view, j);
+    }
+    cell_update.address.sheet_id = current_view.sheet_id;
+    for (int i = 0; i < current_view.yforce + current_view.ylen; i++) {
+        cell_update.address.row = get_view_row(current_view, i);
+        for (int j = 0; j < width; j++) {
+            index = i*width + j;
+            cell_update.address.col = cols[j];
+            flags = storage_get_flags(cell_update.address);
+            if ((hits && !hits[index]) ||
+                flags & (CELL_DIRTY | CELL_UNSENT)) {
+                cell_update.value = evaluate(cell_update.address);
+                storage_set_flags(cell_update.address,
+                    storage_get_flags(cell_update.address) & ~CELL_UNSENT);
+                value_ref(cell_update.value);
+                pthread_queue_push(&cell_updates, &cell_update);
+            }
+        }
+    }
+    free(cols);
+}
+
+static void
+send_viewed_cells(const int *hits)
+{
+    // parse the rows of the current view with cells missing from the cache,
+    // viewed files being on the first sheet only, and never modified
+    int index, nb_cols, width;
     struct cell_content cell_update;
+    struct value *values;
+
+    if (!hits) {
+        return;
+    }
+    width = current_view.xforce + current_view.xlen;
+    nb_cols = MAX(current_view.xforce,
+        get_view_col(current_view, width - 1) + 1);
+    values = malloc(nb_cols*sizeof(*values));
+    for (int i = 0; i < current_view.yforce + current_view.ylen; i++) {
+        for (index = i*width; index < (i + 1)*width && hits[index]; index++) {
+            continue;
+        }
+        if (index == (i + 1)*width) {
+            continue;
+        }
+        cell_update.address = get_view_address(current_view, i*width);
+        if (current_view.sheet_id) {
+            memset(values, 0, nb_cols*sizeof(*values));
+        } else {
+            csv_view_row(cell_update.address.row, values, nb_cols);
+            sent_rows_end = MAX(sent_rows_end, cell_update.address.row + 1);
+            sent_cols_end = MAX(sent_cols_end, nb_cols);
+        }
+        for (index = i*width; index < (i + 1)*width; index++) {
+            if (hits[index]) {
+                continue;
+            }
+            cell_update.address = get_view_address(current_view, index);
+            cell_update.value = values[cell_update.address.col];
+            value_ref(cell_update.value);
+            pthread_queue_push(&cell_updates, &cell_update);
+        }
+        for (int j = 0; j < nb_cols; j++) {
+            value_unref(values[j]);
+        }
+    }
+    free(values);
+}
+
+static void
+send_viewed_rows(int64_t first, int64_t end)
+{
+    // send the cells of the rows [first, end) of the viewed file, in the
+    // columns sent so far
+    struct cell_content cell_update;
+    struct value *values;
+
+    values = malloc(MAX(sent_cols_end, 1)*sizeof(*values));
+    cell_update.address.sheet_id = 0;
+    for (int64_t row = first; row < end; row++) {
+        csv_view_row(row, values, sent_cols_end);
+        cell_update.address.row = row;
+        for (int col = 0; col < sent_cols_end; col++) {
+            cell_update.address.col = col;
+            cell_update.value = values[col];
+            pthread_queue_push(&cell_updates, &cell_update);
+        }
+    }
+    free(values);
+}
+
+static void
+start_save(void)
+{
+    // hand a snapshot to the writer, or delay if a save is in progress
+    struct save *save;
 
-    for (int i = 0; i < 10; i++, nb++) {
-        cell_update = (struct cell_content) {
-            .address = (struct address) {
-                .row = nb/12,
-                .col = nb%12,
-            },
-            .state = nb % 7 == 1,
-        };
-        // pthread_queue_push(&cell_updates, &cell_update);
-        // sleep(1);
+    if (is_saving) {
+        is_save_pending = 1;
+        return;
     }
+    is_saving = 1;
+    is_save_pending = 0;
+    save = malloc(sizeof(*save));
+    *save = (struct save) {
+        .snapshot = storage_snapshot(),
+        .changes = changes,
+        .nb_changes = nb_changes,
+    };
+    changes = NULL;
+    nb_changes = changes_capacity = 0;
+    journal_offset = journal_mark();
+    pthread_queue_push(&saves, save);
 }
 
 void *
 state_manager_routine(void *sem)
 {
+    const struct timespec *deadline;
+
+    // view requests received meanwhile are answered once the file is loaded
+    if (viewed_path) {
+        csv_view_open(viewed_path, is_following ? push_appended_rows : NULL);
+    } else if (file_path) {
+        load();
+        watcher_open(file_path, push_file_change);
+    }
     while (1) {
-        sem_wait(sem);
+        // background evaluation only happens when nothing else is pending,
+        // and the journal is committed once its group delay expired
+        if (has_dirty_cells()) {
+            if (sem_trywait(sem)) {
+                evaluate_in_background();
+                journal_poll();
+                continue;
+            }
+        } else if ((deadline = journal_deadline())) {
+            if (sem_timedwait(sem, deadline)) {
+                journal_commit();
+                continue;
+            }
+        } else {
+            sem_wait(sem);
+        }
         if (should_terminate()) {
             goto cleanup;
+        } else if (pthread_queue_is_non_empty(&finished_saves)) {
+            struct save *save;
+            pthread_queue_pop(&finished_saves, &save);
+            finish_save(save);
+        } else if (pthread_queue_is_non_empty(&finished_exports)) {
+            struct export *export;
+            pthread_queue_pop(&finished_exports, &export);
+            finish_export(export);
         } else if (pthread_queue_is_non_empty(&write_requests)) {
-            // TODO
             struct write_request write_request;
             pthread_queue_pop(&write_requests, &write_request);
-            sleep(1); // simulate a non-trivial operation
+            if (!viewed_path) {
+                start_save();
+            }
         } else if (pthread_queue_is_non_empty(&view_requests)) {
-            // TODO
             struct view_request view_request;
             pthread_queue_pop(&view_requests, &view_request);
             process_view_request(view_request);
-            free(view_request.hits);
+        } else if (pthread_queue_is_non_empty(&appended_rows)) {
+            struct appended_rows appended;
+            pthread_queue_pop(&appended_rows, &appended);
+            process_appended_rows(appended);
+        } else if (pthread_queue_is_non_empty(&file_changes)) {
+            struct stat st;
+            pthread_queue_pop(&file_changes, &st);
+            process_file_change(st);
         } else if (pthread_queue_is_non_empty(&local_modifs)) {
-            // TODO
-            void *local_modif;
+            struct definition *local_modif;
             pthread_queue_pop(&local_modifs, &local_modif);
-            free(local_modif);
+            process_local_modif(local_modif);
+        } else if (pthread_queue_is_non_empty(&import_requests)) {
+            struct import_request import_request;
+            pthread_queue_pop(&import_requests, &import_request);
+            process_import_request(import_request);
+        } else if (pthread_queue_is_non_empty(&export_requests)) {
+            struct export_request export_request;
+            pthread_queue_pop(&export_requests, &export_request);
+            process_export_request(export_request);
         }
     }
 
 cleanup:
+    // snapshots must be released before the storage is cleared, the ones not
+    // taken by the writer are released right away
+    is_save_pending = is_reload_pending = 0;
+    watcher_close();
+    struct export *export;
+    struct export_request export_request;
+    struct import_request import_request;
+    struct save *save;
+    struct snapshot *snapshot;
+    if (is_saving && !pthread_queue_pop(&saves, &save)) {
+        save->is_failed = 1; // not written, the journal is still needed
+        finish_save(save);
+    }
+    while (!pthread_queue_pop(&exports, &export)) {
+        finish_export(export);
+    }
+    while (is_saving || nb_exports) {
+        sem_wait(sem);
+        if (!pthread_queue_pop(&finished_saves, &save)) {
+            finish_save(save);
+        } else if (!pthread_queue_pop(&finished_exports, &export)) {
+            finish_export(export);
+        }
+    }
+    while (!pthread_queue_pop(&import_requests, &import_request)) {
+        free(import_request.path);
+    }
+    while (!pthread_queue_pop(&export_requests, &export_request)) {
+        free(export_request.path);
+    }
+
+    // the sidecar can only be written once the grid file is up to date
+    if (file_path && is_cache_stale && !nb_changes) {
+        snapshot = storage_snapshot();
+        sidecar_write(snapshot, file_path, &file_layout);
+        storage_release_snapshot(snapshot);
+    }
+    free(changes);
+    csv_view_close();
+    journal_close();
+    storage_clear();
     return NULL;
 }
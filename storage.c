@@ -0,0 +1,1169 @@
+#include <limits.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "arena.h"
+#include "kernels.h"
+#include "storage.h"
+#include "string_pool.h"
+#include "types.h"
+
+#define INITIAL_NB_BUCKETS                  (1 << 8)
+#define BIT(I)                              ((uint64_t) 1 << ((I) & 63))
+
+struct tile {
+    // tiles are shared with snapshots, and copied before being modified if
+    // refcount > 1
+    struct tile *next; // next tile in the same bucket of the live storage
+    int refcount;
+    struct sheet *sheet; // whose arena holds the tile
+    sheet_id sheet_id;
+    int64_t row; // multiple of TILE_ROWS
+    int col;
+    uint64_t key; // address_key of its first cell, to hash and sort tiles
+    int nb_errors;
+    uint64_t present[TILE_WORDS], numeric[TILE_WORDS];
+    uint64_t flags[NB_CELL_FLAGS][TILE_WORDS];
+    unsigned char types[TILE_ROWS];
+    double numbers[TILE_ROWS]; // numbers, booleans and error codes
+    const struct string **strings; // lazily allocated
+    struct formula **formulas; // lazily allocated, NULL for literal values
+};
+union array_slot {
+    void *pointers[TILE_ROWS];
+    union array_slot *next_free;
+};
+union formula_slot {
+    struct formula formula;
+    union formula_slot *next_free;
+};
+struct string_count {
+    const struct string *string; // NULL for unused slots
+    size_t nb_refs;
+};
+struct sheet {
+    // tiles and cell payloads are allocated in the arena of their sheet, so
+    // that they are all freed at once with the sheet; the strings of the
+    // sheet are counted here, the pool only holding one reference to each
+    struct sheet *next;
+    sheet_id sheet_id;
+    struct arena arena;
+    union array_slot *free_arrays;
+    union formula_slot *free_formulas;
+    struct tile *free_tiles; // linked by next
+    struct string_count *strings;
+    size_t nb_string_slots, nb_strings;
+};
+struct snapshot {
+    int nb_tiles;
+    struct tile **tiles; // sorted by sheet, column and row
+};
+struct find_error_arg {
+    int nb_errors;
+    struct value *error;
+};
+struct find_flagged_arg {
+    int flag;
+    int (*visit)(struct address address, void *arg);
+    void *arg;
+};
+struct visit_values_arg {
+    int (*visit)(struct address address, struct value value, void *arg);
+    void *arg;
+};
+
+static int aggregate_slice(struct tile *tile, int start, int end, void *arg);
+static void *alloc_array(struct sheet *sheet);
+static struct formula *alloc_formula(struct sheet *sheet,
+    const struct formula *formula);
+static struct tile *alloc_tile(struct sheet *sheet);
+static int compare_addresses(const void *a, const void *b);
+static int compare_tiles(const void *a, const void *b);
+static struct tile *copy_tile(const struct tile *tile);
+static int find_error_in_slice(struct tile *tile, int start, int end,
+    void *arg);
+static int find_flagged_in_slice(struct tile *tile, int start, int end,
+    void *arg);
+static struct tile **find_link(struct address address);
+static struct sheet *find_sheet(sheet_id sheet_id, int create);
+static struct string_count *find_string_count(const struct sheet *sheet,
+    const struct string *string);
+static struct tile *find_tile(struct address address);
+static void free_array(struct sheet *sheet, void *array);
+static void free_formula(struct sheet *sheet, struct formula *formula);
+static struct tile *get_writable_tile(struct address address, int create);
+static size_t hash(sheet_id sheet_id, uint64_t key);
+static int lower_bound(const struct snapshot *snapshot,
+    struct address address);
+static void ref_value(struct sheet *sheet, struct value value);
+static void release_tile(struct tile *tile);
+static void resize_buckets(size_t new_nb_buckets);
+static void resize_string_counts(struct sheet *sheet, size_t nb_slots);
+static void set_tile_value(struct tile *tile, int i, struct value value);
+static int slice_masks(const uint64_t *bitmap, int start, int end,
+    uint64_t *masks);
+static uint64_t tile_key(struct address address);
+static struct value tile_value(const struct tile *tile, int i);
+static void unref_value(struct sheet *sheet, struct value value);
+static int visit_cells_in_slice(const struct tile *tile, int start, int end,
+    int (*visit)(struct address address, struct value value,
+    const struct formula *formula, void *arg), void *arg);
+static int visit_range(struct area range,
+    int (*visit)(struct tile *tile, int start, int end, void *arg), void *arg);
+static int visit_sparse_range(struct area range,
+    int (*visit)(struct tile *tile, int start, int end, void *arg), void *arg);
+static int visit_values_in_slice(struct tile *tile, int start, int end,
+    void *arg);
+
+static size_t nb_buckets, nb_tiles;
+static struct sheet *sheets;
+static struct tile **buckets;
+
+int
+snapshot_get_flags(const struct snapshot *snapshot, struct address address)
+{
+    // storage_get_flags, for the cells of snapshot
+    int flags, i;
+    const struct tile *tile;
+
+    i = lower_bound(snapshot, address);
+    if (i == snapshot->nb_tiles) {
+        return 0;
+    }
+    tile = snapshot->tiles[i];
+    if (tile->sheet_id != address.sheet_id || tile->key != tile_key(address)) {
+        return 0;
+    }
+    i = address.row - tile->row;
+    flags = 0;
+    for (int k = 0; k < NB_CELL_FLAGS; k++) {
+        if (tile->flags[k][i/64] & BIT(i)) {
+            flags |= 1 << k;
+        }
+    }
+    return flags;
+}
+
+struct area
+snapshot_sheet_area(const struct snapshot *snapshot, sheet_id sheet_id)
+{
+    // return the smallest area holding the non-empty cells of a sheet, of
+    // null spans if there are none
+    int first, last, max_col;
+    int64_t max_row;
+    const struct tile *tile;
+    struct area area = {.sheet_id = sheet_id, .row = INT64_MAX, .col = INT_MAX};
+
+    max_col = max_row = -1;
+    for (int i = lower_bound(snapshot, (struct address) {.sheet_id = sheet_id});
+        i < snapshot->nb_tiles && snapshot->tiles[i]->sheet_id == sheet_id;
+        i++) {
+        tile = snapshot->tiles[i];
+        first = last = -1;
+        for (int j = 0; j < TILE_ROWS; j++) {
+            if ((tile->formulas && tile->formulas[j]) ||
+                tile->present[j/64] & BIT(j)) {
+                first = first < 0 ? j : first;
+                last = j;
+            }
+        }
+        if (first < 0) {
+            continue;
+        }
+        area.row = MIN(area.row, tile->row + first);
+        area.col = MIN(area.col, tile->col);
+        max_row = MAX(max_row, tile->row + last);
+        max_col = MAX(max_col, tile->col);
+    }
+    if (max_row < 0) {
+        return (struct area) {.sheet_id = sheet_id};
+    }
+    area.row_span = max_row + 1 - area.row;
+    area.col_span = max_col + 1 - area.col;
+    return area;
+}
+
+int
+snapshot_visit_area(const struct snapshot *snapshot, struct area area,
+    int (*visit)(struct address address, struct value value,
+    const struct formula *formula, void *arg), void *arg)
+{
+    // snapshot_visit_cells, restricted to the cells of area
+    int res, start, end;
+    const struct tile *tile;
+
+    for (int col = area.col; col < area.col + area.col_span; col++) {
+        for (int i = lower_bound(snapshot, (struct address) {
+            .sheet_id = area.sheet_id,
+            .row = area.row,
+            .col = col,
+        }); i < snapshot->nb_tiles; i++) {
+            tile = snapshot->tiles[i];
+            if (tile->sheet_id != area.sheet_id || tile->col != col ||
+                tile->row >= area.row + area.row_span) {
+                break;
+            }
+            start = MAX(area.row - tile->row, 0);
+            end = MIN(area.row + area.row_span - tile->row, TILE_ROWS);
+            if ((res = visit_cells_in_slice(tile, start, end, visit, arg))) {
+                return res;
+            }
+        }
+    }
+    return 0;
+}
+
+int
+snapshot_visit_cells(const struct snapshot *snapshot,
+    int (*visit)(struct address address, struct value value,
+    const struct formula *formula, void *arg), void *arg)
+{
+    // call visit on every non-empty cell of snapshot, by sheets, columns and
+    // rows, until a non-null result is returned
+    // safe to call from any thread, as long as the snapshot is not released
+    int res;
+
+    for (int i = 0; i < snapshot->nb_tiles; i++) {
+        if ((res = visit_cells_in_slice(snapshot->tiles[i], 0, TILE_ROWS,
+            visit, arg))) {
+            return res;
+        }
+    }
+    return 0;
+}
+
+void
+storage_aggregate(struct area range, struct aggregate *aggregate)
+{
+    // accumulate the numbers of range into aggregate
+    visit_range(range, aggregate_slice, aggregate);
+}
+
+void
+storage_clear(void)
+{
+    while (sheets) {
+        storage_clear_sheet(sheets->sheet_id);
+    }
+    free(buckets); buckets = NULL;
+    nb_buckets = nb_tiles = 0;
+}
+
+void
+storage_clear_sheet(sheet_id sheet_id)
+{
+    struct sheet *sheet, **p;
+    struct tile *tile, **q;
+
+    for (p = &sheets; *p && (*p)->sheet_id != sheet_id; p = &(*p)->next);
+    if (!(sheet = *p)) {
+        return;
+    }
+
+    // unlink the tiles
+    // no snapshot should be alive, as their tiles are in the arena
+    for (size_t i = 0; i < nb_buckets; i++) {
+        for (q = &buckets[i]; (tile = *q);) {
+            if (tile->sheet_id != sheet_id) {
+                q = &tile->next;
+                continue;
+            }
+            *q = tile->next;
+            nb_tiles--;
+        }
+    }
+
+    // tiles and formulas are freed along with the arena, and each string
+    // once
+    for (size_t i = 0; i < sheet->nb_string_slots; i++) {
+        if (sheet->strings[i].string) {
+            string_unref(sheet->strings[i].string);
+        }
+    }
+    free(sheet->strings);
+    arena_free_all(&sheet->arena);
+    *p = sheet->next;
+    free(sheet);
+}
+
+int
+storage_find_error(struct area range, struct value *error)
+{
+    // return the number of errors in range, and store the first one in error
+    struct find_error_arg find_error_arg;
+
+    find_error_arg = (struct find_error_arg) {.error = error};
+    visit_range(range, find_error_in_slice, &find_error_arg);
+    return find_error_arg.nb_errors;
+}
+
+int
+storage_get_flags(struct address address)
+{
+    int flags, i;
+    struct tile *tile;
+
+    if (!(tile = find_tile(address))) {
+        return 0;
+    }
+    i = address.row - tile->row;
+    flags = 0;
+    for (int k = 0; k < NB_CELL_FLAGS; k++) {
+        if (tile->flags[k][i/64] & BIT(i)) {
+            flags |= 1 << k;
+        }
+    }
+    return flags;
+}
+
+const struct formula *
+storage_get_formula(struct address address)
+{
+    struct tile *tile;
+
+    tile = find_tile(address);
+    return tile && tile->formulas ? tile->formulas[address.row - tile->row] :
+        NULL;
+}
+
+struct value
+storage_get_value(struct address address)
+{
+    struct tile *tile;
+
+    if (!(tile = find_tile(address))) {
+        return (struct value) {.type = VALUE_EMPTY};
+    }
+    return tile_value(tile, address.row - tile->row);
+}
+
+void
+storage_release_snapshot(struct snapshot *snapshot)
+{
+    // must be called from the thread modifying the storage
+    for (int i = 0; i < snapshot->nb_tiles; i++) {
+        release_tile(snapshot->tiles[i]);
+    }
+    free(snapshot->tiles);
+    free(snapshot);
+}
+
+void
+storage_set_flags(struct address address, int flags)
+{
+    int i;
+    struct tile *tile;
+
+    // avoid creating or copying a tile when flags do not change
+    if (storage_get_flags(address) == flags) {
+        return;
+    }
+    tile = get_writable_tile(address, 1);
+    i = address.row - tile->row;
+    for (int k = 0; k < NB_CELL_FLAGS; k++) {
+        if (flags & 1 << k) {
+            tile->flags[k][i/64] |= BIT(i);
+        } else {
+            tile->flags[k][i/64] &= ~BIT(i);
+        }
+    }
+}
+
+void
+storage_set_formula(struct address address, const struct formula *formula)
+{
+    // formula is copied, NULL removes the existing formula
+    struct sheet *sheet;
+    struct tile *tile;
+    struct formula **dest;
+
+    if (!(tile = get_writable_tile(address, formula != NULL))) {
+        return;
+    }
+    sheet = tile->sheet;
+    if (!tile->formulas) {
+        if (!formula) {
+            return;
+        }
+        tile->formulas = alloc_array(sheet);
+    }
+    dest = &tile->formulas[address.row - tile->row];
+    if (!formula) {
+        if (*dest) {
+            free_formula(sheet, *dest);
+            *dest = NULL;
+        }
+        return;
+    } else if (!*dest) {
+        *dest = alloc_formula(sheet, formula);
+    } else {
+        // before dropping the old key, which may be the same
+        ref_value(sheet, formula->key);
+        unref_value(sheet, (*dest)->key);
+        **dest = *formula;
+    }
+}
+
+void
+storage_set_value(struct address address, struct value value)
+{
+    struct tile *tile;
+
+    if ((tile = get_writable_tile(address, value.type != VALUE_EMPTY))) {
+        set_tile_value(tile, address.row - tile->row, value);
+    }
+}
+
+void
+storage_set_values(struct address address, const struct value *values,
+    int nb, int flags)
+{
+    // set the nb cells from address downwards to values, and their flags,
+    // tile by tile; the cells must not hold formulas
+    int end, has_values, i, start;
+    struct tile *tile;
+
+    while (nb > 0) {
+        start = address.row & (TILE_ROWS - 1);
+        end = MIN(TILE_ROWS, start + nb);
+        has_values = 0;
+        for (i = 0; !has_values && i < end - start; i++) {
+            has_values = values[i].type != VALUE_EMPTY;
+        }
+        if ((tile = get_writable_tile(address, has_values))) {
+            for (i = start; i < end; i++) {
+                set_tile_value(tile, i, values[i - start]);
+                for (int k = 0; k < NB_CELL_FLAGS; k++) {
+                    if (flags & 1 << k) {
+                        tile->flags[k][i/64] |= BIT(i);
+                    } else {
+                        tile->flags[k][i/64] &= ~BIT(i);
+                    }
+                }
+            }
+        }
+        values += end - start;
+        nb -= end - start;
+        address.row += end - start;
+    }
+}
+
+struct snapshot *
+storage_snapshot(void)
+{
+    // return an immutable copy of the storage, sharing the tiles
+    struct snapshot *snapshot;
+    struct tile *tile;
+
+    snapshot = malloc(sizeof(*snapshot));
+    snapshot->nb_tiles = 0;
+    snapshot->tiles = malloc(MAX(nb_tiles, 1)*sizeof(*snapshot->tiles));
+    for (size_t i = 0; i < nb_buckets; i++) {
+        for (tile = buckets[i]; tile; tile = tile->next) {
+            tile->refcount++;
+            snapshot->tiles[snapshot->nb_tiles++] = tile;
+        }
+    }
+    qsort(snapshot->tiles, snapshot->nb_tiles, sizeof(*snapshot->tiles),
+        compare_tiles);
+    return snapshot;
+}
+
+int
+storage_visit_flagged(struct area range, int flag,
+    int (*visit)(struct address address, void *arg), void *arg)
+{
+    // call visit on every cell of range having flag set, until a non-null
+    // result is returned
+    // visit may modify the storage, but flag must not be set on the cells of
+    // range during the visit
+    struct find_flagged_arg find_flagged_arg;
+
+    find_flagged_arg = (struct find_flagged_arg) {
+        .flag = flag,
+        .visit = visit,
+        .arg = arg,
+    };
+    return visit_range(range, find_flagged_in_slice, &find_flagged_arg);
+}
+
+int
+storage_visit_values(struct area range,
+    int (*visit)(struct address address, struct value value, void *arg),
+    void *arg)
+{
+    // call visit on every non-empty cell of range, by columns, until a
+    // non-null result is returned
+    // visit must not modify the storage
+    struct visit_values_arg visit_values_arg;
+
+    visit_values_arg = (struct visit_values_arg) {
+        .visit = visit,
+        .arg = arg,
+    };
+    return visit_range(range, visit_values_in_slice, &visit_values_arg);
+}
+
+static int
+aggregate_slice(struct tile *tile, int start, int end, void *arg)
+{
+    int nb_words;
+    uint64_t masks[TILE_WORDS];
+
+    nb_words = slice_masks(tile->numeric, start, end, masks);
+    aggregate_numbers(arg, tile->numbers + start/64*64, masks, nb_words);
+    return 0;
+}
+
+static void *
+alloc_array(struct sheet *sheet)
+{
+    // return TILE_ROWS null pointers allocated in the arena of sheet
+    union array_slot *slot;
+
+    if ((slot = sheet->free_arrays)) {
+        sheet->free_arrays = slot->next_free;
+        memset(slot, 0, sizeof(*slot));
+    } else {
+        slot = arena_alloc(&sheet->arena, sizeof(*slot));
+    }
+    return slot->pointers;
+}
+
+static struct formula *
+alloc_formula(struct sheet *sheet, const struct formula *formula)
+{
+    // return a copy of formula allocated in the arena of sheet
+    union formula_slot *slot;
+
+    if ((slot = sheet->free_formulas)) {
+        sheet->free_formulas = slot->next_free;
+    } else {
+        slot = arena_alloc(&sheet->arena, sizeof(*slot));
+    }
+    slot->formula = *formula;
+    ref_value(sheet, formula->key);
+    return &slot->formula;
+}
+
+static struct tile *
+alloc_tile(struct sheet *sheet)
+{
+    // return a zeroed tile allocated in the arena of sheet
+    struct tile *tile;
+
+    if ((tile = sheet->free_tiles)) {
+        sheet->free_tiles = tile->next;
+        memset(tile, 0, sizeof(*tile));
+    } else {
+        tile = arena_alloc(&sheet->arena, sizeof(*tile));
+    }
+    tile->sheet = sheet;
+    return tile;
+}
+
+static int
+compare_addresses(const void *a, const void *b)
+{
+    // of a single sheet
+    uint64_t x = address_key(* (struct address *) a),
+        y = address_key(* (struct address *) b);
+
+    return (x > y) - (x < y);
+}
+
+static int
+compare_tiles(const void *a, const void *b)
+{
+    const struct tile *x = * (struct tile **) a, *y = * (struct tile **) b;
+
+    if (x->sheet_id != y->sheet_id) {
+        return x->sheet_id < y->sheet_id ? -1 : 1;
+    }
+    return (x->key > y->key) - (x->key < y->key);
+}
+
+static struct tile *
+copy_tile(const struct tile *tile)
+{
+    struct sheet *sheet;
+    struct tile *copy;
+
+    sheet = tile->sheet;
+    copy = alloc_tile(sheet);
+    *copy = *tile;
+    copy->refcount = 1;
+    if (tile->strings) {
+        copy->strings = alloc_array(sheet);
+        memcpy(copy->strings, tile->strings, TILE_ROWS*sizeof(*copy->strings));
+        for (int i = 0; i < TILE_ROWS; i++) {
+            if (copy->strings[i]) {
+                find_string_count(sheet, copy->strings[i])->nb_refs++;
+            }
+        }
+    }
+    if (tile->formulas) {
+        // formulas are modified in place, so they can not be shared
+        copy->formulas = alloc_array(sheet);
+        for (int i = 0; i < TILE_ROWS; i++) {
+            if (tile->formulas[i]) {
+                copy->formulas[i] = alloc_formula(sheet, tile->formulas[i]);
+            }
+        }
+    }
+    return copy;
+}
+
+static int
+find_error_in_slice(struct tile *tile, int start, int end, void *arg)
+{
+    struct find_error_arg *find_error_arg;
+
+    if (!tile->nb_errors) {
+        return 0;
+    }
+    find_error_arg = arg;
+    for (int i = start; i < end; i++) {
+        if (tile->types[i] != VALUE_ERROR) {
+            continue;
+        } else if (!find_error_arg->nb_errors++) {
+            find_error_arg->error->type = VALUE_ERROR;
+            find_error_arg->error->as.error = tile->numbers[i];
+        }
+    }
+    return 0;
+}
+
+static int
+find_flagged_in_slice(struct tile *tile, int start, int end, void *arg)
+{
+    int bit, k, res, w0;
+    uint64_t masks[TILE_WORDS], mask;
+    struct find_flagged_arg *find_flagged_arg;
+
+    find_flagged_arg = arg;
+    for (k = 0; !(find_flagged_arg->flag & 1 << k); k++);
+    w0 = start/64;
+    slice_masks(tile->flags[k], start, end, masks);
+    for (int w = w0; w < (end + 63)/64; w++) {
+        // the bitmap is read again after each visit, as it may change
+        while ((mask = masks[w - w0] & tile->flags[k][w])) {
+            bit = __builtin_ctzll(mask);
+            masks[w - w0] &= ~BIT(bit);
+            res = find_flagged_arg->visit((struct address) {
+                .sheet_id = tile->sheet_id,
+                .row = tile->row + 64*w + bit,
+                .col = tile->col,
+            }, find_flagged_arg->arg);
+            if (res) {
+                return res;
+            }
+        }
+    }
+    return 0;
+}
+
+static struct tile **
+find_link(struct address address)
+{
+    // return the link to the tile containing address in its bucket, pointing
+    // to NULL if it does not exist
+    uint64_t key;
+    struct tile **link;
+
+    key = tile_key(address);
+    link = &buckets[hash(address.sheet_id, key) & (nb_buckets - 1)];
+    for (; *link; link = &(*link)->next) {
+        if ((*link)->sheet_id == address.sheet_id && (*link)->key == key) {
+            break;
+        }
+    }
+    return link;
+}
+
+static struct sheet *
+find_sheet(sheet_id sheet_id, int create)
+{
+    // return NULL if the sheet does not exist and create is null
+    struct sheet *sheet;
+
+    for (sheet = sheets; sheet; sheet = sheet->next) {
+        if (sheet->sheet_id == sheet_id) {
+            return sheet;
+        }
+    }
+    if (!create) {
+        return NULL;
+    }
+    sheet = calloc(1, sizeof(*sheet));
+    sheet->sheet_id = sheet_id;
+    sheet->next = sheets;
+    sheets = sheet;
+    return sheet;
+}
+
+static struct string_count *
+find_string_count(const struct sheet *sheet, const struct string *string)
+{
+    // return the count of string, or the unused slot where it would be
+    // inserted
+    size_t i, mask;
+
+    mask = sheet->nb_string_slots - 1;
+    i = string->hash & mask;
+    while (sheet->strings[i].string && sheet->strings[i].string != string) {
+        i = (i + 1) & mask;
+    }
+    return &sheet->strings[i];
+}
+
+static struct tile *
+find_tile(struct address address)
+{
+    // return the tile containing address, or NULL if it does not exist
+    // the tile must not be modified, see get_writable_tile
+    return nb_buckets ? *find_link(address) : NULL;
+}
+
+static void
+free_array(struct sheet *sheet, void *array)
+{
+    // keep the slot for a later array of the same sheet
+    union array_slot *slot;
+
+    slot = array;
+    slot->next_free = sheet->free_arrays;
+    sheet->free_arrays = slot;
+}
+
+static void
+free_formula(struct sheet *sheet, struct formula *formula)
+{
+    // keep the slot for a later formula of the same sheet
+    union formula_slot *slot;
+
+    unref_value(sheet, formula->key);
+    slot = (union formula_slot *) formula;
+    slot->next_free = sheet->free_formulas;
+    sheet->free_formulas = slot;
+}
+
+static struct tile *
+get_writable_tile(struct address address, int create)
+{
+    // return the tile containing address, copied first if it is shared, or
+    // NULL if it does not exist and create is null
+    struct tile **link, *tile;
+
+    if (create && nb_tiles >= nb_buckets) {
+        // keep the load factor under 1
+        resize_buckets(nb_buckets ? 2*nb_buckets : INITIAL_NB_BUCKETS);
+    }
+    if (!nb_buckets) {
+        return NULL;
+    }
+    link = find_link(address);
+    if ((tile = *link) && tile->refcount > 1) {
+        *link = copy_tile(tile);
+        (*link)->next = tile->next;
+        tile->refcount--;
+        return *link;
+    } else if (tile || !create) {
+        return tile;
+    }
+
+    // insert a new empty tile
+    tile = *link = alloc_tile(find_sheet(address.sheet_id, 1));
+    tile->refcount = 1;
+    tile->sheet_id = address.sheet_id;
+    tile->row = address.row & ~(TILE_ROWS - 1);
+    tile->col = address.col;
+    tile->key = tile_key(address);
+    nb_tiles++;
+    return tile;
+}
+
+static size_t
+hash(sheet_id sheet_id, uint64_t key)
+{
+    uint64_t h;
+
+    h = (uint64_t) (unsigned) sheet_id*0x9e3779b97f4a7c15u;
+    h ^= (key >> TILE_SHIFT)*0xc2b2ae3d27d4eb4fu;
+    return (size_t) (h ^ (h >> 29));
+}
+
+static int
+lower_bound(const struct snapshot *snapshot, struct address address)
+{
+    // index of the first tile of snapshot not before the tile of address
+    int low, high, mid;
+    struct tile key, *key_ptr;
+
+    key.sheet_id = address.sheet_id;
+    key.key = tile_key(address);
+    key_ptr = &key;
+    low = 0;
+    high = snapshot->nb_tiles;
+    while (low < high) {
+        mid = low + (high - low)/2;
+        if (compare_tiles(&snapshot->tiles[mid], &key_ptr) < 0) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+    return low;
+}
+
+static void
+ref_value(struct sheet *sheet, struct value value)
+{
+    // count a reference of sheet to the string of value, if any
+    struct string_count *count;
+
+    if (value.type != VALUE_STRING) {
+        return;
+    }
+    if (2*(sheet->nb_strings + 1) > sheet->nb_string_slots) {
+        // keep the load factor under 1/2
+        resize_string_counts(sheet, sheet->nb_string_slots ?
+            2*sheet->nb_string_slots : 64);
+    }
+    count = find_string_count(sheet, value.as.string);
+    if (!count->string) {
+        string_ref(value.as.string);
+        count->string = value.as.string;
+        sheet->nb_strings++;
+    }
+    count->nb_refs++;
+}
+
+static void
+release_tile(struct tile *tile)
+{
+    // keep tile and its payloads for later ones of its sheet once it is not
+    // shared anymore
+    struct sheet *sheet;
+
+    if (--tile->refcount) {
+        return;
+    }
+    sheet = tile->sheet;
+    if (tile->strings) {
+        for (int i = 0; i < TILE_ROWS; i++) {
+            if (tile->strings[i]) {
+                unref_value(sheet, (struct value) {
+                    .type = VALUE_STRING,
+                    .as.string = tile->strings[i],
+                });
+            }
+        }
+        free_array(sheet, tile->strings);
+    }
+    if (tile->formulas) {
+        for (int i = 0; i < TILE_ROWS; i++) {
+            if (tile->formulas[i]) {
+                free_formula(sheet, tile->formulas[i]);
+            }
+        }
+        free_array(sheet, tile->formulas);
+    }
+    tile->next = sheet->free_tiles;
+    sheet->free_tiles = tile;
+}
+
+static void
+resize_buckets(size_t new_nb_buckets)
+{
+    // new_nb_buckets must be a power of two
+    size_t bucket;
+    struct tile **new_buckets, *tile, *next;
+
+    new_buckets = calloc(new_nb_buckets, sizeof(*new_buckets));
+    for (size_t i = 0; i < nb_buckets; i++) {
+        for (tile = buckets[i]; tile; tile = next) {
+            next = tile->next;
+            bucket = hash(tile->sheet_id, tile->key) & (new_nb_buckets - 1);
+            tile->next = new_buckets[bucket];
+            new_buckets[bucket] = tile;
+        }
+    }
+    free(buckets);
+    buckets = new_buckets;
+    nb_buckets = new_nb_buckets;
+}
+
+static void
+resize_string_counts(struct sheet *sheet, size_t nb_slots)
+{
+    // nb_slots must be a power of two
+    size_t old_nb_slots;
+    struct string_count *old_strings;
+
+    old_strings = sheet->strings;
+    old_nb_slots = sheet->nb_string_slots;
+    sheet->strings = calloc(nb_slots, sizeof(*sheet->strings));
+    sheet->nb_string_slots = nb_slots;
+    for (size_t i = 0; i < old_nb_slots; i++) {
+        if (old_strings[i].string) {
+            *find_string_count(sheet, old_strings[i].string) = old_strings[i];
+        }
+    }
+    free(old_strings);
+}
+
+static void
+set_tile_value(struct tile *tile, int i, struct value value)
+{
+    tile->nb_errors -= tile->types[i] == VALUE_ERROR;
+    tile->nb_errors += value.type == VALUE_ERROR;
+    // before dropping the old one, which may be the same
+    ref_value(tile->sheet, value);
+    if (tile->types[i] == VALUE_STRING) {
+        unref_value(tile->sheet, tile_value(tile, i));
+        tile->strings[i] = NULL;
+    }
+    tile->types[i] = value.type;
+    switch (value.type) {
+    case VALUE_EMPTY:
+        tile->numbers[i] = 0;
+        break;
+    case VALUE_STRING:
+        if (!tile->strings) {
+            tile->strings = alloc_array(tile->sheet);
+        }
+        tile->strings[i] = value.as.string;
+        tile->numbers[i] = 0;
+        break;
+    case VALUE_BOOLEAN:
+        tile->numbers[i] = value.as.boolean;
+        break;
+    case VALUE_ERROR:
+        tile->numbers[i] = value.as.error;
+        break;
+    case VALUE_NUMBER:
+        tile->numbers[i] = value.as.number;
+        break;
+    }
+    if (value.type == VALUE_EMPTY) {
+        tile->present[i/64] &= ~BIT(i);
+    } else {
+        tile->present[i/64] |= BIT(i);
+    }
+    if (value.type == VALUE_NUMBER) {
+        tile->numeric[i/64] |= BIT(i);
+    } else {
+        tile->numeric[i/64] &= ~BIT(i);
+    }
+}
+
+static int
+slice_masks(const uint64_t *bitmap, int start, int end, uint64_t *masks)
+{
+    // copy the words of bitmap covering [start, end) in masks, clearing the
+    // bits out of range, and return the number of words
+    int nb_words, w0;
+
+    w0 = start/64;
+    nb_words = (end + 63)/64 - w0;
+    memcpy(masks, bitmap + w0, nb_words*sizeof(*masks));
+    masks[0] &= UINT64_MAX << (start & 63);
+    if (end & 63) {
+        masks[nb_words - 1] &= BIT(end) - 1;
+    }
+    return nb_words;
+}
+
+static uint64_t
+tile_key(struct address address)
+{
+    // address_key of the first cell of the tile holding address
+    address.row &= ~(TILE_ROWS - 1);
+    return address_key(address);
+}
+
+static struct value
+tile_value(const struct tile *tile, int i)
+{
+    struct value value;
+
+    value.type = tile->types[i];
+    switch (value.type) {
+    case VALUE_BOOLEAN:
+        value.as.boolean = tile->numbers[i] != 0;
+        break;
+    case VALUE_ERROR:
+        value.as.error = tile->numbers[i];
+        break;
+    case VALUE_STRING:
+        value.as.string = tile->strings[i];
+        break;
+    default:
+        value.as.number = tile->numbers[i];
+        break;
+    }
+    return value;
+}
+
+static void
+unref_value(struct sheet *sheet, struct value value)
+{
+    // drop a reference of sheet to the string of value, if any, and its
+    // count once null, moving back the following strings of the cluster
+    size_t i, j, k, mask;
+    struct string_count *count;
+
+    if (value.type != VALUE_STRING) {
+        return;
+    }
+    count = find_string_count(sheet, value.as.string);
+    if (--count->nb_refs) {
+        return;
+    }
+    string_unref(value.as.string);
+    sheet->nb_strings--;
+    mask = sheet->nb_string_slots - 1;
+    i = count - sheet->strings;
+    for (j = (i + 1) & mask; sheet->strings[j].string; j = (j + 1) & mask) {
+        // the string at j can fill the hole at i unless its ideal slot k
+        // lies cyclically in (i, j]
+        k = sheet->strings[j].string->hash & mask;
+        if (i <= j ? i < k && k <= j : i < k || k <= j) {
+            continue;
+        }
+        sheet->strings[i] = sheet->strings[j];
+        i = j;
+    }
+    sheet->strings[i].string = NULL;
+    sheet->strings[i].nb_refs = 0;
+}
+
+static int
+visit_cells_in_slice(const struct tile *tile, int start, int end,
+    int (*visit)(struct address address, struct value value,
+    const struct formula *formula, void *arg), void *arg)
+{
+    int res;
+    const struct formula *formula;
+
+    for (int j = start; j < end; j++) {
+        formula = tile->formulas ? tile->formulas[j] : NULL;
+        if (!formula && !(tile->present[j/64] & BIT(j))) {
+            continue;
+        }
+        res = visit((struct address) {
+            .sheet_id = tile->sheet_id,
+            .row = tile->row + j,
+            .col = tile->col,
+        }, tile_value(tile, j), formula, arg);
+        if (res) {
+            return res;
+        }
+    }
+    return 0;
+}
+
+static int
+visit_range(struct area range,
+    int (*visit)(struct tile *tile, int start, int end, void *arg), void *arg)
+{
+    // call visit on the slices [start, end) of the existing tiles covering
+    // range, until a non-null result is returned
+    int res;
+    int64_t end, row;
+    struct address address;
+    struct tile *tile;
+
+    if (range.row_span < 1 || range.col_span < 1) {
+        return 0;
+    } else if ((range.row_span/TILE_ROWS + 2)*range.col_span >
+        (int64_t) nb_tiles) {
+        return visit_sparse_range(range, visit, arg);
+    }
+    address.sheet_id = range.sheet_id;
+    for (int j = 0; j < range.col_span; j++) {
+        address.col = range.col + j;
+        for (row = range.row; row < range.row + range.row_span;
+            row = (row & ~(TILE_ROWS - 1)) + TILE_ROWS) {
+            address.row = row;
+            if (!(tile = find_tile(address))) {
+                continue;
+            }
+            end = MIN(range.row + range.row_span, tile->row + TILE_ROWS);
+            if ((res = visit(tile, row - tile->row, end - tile->row, arg))) {
+                return res;
+            }
+        }
+    }
+    return 0;
+}
+
+static int
+visit_sparse_range(struct area range,
+    int (*visit)(struct tile *tile, int start, int end, void *arg), void *arg)
+{
+    // visit_range, for ranges covering more tiles than exist (as whole
+    // columns do): the tiles are found from the buckets, then visited in
+    // order, looked up again as visit may replace them
+    int res;
+    size_t nb;
+    int64_t end;
+    struct address *starts;
+    struct tile *tile;
+
+    starts = malloc(MAX(nb_tiles, 1)*sizeof(*starts));
+    nb = 0;
+    for (size_t i = 0; i < nb_buckets; i++) {
+        for (tile = buckets[i]; tile; tile = tile->next) {
+            if (tile->sheet_id == range.sheet_id && tile->col >= range.col &&
+                tile->col < range.col + range.col_span &&
+                tile->row < range.row + range.row_span &&
+                tile->row + TILE_ROWS > range.row) {
+                starts[nb++] = (struct address) {
+                    .sheet_id = tile->sheet_id,
+                    .row = MAX(tile->row, range.row),
+                    .col = tile->col,
+                };
+            }
+        }
+    }
+    qsort(starts, nb, sizeof(*starts), compare_addresses);
+    res = 0;
+    for (size_t i = 0; !res && i < nb; i++) {
+        if ((tile = find_tile(starts[i]))) {
+            end = MIN(range.row + range.row_span, tile->row + TILE_ROWS);
+            res = visit(tile, starts[i].row - tile->row, end - tile->row,
+                arg);
+        }
+    }
+    free(starts);
+    return res;
+}
+
+static int
+visit_values_in_slice(struct tile *tile, int start, int end, void *arg)
+{
+    int bit, res, w0;
+    uint64_t masks[TILE_WORDS];
+    struct visit_values_arg *visit_values_arg;
+
+    visit_values_arg = arg;
+    w0 = start/64;
+    slice_masks(tile->present, start, end, masks);
+    for (int w = w0; w < (end + 63)/64; w++) {
+        for (; masks[w - w0]; masks[w - w0] &= masks[w - w0] - 1) {
+            bit = __builtin_ctzll(masks[w - w0]);
+            res = visit_values_arg->visit((struct address) {
+                .sheet_id = tile->sheet_id,
+                .row = tile->row + 64*w + bit,
+                .col = tile->col,
+            }, tile_value(tile, 64*w + bit), visit_values_arg->arg);
+            if (res) {
+                return res;
+            }
+        }
+    }
+    return 0;
+}
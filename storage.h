@@ -0,0 +1,51 @@
+#ifndef STORAGE_H
+#define STORAGE_H
+
+#include "kernels.h"
+#include "types.h"
+
+// cells are stored by tiles of TILE_ROWS consecutive rows of a single column,
+// values being split into typed arrays along with per-tile bitmaps
+#define TILE_SHIFT                          10
+#define TILE_ROWS                           (1 << TILE_SHIFT)
+#define TILE_WORDS                          (TILE_ROWS/64)
+
+// cell flags
+#define CELL_DIRTY                          (1 << 0) // formula to recompute
+#define CELL_EVALUATING                     (1 << 1) // cycle detection
+#define CELL_UNSENT                         (1 << 2) // unknown to cache manager
+#define NB_CELL_FLAGS                       3
+
+struct snapshot;
+
+int snapshot_get_flags(const struct snapshot *snapshot,
+    struct address address);
+struct area snapshot_sheet_area(const struct snapshot *snapshot,
+    sheet_id sheet_id);
+int snapshot_visit_area(const struct snapshot *snapshot, struct area area,
+    int (*visit)(struct address address, struct value value,
+    const struct formula *formula, void *arg), void *arg);
+int snapshot_visit_cells(const struct snapshot *snapshot,
+    int (*visit)(struct address address, struct value value,
+    const struct formula *formula, void *arg), void *arg);
+void storage_aggregate(struct area range, struct aggregate *aggregate);
+void storage_clear(void);
+void storage_clear_sheet(sheet_id sheet_id);
+int storage_find_error(struct area range, struct value *error);
+int storage_get_flags(struct address address);
+const struct formula *storage_get_formula(struct address address);
+struct value storage_get_value(struct address address);
+void storage_release_snapshot(struct snapshot *snapshot);
+void storage_set_flags(struct address address, int flags);
+void storage_set_formula(struct address address, const struct formula *formula);
+void storage_set_value(struct address address, struct value value);
+void storage_set_values(struct address address, const struct value *values,
+    int nb, int flags);
+struct snapshot *storage_snapshot(void);
+int storage_visit_flagged(struct area range, int flag,
+    int (*visit)(struct address address, void *arg), void *arg);
+int storage_visit_values(struct area range,
+    int (*visit)(struct address address, struct value value, void *arg),
+    void *arg);
+
+#endif // STORAGE_H
@@ -0,0 +1,176 @@
+// reference-counted pool of interned strings
+// strings may be referenced by several threads (through cell_content), hence
+// the mutex; bulk loaders intern and release their strings by batches, so
+// as to take it once per batch
+
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "string_pool.h"
+#include "types.h"
+
+#define INITIAL_NB_BUCKETS                  (1 << 10)
+
+static const struct string *intern(const char *data, size_t length,
+    uint64_t h);
+static void resize_buckets(size_t new_nb_buckets);
+static void unref(const struct string *string);
+
+static size_t nb_buckets, nb_strings;
+static pthread_mutex_t pool_mutex = PTHREAD_MUTEX_INITIALIZER;
+static struct string **buckets;
+
+uint64_t
+string_hash(const char *data, size_t length)
+{
+    // FNV-1a
+    uint64_t h;
+
+    h = 0xcbf29ce484222325u;
+    for (size_t i = 0; i < length; i++) {
+        h = (h ^ (unsigned char) data[i])*0x100000001b3u;
+    }
+    return h;
+}
+
+const struct string *
+string_intern(const char *data, size_t length)
+{
+    // return a new reference to the interned copy of data
+    uint64_t h;
+    const struct string *string;
+
+    h = string_hash(data, length);
+    pthread_mutex_lock(&pool_mutex);
+    string = intern(data, length, h);
+    pthread_mutex_unlock(&pool_mutex);
+    return string;
+}
+
+void
+string_intern_keys(const struct string_key *keys, size_t n,
+    const struct string **strings)
+{
+    // string_intern for each of the n keys, in strings
+    pthread_mutex_lock(&pool_mutex);
+    for (size_t i = 0; i < n; i++) {
+        strings[i] = intern(keys[i].data, keys[i].length, keys[i].hash);
+    }
+    pthread_mutex_unlock(&pool_mutex);
+}
+
+void
+string_ref(const struct string *string)
+{
+    pthread_mutex_lock(&pool_mutex);
+    ((struct string *) string)->refcount++;
+    pthread_mutex_unlock(&pool_mutex);
+}
+
+void
+string_unref(const struct string *string)
+{
+    pthread_mutex_lock(&pool_mutex);
+    unref(string);
+    pthread_mutex_unlock(&pool_mutex);
+}
+
+void
+string_unref_all(const struct string *const *strings, size_t n)
+{
+    pthread_mutex_lock(&pool_mutex);
+    for (size_t i = 0; i < n; i++) {
+        unref(strings[i]);
+    }
+    pthread_mutex_unlock(&pool_mutex);
+}
+
+void
+value_ref(struct value value)
+{
+    if (value.type == VALUE_STRING) {
+        string_ref(value.as.string);
+    }
+}
+
+void
+value_unref(struct value value)
+{
+    if (value.type == VALUE_STRING) {
+        string_unref(value.as.string);
+    }
+}
+
+static const struct string *
+intern(const char *data, size_t length, uint64_t h)
+{
+    // string_intern, under pool_mutex
+    struct string *string, **bucket;
+
+    if (nb_strings >= nb_buckets) {
+        resize_buckets(nb_buckets ? 2*nb_buckets : INITIAL_NB_BUCKETS);
+    }
+    bucket = &buckets[h & (nb_buckets - 1)];
+    for (string = *bucket; string; string = string->next) {
+        if (string->hash == h && string->length == length &&
+            !memcmp(string->data, data, length)) {
+            string->refcount++;
+            return string;
+        }
+    }
+    string = malloc(sizeof(*string) + length + 1);
+    string->hash = h;
+    string->refcount = 1;
+    string->length = length;
+    memcpy(string->data, data, length);
+    string->data[length] = '\0';
+    string->next = *bucket;
+    *bucket = string;
+    nb_strings++;
+    return string;
+}
+
+static void
+resize_buckets(size_t new_nb_buckets)
+{
+    // new_nb_buckets must be a power of two
+    struct string **new_buckets, *string, *next;
+
+    new_buckets = calloc(new_nb_buckets, sizeof(*new_buckets));
+    for (size_t i = 0; i < nb_buckets; i++) {
+        for (string = buckets[i]; string; string = next) {
+            next = string->next;
+            string->next = new_buckets[string->hash & (new_nb_buckets - 1)];
+            new_buckets[string->hash & (new_nb_buckets - 1)] = string;
+        }
+    }
+    free(buckets);
+    buckets = new_buckets;
+    nb_buckets = new_nb_buckets;
+}
+
+static void
+unref(const struct string *string)
+{
+    // string_unref, under pool_mutex: the string is removed from the pool
+    // when its last reference is dropped
+    struct string **p;
+
+    if (--((struct string *) string)->refcount) {
+        return;
+    }
+    for (p = &buckets[string->hash & (nb_buckets - 1)]; *p; p = &(*p)->next) {
+        if (*p == string) {
+            *p = string->next;
+            break;
+        }
+    }
+    free((struct string *) string);
+    if (!--nb_strings) {
+        free(buckets); buckets = NULL;
+        nb_buckets = 0;
+    }
+}
@@ -0,0 +1,33 @@
+#ifndef STRING_POOL_H
+#define STRING_POOL_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "types.h"
+
+struct string {
+    // interned strings are unique, and can be compared by address
+    struct string *next; // next string in the same bucket
+    uint64_t hash;
+    size_t refcount, length;
+    char data[]; // null-terminated
+};
+struct string_key {
+    // string to intern, not null-terminated
+    const char *data;
+    size_t length;
+    uint64_t hash; // see string_hash
+};
+
+uint64_t string_hash(const char *data, size_t length);
+const struct string *string_intern(const char *data, size_t length);
+void string_intern_keys(const struct string_key *keys, size_t n,
+    const struct string **strings);
+void string_ref(const struct string *string);
+void string_unref(const struct string *string);
+void string_unref_all(const struct string *const *strings, size_t n);
+void value_ref(struct value value);
+void value_unref(struct value value);
+
+#endif // STRING_POOL_H
@@ -11,6 +11,7 @@ void *state_manager_routine(void *sem);
 void *cache_manager_routine(void *sem);
 void *sender_routine(void *sem);
 void *receiver_routine(void *sem);
+void *writer_routine(void *sem);
 
 static void spawn_thread(enum thread_id thread_id,
     void *(*start_routine) (void *), const pthread_attr_t *attr);
@@ -59,6 +60,10 @@ spawn_threads(void)
 {
     pthread_attr_t attr;
 
+    // threads may post to the ones spawned after them
+    for (int i = 0; i < THREAD_NB; i++) {
+        sem_init(&thread_sems[i], 0, 0);
+    }
     pthread_attr_init(&attr);
     pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_JOINABLE);
     spawn_thread(CONTROLLER, controller_routine, &attr);
@@ -66,6 +71,7 @@ spawn_threads(void)
     spawn_thread(CACHE_MANAGER, cache_manager_routine, &attr);
     spawn_thread(SENDER, sender_routine, &attr);
     spawn_thread(RECEIVER, receiver_routine, &attr);
+    spawn_thread(WRITER, writer_routine, &attr);
     pthread_attr_destroy(&attr);
 }
 
@@ -111,7 +117,6 @@ static void
 spawn_thread(enum thread_id thread_id, void *(*start_routine) (void *),
     const pthread_attr_t *attr)
 {
-    sem_init(&thread_sems[thread_id], 0, 0);
     pthread_create(&pthread_ids[thread_id], attr, start_routine,
         &thread_sems[thread_id]);
 }
@@ -7,8 +7,9 @@ enum thread_id {
     CACHE_MANAGER,
     SENDER,
     RECEIVER,
+    WRITER,
 };
-#define THREAD_NB   5
+#define THREAD_NB   6
 
 void capture_signals(void);
 int join_threads(void);
@@ -1,5 +1,7 @@
+#include <inttypes.h>
 #include <stdio.h>
 
+#include "hidden.h"
 #include "types.h"
 
 int
@@ -11,7 +13,8 @@ address_equal(struct address a, struct address b)
 int
 address_in_area(struct address address, struct area area)
 {
-    int same_sheet, row_in_range, col_in_range, d;
+    int same_sheet, row_in_range, col_in_range;
+    int64_t d;
 
     same_sheet = address.sheet_id == area.sheet_id;
     row_in_range = (d = address.row - area.row) >= 0 && d < area.row_span;
@@ -25,6 +28,14 @@ address_in_view(struct address address, struct view view)
     return get_view_index(view, address) >= 0;
 }
 
+uint64_t
+address_key(struct address address)
+{
+    // column and row packed so that keys sort as cells are stored, by column
+    // then row, sheets being compared apart as their ids are arbitrary
+    return (uint64_t) address.col << ROW_BITS | (uint64_t) address.row;
+}
+
 struct address
 address_of_cursor(struct cursor_pos cursor)
 {
@@ -35,54 +46,100 @@ address_of_cursor(struct cursor_pos cursor)
     };
 }
 
+int
+area_equal(struct area a, struct area b)
+{
+    return a.sheet_id == b.sheet_id && a.row == b.row && a.col == b.col &&
+        a.row_span == b.row_span && a.col_span == b.col_span;
+}
+
+int
+area_intersect(struct area a, struct area b)
+{
+    return a.sheet_id == b.sheet_id &&
+        a.row < b.row + b.row_span && b.row < a.row + a.row_span &&
+        a.col < b.col + b.col_span && b.col < a.col + a.col_span;
+}
+
+struct area
+area_of_address(struct address address)
+{
+    return (struct area) {
+        .sheet_id = address.sheet_id,
+        .row = address.row,
+        .col = address.col,
+        .row_span = 1,
+        .col_span = 1,
+    };
+}
+
 int
 col_name(int x, char buf[])
 {
-    if (x < 26) {
-        buf[0] = 'A' + x;
-        return 1;
-    } else {
-        buf[0] = 'A' + x/26 - 1;
-        buf[1] = 'A' + x%26;
-        return 2;
+    // bijective base-26 (A, ..., Z, AA, ...), buf is not null-terminated
+    int len;
+    char tmp[16];
+
+    len = 0;
+    do {
+        tmp[len++] = 'A' + x%26;
+        x = x/26 - 1;
+    } while (x >= 0);
+    for (int i = 0; i < len; i++) {
+        buf[i] = tmp[len - 1 - i];
     }
+    return len;
 }
 
 struct address
 get_view_address(struct view view, int index)
 {
-    int length, i, j;
+    int width;
 
-    length = get_view_length(view);
-    i = index/length;
-    j = index%length;
+    width = view.xforce + view.xlen;
     return (struct address) {
         .sheet_id = view.sheet_id,
-        .row = i < view.yforce ? i : view.ymin + i - view.yforce,
-        .col = j < view.xforce ? j : view.xmin + j - view.xforce,
+        .row = get_view_row(view, index/width),
+        .col = get_view_col(view, index%width),
     };
 }
 
+int
+get_view_col(struct view view, int j)
+{
+    // return the column of the j-th column of view, the ones after the
+    // frozen ones being the shown ones from xmin
+    return j < view.xforce ? j :
+        next_shown(view.hidden, AXIS_COLS, view.xmin, j - view.xforce);
+}
+
+int
+get_view_col_index(struct view view, int x)
+{
+    // return the position of the column x in view, or -1
+    int d;
+
+    if (x >= 0 && x < view.xforce) {
+        return x;
+    } else if (x < view.xmin) {
+        return -1;
+    }
+    d = shown_between(view.hidden, AXIS_COLS, view.xmin, x);
+    return d >= 0 && d < view.xlen ? view.xforce + d : -1;
+}
+
 int
 get_view_index(struct view view, struct address address)
 {
     // return a negative result if address is not in view
-    int same_sheet, row_in_view, col_in_view, d, i, j;
-
-    same_sheet = address.sheet_id == view.sheet_id;
-    row_in_view = address.row < view.yforce ||
-        ((d = address.row - view.ymin) >= 0 && d < view.ylen);
-    col_in_view = address.col < view.xforce ||
-        ((d = address.col - view.xmin) >= 0 && d < view.xlen);
-    if (same_sheet && row_in_view && col_in_view) {
-        i = address.row < view.yforce ? address.row :
-            view.yforce + address.row - view.ymin;
-        j = address.col < view.xforce ? address.col :
-            view.xforce + address.col - view.xmin;
-        return i*get_view_length(view) + j;
-    } else {
+    int i, j;
+
+    if (address.sheet_id != view.sheet_id ||
+        (i = get_view_row_index(view, address.row)) < 0 ||
+        (j = get_view_col_index(view, address.col)) < 0) {
         return -1;
     }
+    return i*(view.xforce + view.xlen) + j;
 }
 
 int
@@ -91,16 +148,59 @@ get_view_length(struct view view)
     return (view.xforce + view.xlen)*(view.yforce + view.ylen);
 }
 
+int64_t
+get_view_row(struct view view, int i)
+{
+    // return the row of the i-th row of view, see get_view_col
+    return i < view.yforce ? i :
+        next_shown(view.hidden, AXIS_ROWS, view.ymin, i - view.yforce);
+}
+
+int
+get_view_row_index(struct view view, int64_t y)
+{
+    // return the position of the row y in view, or -1
+    int64_t d;
+
+    if (y >= 0 && y < view.yforce) {
+        return y;
+    } else if (y < view.ymin) {
+        return -1;
+    }
+    d = shown_between(view.hidden, AXIS_ROWS, view.ymin, y);
+    return d >= 0 && d < view.ylen ? view.yforce + d : -1;
+}
+
+int
+row_name(int64_t y, char buf[])
+{
+    return sprintf(buf, "%" PRId64, y);
+}
+
 int
-row_name(int y, char buf[])
+value_equal(struct value a, struct value b)
 {
-    return sprintf(buf, "%d", y);
+    if (a.type != b.type) {
+        return 0;
+    }
+    switch (a.type) {
+    case VALUE_BOOLEAN:
+        return a.as.boolean == b.as.boolean;
+    case VALUE_ERROR:
+        return a.as.error == b.as.error;
+    case VALUE_NUMBER:
+        return a.as.number == b.as.number;
+    case VALUE_STRING:
+        return a.as.string == b.as.string;
+    default:
+        return 1;
+    }
 }
 
 int
 view_equal(struct view a, struct view b)
 {
-    return a.sheet_id == b.sheet_id &&
+    return a.sheet_id == b.sheet_id && a.hidden == b.hidden &&
         a.xforce == b.xforce && a.xlen == b.xlen && a.xmin == b.xmin &&
         a.yforce == b.yforce && a.ylen == b.ylen && a.ymin == b.ymin;
 }
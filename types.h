@@ -1,41 +1,103 @@
 #ifndef TYPES_H
 #define TYPES_H
 
+#include <stdint.h>
+
 #include "config.h"
 #include "termbox2.h"
 
 #define MAX(A, B)   ((A) > (B) ? (A) : (B))
 #define MIN(A, B)   ((A) < (B) ? (A) : (B))
 
+// addresses are packed in a key of ROW_BITS + COL_BITS bits, see address_key
+#define COL_BITS    20
+#define ROW_BITS    40
+#define NB_COLUMNS  (1 << COL_BITS) // of a sheet
+#define NB_ROWS     ((int64_t) 1 << ROW_BITS) // of a sheet
+
 // TODO: reorder
 typedef int sheet_id;
 struct address {
     sheet_id sheet_id;
-    int row, col;
+    int64_t row;
+    int col;
 };
 struct area {
     sheet_id sheet_id;
-    int row, col;
-    int row_span, col_span;
+    int64_t row;
+    int col;
+    int64_t row_span;
+    int col_span;
+};
+enum error {
+    ERROR_CYCLE,
+    ERROR_DIV0,
+    ERROR_NA,
+};
+enum value_type {
+    VALUE_EMPTY,
+    VALUE_BOOLEAN,
+    VALUE_ERROR,
+    VALUE_NUMBER,
+    VALUE_STRING,
+};
+struct hidden;
+struct string;
+struct value {
+    enum value_type type;
+    union {
+        int boolean;
+        enum error error;
+        double number;
+        const struct string *string; // interned, see string_pool.h
+    } as;
+};
+enum function {
+    FUNCTION_NONE, // literal value
+    FUNCTION_AVERAGE,
+    FUNCTION_COUNT,
+    FUNCTION_MATCH_APPROX, // position of the largest number <= key
+    FUNCTION_MATCH_EXACT, // position of the first value equal to key
+    FUNCTION_MAX,
+    FUNCTION_MIN,
+    FUNCTION_SUM,
+};
+struct formula {
+    enum function function;
+    struct area range;
+    struct value key; // FUNCTION_MATCH_* only
+};
+struct definition {
+    // the content (value if formula.function == FUNCTION_NONE, else formula)
+    // is applied to every cell of area
+    // strings of value and formula.key are references owned by the definition
+    struct area area;
+    struct value value;
+    struct formula formula;
 };
 struct cell_content {
+    // a string value is a reference owned by the holder of the cell_content
     struct address address;
-    int state; // XXX: for testing purposes
+    struct value value;
 };
 struct cell_display {
-    char ch[CELL_WIDTH + 1];
+    char ch[CELL_MAX_WIDTH + 1]; // as wide as the column
     uintattr_t fg;
 };
 struct cursor_pos {
     sheet_id sheet_id;
-    int row, col;
-    int anchor_row, anchor_col;
+    int64_t row;
+    int col;
+    int64_t anchor_row;
+    int anchor_col;
 };
 struct view {
     sheet_id sheet_id;
     // the xforce first columns and xlen columns starting at xmin are included
     // the same goes for y* and rows
-    int xforce, xlen, xmin, yforce, ylen, ymin;
+    int xforce, xlen, xmin, yforce, ylen;
+    int64_t ymin;
+    const struct hidden *hidden; // lines hidden when computed, see hidden.h
     // related buffers should be used with a row-major order
 };
 struct view_request {
@@ -43,23 +105,60 @@ struct view_request {
     int *hits, nb_hits;
 };
 
+struct appended_rows {
+    // rows [first, end) of the followed file were appended, or modified
+    int64_t first, end;
+};
+struct export {
+    // snapshot to write as csv, the whole sheet of area if area.row_span is
+    // null
+    struct snapshot *snapshot;
+    struct area area;
+    char *path, delimiter; // path is owned, NULL for stdout
+    int is_failed;
+};
+struct export_request {
+    char *path; // owned by the request
+    sheet_id sheet_id;
+};
+struct import_request {
+    char *path; // owned by the request
+    struct address origin;
+};
+
 // TODO
 struct validation {
     int id; // XXX: for testing purpose
 };
+struct save {
+    // snapshot to write, along with the areas modified since the last save
+    struct snapshot *snapshot;
+    struct area *changes;
+    int nb_changes, is_failed;
+};
+
 struct write_request {
     int id; // XXX: for testing purpose
 };
 
 int address_equal(struct address a, struct address b);
 int address_in_area(struct address address, struct area area);
+int area_equal(struct area a, struct area b);
+int area_intersect(struct area a, struct area b);
+struct area area_of_address(struct address address);
 int address_in_view(struct address address, struct view view);
+uint64_t address_key(struct address address);
 struct address address_of_cursor(struct cursor_pos cursor);
 int col_name(int x, char buf[]);
 struct address get_view_address(struct view view, int index);
+int get_view_col(struct view view, int j);
+int get_view_col_index(struct view view, int x);
 int get_view_index(struct view view, struct address address);
 int get_view_length(struct view view);
-int row_name(int y, char buf[]);
+int64_t get_view_row(struct view view, int i);
+int get_view_row_index(struct view view, int64_t y);
+int row_name(int64_t y, char buf[]);
+int value_equal(struct value a, struct value b);
 int view_equal(struct view a, struct view b);
 
 #endif // TYPES_H
@@ -0,0 +1,150 @@
+// file watcher: a file is watched from another thread, for modifications by
+// other programs (renaming a new file over it included), reported once the
+// file stayed the same for a poll period, so that it is complete
+// the directory is watched with inotify if available, since a renamed file
+// is a new one, and the file is polled otherwise
+
+#include <poll.h>
+#include <pthread.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <sys/inotify.h>
+#endif // __linux__
+
+#include "config.h"
+#include "watcher.h"
+
+struct watcher {
+    int is_open, is_closing, watch_fd; // watch_fd is -1 without inotify
+    char *path;
+    struct stat last; // last state seen, zeroed while missing
+    void (*on_change)(const struct stat *st);
+    pthread_t thread;
+};
+
+static int is_same_file(const struct stat *a, const struct stat *b);
+static void *watch_routine(void *arg);
+
+static pthread_mutex_t watcher_mutex = PTHREAD_MUTEX_INITIALIZER;
+static struct watcher watcher;
+
+void
+watcher_close(void)
+{
+    if (!watcher.is_open) {
+        return;
+    }
+    pthread_mutex_lock(&watcher_mutex);
+    watcher.is_closing = 1;
+    pthread_mutex_unlock(&watcher_mutex);
+    pthread_join(watcher.thread, NULL);
+    if (watcher.watch_fd >= 0) {
+        close(watcher.watch_fd);
+    }
+    free(watcher.path);
+    watcher = (struct watcher) {0};
+}
+
+int
+watcher_open(const char *path, void (*on_change)(const struct stat *st))
+{
+    // watch path, on_change being called from another thread with its new
+    // state, return a non-null result on failure
+    char *dir, *slash;
+
+    watcher_close();
+    watcher.path = malloc(strlen(path) + 1);
+    strcpy(watcher.path, path);
+    if (stat(path, &watcher.last)) {
+        watcher.last = (struct stat) {0};
+    }
+    watcher.watch_fd = -1;
+#ifdef __linux__
+    dir = malloc(strlen(path) + sizeof("."));
+    strcpy(dir, path);
+    if ((slash = strrchr(dir, '/'))) {
+        slash[slash == dir] = '\0';
+    } else {
+        strcpy(dir, ".");
+    }
+    if ((watcher.watch_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC)) >= 0 &&
+        inotify_add_watch(watcher.watch_fd, dir, IN_CLOSE_WRITE | IN_CREATE |
+        IN_DELETE | IN_MODIFY | IN_MOVED_TO) < 0) {
+        close(watcher.watch_fd);
+        watcher.watch_fd = -1;
+    }
+    free(dir);
+#else
+    (void) dir;
+    (void) slash;
+#endif // __linux__
+    watcher.on_change = on_change;
+    if (pthread_create(&watcher.thread, NULL, watch_routine, NULL)) {
+        if (watcher.watch_fd >= 0) {
+            close(watcher.watch_fd);
+        }
+        free(watcher.path);
+        watcher = (struct watcher) {0};
+        return -1;
+    }
+    watcher.is_open = 1;
+    return 0;
+}
+
+static int
+is_same_file(const struct stat *a, const struct stat *b)
+{
+    return a->st_dev == b->st_dev && a->st_ino == b->st_ino &&
+        a->st_size == b->st_size &&
+        a->st_mtim.tv_sec == b->st_mtim.tv_sec &&
+        a->st_mtim.tv_nsec == b->st_mtim.tv_nsec;
+}
+
+static void *
+watch_routine(void *arg)
+{
+    // events of the other files of the directory only cost a stat
+    char buf[1 << 12];
+    int is_changed, is_closing;
+    struct pollfd pollfd;
+    struct stat st;
+    struct timespec changed = {0}, now;
+
+    (void) arg;
+    is_changed = 0;
+    while (1) {
+        pthread_mutex_lock(&watcher_mutex);
+        is_closing = watcher.is_closing;
+        pthread_mutex_unlock(&watcher_mutex);
+        if (is_closing) {
+            return NULL;
+        }
+
+        // without inotify, the file is polled
+        pollfd = (struct pollfd) {.fd = watcher.watch_fd, .events = POLLIN};
+        if (poll(&pollfd, watcher.watch_fd >= 0, WATCHER_PERIOD) > 0) {
+            while (read(watcher.watch_fd, buf, sizeof(buf)) > 0) {
+                continue;
+            }
+        }
+
+        // a missing file is being replaced, not a changed one
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        if (stat(watcher.path, &st)) {
+            continue;
+        } else if (!is_same_file(&st, &watcher.last)) {
+            watcher.last = st;
+            changed = now;
+            is_changed = 1;
+        } else if (is_changed && (now.tv_sec - changed.tv_sec)*1000 +
+            (now.tv_nsec - changed.tv_nsec)/1000000 >= WATCHER_PERIOD) {
+            is_changed = 0;
+            watcher.on_change(&st);
+        }
+    }
+}
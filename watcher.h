@@ -0,0 +1,9 @@
+#ifndef WATCHER_H
+#define WATCHER_H
+
+#include <sys/stat.h>
+
+void watcher_close(void);
+int watcher_open(const char *path, void (*on_change)(const struct stat *st));
+
+#endif // WATCHER_H
@@ -0,0 +1,217 @@
+// column widths of the sheets, CELL_WIDTH unless set otherwise
+// sheets with set widths or hidden columns have a Fenwick tree over the
+// NB_COLUMNS widths, hidden columns counting as 0 wide, so that positions
+// (sums of the widths of the previous columns) and the column at a position
+// are found in O(log NB_COLUMNS)
+// functions are called by the controller and the cache manager
+
+#include <pthread.h>
+#include <stdlib.h>
+
+#include "types.h"
+#include "widths.h"
+
+struct sheet_widths {
+    sheet_id sheet_id;
+    int *tree; // 1-based, tree[i] sums the widths of columns (i - lsb(i), i]
+    signed char *widths; // negative for hidden columns
+};
+
+static void add_width(int *tree, int x, int delta);
+static void build_tree(struct sheet_widths *sheet);
+static struct sheet_widths *find_sheet(sheet_id sheet_id, int create);
+static int prefix_sum(const int *tree, int x);
+
+static int nb_sheets;
+static pthread_mutex_t widths_mutex = PTHREAD_MUTEX_INITIALIZER;
+static struct sheet_widths *sheets;
+
+int
+col_at(sheet_id sheet_id, int position)
+{
+    // return the column spanning position, or NB_COLUMNS past the last one
+    int step, x;
+    const struct sheet_widths *sheet;
+
+    if (position < 0) {
+        return 0;
+    }
+    pthread_mutex_lock(&widths_mutex);
+    if (!(sheet = find_sheet(sheet_id, 0))) {
+        pthread_mutex_unlock(&widths_mutex);
+        return MIN(position/CELL_WIDTH, NB_COLUMNS);
+    }
+
+    // descend the tree, x being the number of columns ending before position
+    for (step = 1; step*2 <= NB_COLUMNS; step *= 2) {
+        continue;
+    }
+    for (x = 0; step; step /= 2) {
+        if (x + step <= NB_COLUMNS && sheet->tree[x + step] <= position) {
+            x += step;
+            position -= sheet->tree[x];
+        }
+    }
+    pthread_mutex_unlock(&widths_mutex);
+    return x;
+}
+
+int
+col_position(sheet_id sheet_id, int x)
+{
+    // return the sum of the widths of the shown columns before x
+    int res;
+    const struct sheet_widths *sheet;
+
+    x = MAX(0, MIN(x, NB_COLUMNS));
+    pthread_mutex_lock(&widths_mutex);
+    res = (sheet = find_sheet(sheet_id, 0)) ?
+        prefix_sum(sheet->tree, x) : x*CELL_WIDTH;
+    pthread_mutex_unlock(&widths_mutex);
+    return res;
+}
+
+int
+col_width(sheet_id sheet_id, int x)
+{
+    // of the column x, even if hidden
+    int res;
+    const struct sheet_widths *sheet;
+
+    if (x < 0 || x >= NB_COLUMNS) {
+        return CELL_WIDTH;
+    }
+    pthread_mutex_lock(&widths_mutex);
+    res = (sheet = find_sheet(sheet_id, 0)) ?
+        abs(sheet->widths[x]) : CELL_WIDTH;
+    pthread_mutex_unlock(&widths_mutex);
+    return res;
+}
+
+void
+free_col_widths(void)
+{
+    pthread_mutex_lock(&widths_mutex);
+    for (int i = 0; i < nb_sheets; i++) {
+        free(sheets[i].tree);
+        free(sheets[i].widths);
+    }
+    free(sheets);
+    sheets = NULL;
+    nb_sheets = 0;
+    pthread_mutex_unlock(&widths_mutex);
+}
+
+void
+set_col_width(sheet_id sheet_id, int x, int width)
+{
+    // width is clamped to [1, CELL_MAX_WIDTH]
+    struct sheet_widths *sheet;
+
+    if (x < 0 || x >= NB_COLUMNS) {
+        return;
+    }
+    width = MAX(1, MIN(width, CELL_MAX_WIDTH));
+    pthread_mutex_lock(&widths_mutex);
+    if ((sheet = find_sheet(sheet_id, width != CELL_WIDTH))) {
+        if (sheet->widths[x] > 0) {
+            add_width(sheet->tree, x, width - sheet->widths[x]);
+            sheet->widths[x] = width;
+        } else {
+            sheet->widths[x] = -width;
+        }
+    }
+    pthread_mutex_unlock(&widths_mutex);
+}
+
+void
+set_cols_hidden(sheet_id sheet_id, int first, int end, int hidden)
+{
+    // hidden columns count as 0 wide in positions, see hidden.h
+    // past NB_COLUMNS/COL_BITS columns, rebuilding the tree in
+    // O(NB_COLUMNS) beats updating it in O(COL_BITS) per column
+    int is_bulk;
+    struct sheet_widths *sheet;
+
+    first = MAX(0, first);
+    end = MIN(end, NB_COLUMNS);
+    is_bulk = (end - first)*COL_BITS > NB_COLUMNS;
+    pthread_mutex_lock(&widths_mutex);
+    if ((sheet = find_sheet(sheet_id, hidden))) {
+        for (int x = first; x < end; x++) {
+            if ((sheet->widths[x] > 0) == hidden) {
+                if (!is_bulk) {
+                    add_width(sheet->tree, x, -sheet->widths[x]);
+                }
+                sheet->widths[x] = -sheet->widths[x];
+            }
+        }
+        if (is_bulk) {
+            build_tree(sheet);
+        }
+    }
+    pthread_mutex_unlock(&widths_mutex);
+}
+
+static void
+add_width(int *tree, int x, int delta)
+{
+    for (int i = x + 1; i <= NB_COLUMNS; i += i & -i) {
+        tree[i] += delta;
+    }
+}
+
+static void
+build_tree(struct sheet_widths *sheet)
+{
+    // from the widths, each node adding itself to its parent
+    int parent;
+
+    for (int i = 1; i <= NB_COLUMNS; i++) {
+        sheet->tree[i] = MAX(0, sheet->widths[i - 1]);
+    }
+    for (int i = 1; i <= NB_COLUMNS; i++) {
+        if ((parent = i + (i & -i)) <= NB_COLUMNS) {
+            sheet->tree[parent] += sheet->tree[i];
+        }
+    }
+}
+
+static struct sheet_widths *
+find_sheet(sheet_id sheet_id, int create)
+{
+    // return the widths of sheet_id, NULL if never set and !create
+    // every column of a new sheet is shown and CELL_WIDTH wide
+    struct sheet_widths *sheet;
+
+    for (int i = 0; i < nb_sheets; i++) {
+        if (sheets[i].sheet_id == sheet_id) {
+            return &sheets[i];
+        }
+    }
+    if (!create) {
+        return NULL;
+    }
+    sheets = realloc(sheets, (nb_sheets + 1)*sizeof(*sheets));
+    sheet = &sheets[nb_sheets++];
+    sheet->sheet_id = sheet_id;
+    sheet->tree = malloc((NB_COLUMNS + 1)*sizeof(*sheet->tree));
+    sheet->widths = malloc(NB_COLUMNS);
+    for (int i = 1; i <= NB_COLUMNS; i++) {
+        sheet->tree[i] = (i & -i)*CELL_WIDTH;
+        sheet->widths[i - 1] = CELL_WIDTH;
+    }
+    return sheet;
+}
+
+static int
+prefix_sum(const int *tree, int x)
+{
+    // of the widths of the x first columns
+    int res;
+
+    for (res = 0; x > 0; x -= x & -x) {
+        res += tree[x];
+    }
+    return res;
+}
@@ -0,0 +1,13 @@
+#ifndef WIDTHS_H
+#define WIDTHS_H
+
+#include "types.h"
+
+int col_at(sheet_id sheet_id, int position);
+int col_position(sheet_id sheet_id, int x);
+int col_width(sheet_id sheet_id, int x);
+void free_col_widths(void);
+void set_col_width(sheet_id sheet_id, int x, int width);
+void set_cols_hidden(sheet_id sheet_id, int first, int end, int hidden);
+
+#endif // WIDTHS_H
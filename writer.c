@@ -0,0 +1,424 @@
+// background writer: snapshots of the storage are written to the grid file
+// while the state manager keeps applying modifications
+// a new file is written next to the old one, then renamed over it; if the old
+// file is still the one described by file_layout, only the lines defining
+// modified areas are written again, the other ones being copied as is
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <fcntl.h>
+#include <semaphore.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "client.h"
+#include "config.h"
+#include "csv.h"
+#include "file_format.h"
+#include "pthread_queue.h"
+#include "storage.h"
+#include "thread_management.h"
+#include "types.h"
+#include "writer.h"
+
+struct run {
+    // vertical run of cells of identical content, written as one definition
+    struct definition definition;
+    sheet_id current_sheet;
+    FILE *fp;
+    off_t offset; // of the end of the new file
+    struct file_layout *layout; // of the new file
+    const struct area *excluded; // cells not to write
+    int nb_excluded;
+};
+
+struct sorted_changes {
+    // modified areas by sheet and first row, with the largest end row of the
+    // ones up to each on its sheet: (sheet_id, max_ends) increase too
+    struct area *areas;
+    int64_t *max_ends;
+    int nb;
+};
+
+static int compare_areas(const void *a, const void *b);
+static int copy_lines(struct run *run, int old_fd, int first, int last,
+    off_t start, off_t end);
+static int copy_range(int in, int out, off_t offset, size_t length);
+static int find_change(const struct sorted_changes *sorted, sheet_id sheet_id,
+    int64_t row, int is_by_end);
+static void flush_run(struct run *run);
+static int intersects(struct area area, const struct sorted_changes *sorted);
+static void sort_changes(const struct save *save,
+    struct sorted_changes *sorted);
+static int write_cell(struct address address, struct value value,
+    const struct formula *formula, void *arg);
+static int write_changes(const struct save *save, struct run *run,
+    int old_fd);
+
+int
+write_save(const struct save *save, const char *path)
+{
+    // return a non-null result on failure
+    char *new_path;
+    int old_fd, res;
+    struct file_layout layout = {0};
+    struct run run = {.layout = &layout};
+    struct stat st;
+
+    new_path = malloc(strlen(path) + sizeof(".new"));
+    sprintf(new_path, "%s.new", path);
+    if (!(run.fp = fopen(new_path, "w"))) {
+        free(new_path);
+        return -1;
+    }
+
+    // the old file may have been modified by another program
+    old_fd = -1;
+    if (!stat(path, &st)) {
+        fchmod(fileno(run.fp), st.st_mode & 07777);
+        if (save->nb_changes <= SAVE_MAX_CHANGES &&
+            st.st_size == file_layout.size &&
+            st.st_mtim.tv_sec == file_layout.mtime.tv_sec &&
+            st.st_mtim.tv_nsec == file_layout.mtime.tv_nsec) {
+            old_fd = open(path, O_RDONLY);
+        }
+    }
+    if (old_fd >= 0) {
+        res = write_changes(save, &run, old_fd);
+        close(old_fd);
+    } else {
+        snapshot_visit_cells(save->snapshot, write_cell, &run);
+        flush_run(&run);
+        res = 0;
+    }
+    layout.last_sheet = run.current_sheet;
+    res = fflush(run.fp) || ferror(run.fp) || fsync(fileno(run.fp)) || res;
+    res = fclose(run.fp) || res;
+    if (!res) {
+        res = rename(new_path, path) || stat(path, &st);
+    }
+
+    if (res) {
+        unlink(new_path);
+        free(layout.lines);
+    } else {
+        layout.size = st.st_size;
+        layout.mtime = st.st_mtim;
+        free(file_layout.lines);
+        file_layout = layout;
+    }
+    free(new_path);
+    return res;
+}
+
+static int
+compare_areas(const void *a, const void *b)
+{
+    const struct area *x = a, *y = b;
+
+    if (x->sheet_id != y->sheet_id) {
+        return x->sheet_id < y->sheet_id ? -1 : 1;
+    }
+    return (x->row > y->row) - (x->row < y->row);
+}
+
+static int
+copy_lines(struct run *run, int old_fd, int first, int last, off_t start,
+    off_t end)
+{
+    // copy the bytes [start, end) of the old file, holding the definition
+    // lines first to last (excluded)
+    struct file_line line;
+
+    if (fflush(run->fp) || copy_range(old_fd, fileno(run->fp), start,
+        end - start)) {
+        return -1;
+    }
+    for (int i = first; i < last; i++) {
+        line = file_layout.lines[i];
+        line.offset += run->offset - start;
+        file_layout_append(run->layout, line);
+    }
+    run->offset += end - start;
+    return 0;
+}
+
+static int
+copy_range(int in, int out, off_t offset, size_t length)
+{
+    // copy within the kernel if possible, and through a buffer otherwise
+    char buf[1 << 16];
+    ssize_t n;
+
+#ifdef __linux__
+    loff_t in_offset;
+
+    in_offset = offset;
+    while (length && (n = copy_file_range(in, &in_offset, out, NULL, length,
+        0)) > 0) {
+        length -= n;
+    }
+    offset = in_offset;
+#endif // __linux__
+    while (length) {
+        if ((n = pread(in, buf, MIN(length, sizeof(buf)), offset)) <= 0 ||
+            write(out, buf, n) != n) {
+            return -1;
+        }
+        offset += n;
+        length -= n;
+    }
+    return 0;
+}
+
+static int
+find_change(const struct sorted_changes *sorted, sheet_id sheet_id,
+    int64_t row, int is_by_end)
+{
+    // return the index of the first change from (sheet_id, row) on, by first
+    // row or by largest end row so far
+    int high, low, mid;
+    int64_t key;
+
+    low = 0;
+    high = sorted->nb;
+    while (low < high) {
+        mid = low + (high - low)/2;
+        key = is_by_end ? sorted->max_ends[mid] : sorted->areas[mid].row;
+        if (sorted->areas[mid].sheet_id < sheet_id ||
+            (sorted->areas[mid].sheet_id == sheet_id && key < row)) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+    return low;
+}
+
+static void
+flush_run(struct run *run)
+{
+    int length;
+    struct area *area;
+
+    area = &run->definition.area;
+    if (!area->row_span) {
+        return;
+    }
+    if (area->sheet_id != run->current_sheet) {
+        run->offset += write_sheet(run->fp, area->sheet_id);
+        run->current_sheet = area->sheet_id;
+    }
+    length = write_definition(run->fp, &run->definition);
+    file_layout_append(run->layout, (struct file_line) {
+        .offset = run->offset,
+        .length = length,
+        .area = *area,
+        .hash = definition_hash(&run->definition),
+    });
+    run->offset += length;
+    area->row_span = 0;
+}
+
+static int
+intersects(struct area area, const struct sorted_changes *sorted)
+{
+    // only the changes starting before the end of area and following one
+    // ending after its first row may intersect it
+    int first, last;
+
+    first = find_change(sorted, area.sheet_id, area.row + 1, 1);
+    last = find_change(sorted, area.sheet_id, area.row + area.row_span, 0);
+    for (int i = first; i < last; i++) {
+        if (area_intersect(area, sorted->areas[i])) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static void
+sort_changes(const struct save *save, struct sorted_changes *sorted)
+{
+    sorted->nb = save->nb_changes;
+    sorted->areas = malloc(MAX(sorted->nb, 1)*sizeof(*sorted->areas));
+    sorted->max_ends = malloc(MAX(sorted->nb, 1)*sizeof(*sorted->max_ends));
+    memcpy(sorted->areas, save->changes, sorted->nb*sizeof(*sorted->areas));
+    qsort(sorted->areas, sorted->nb, sizeof(*sorted->areas), compare_areas);
+    for (int i = 0; i < sorted->nb; i++) {
+        sorted->max_ends[i] = sorted->areas[i].row + sorted->areas[i].row_span;
+        if (i && sorted->areas[i - 1].sheet_id == sorted->areas[i].sheet_id) {
+            sorted->max_ends[i] = MAX(sorted->max_ends[i],
+                sorted->max_ends[i - 1]);
+        }
+    }
+}
+
+static int
+write_cell(struct address address, struct value value,
+    const struct formula *formula, void *arg)
+{
+    int is_same_content;
+    struct area *area;
+    struct run *run;
+
+    run = arg;
+    area = &run->definition.area;
+    if (!formula && value.type == VALUE_ERROR) {
+        return 0; // can not be defined as a literal
+    }
+    for (int i = 0; i < run->nb_excluded; i++) {
+        if (address_in_area(address, run->excluded[i])) {
+            return 0;
+        }
+    }
+
+    // extend the current run if possible
+    is_same_content = formula ? formula_equal(formula,
+        &run->definition.formula) : run->definition.formula.function ==
+        FUNCTION_NONE && value_equal(value, run->definition.value);
+    if (area->row_span && is_same_content &&
+        address.sheet_id == area->sheet_id && address.col == area->col &&
+        address.row == area->row + area->row_span) {
+        area->row_span++;
+        return 0;
+    }
+
+    flush_run(run);
+    run->definition = (struct definition) {
+        .area = {
+            .sheet_id = address.sheet_id,
+            .row = address.row,
+            .col = address.col,
+            .row_span = 1,
+            .col_span = 1,
+        },
+        .value = value,
+    };
+    if (formula) {
+        run->definition.formula = *formula;
+    }
+    return 0;
+}
+
+static int
+write_changes(const struct save *save, struct run *run, int old_fd)
+{
+    // write the old file with its lines defining modified cells written
+    // again in place (as later lines may override them), then the modified
+    // cells not defined before, return a non-null result on failure
+    char last_char;
+    int first, length, nb_dropped, dropped_capacity;
+    off_t start;
+    const struct file_line *line;
+    struct area *excluded;
+    struct sorted_changes sorted;
+
+    sort_changes(save, &sorted);
+    excluded = NULL;
+    nb_dropped = dropped_capacity = 0;
+    first = 0;
+    start = 0;
+    for (int i = 0; i < file_layout.nb_lines; i++) {
+        line = &file_layout.lines[i];
+        if (!intersects(line->area, &sorted)) {
+            continue;
+        }
+        if (copy_lines(run, old_fd, first, i, start, line->offset)) {
+            free(excluded);
+            free(sorted.areas);
+            free(sorted.max_ends);
+            return -1;
+        }
+        run->current_sheet = line->area.sheet_id;
+        if (line->is_clear) {
+            // still needed for the cells defined by previous lines
+            length = write_definition(run->fp, &(struct definition) {
+                .area = line->area,
+            });
+            file_layout_append(run->layout, (struct file_line) {
+                .offset = run->offset,
+                .length = length,
+                .area = line->area,
+                .is_clear = 1,
+                .hash = line->hash,
+            });
+            run->offset += length;
+        }
+        snapshot_visit_area(save->snapshot, line->area, write_cell, run);
+        flush_run(run);
+        first = i + 1;
+        start = line->offset + line->length;
+
+        // cells of the dropped lines are written already
+        if (nb_dropped == dropped_capacity) {
+            dropped_capacity = dropped_capacity ? 2*dropped_capacity : 16;
+            excluded = realloc(excluded, dropped_capacity*sizeof(*excluded));
+        }
+        excluded[nb_dropped++] = line->area;
+    }
+    free(sorted.areas);
+    free(sorted.max_ends);
+    if (copy_lines(run, old_fd, first, file_layout.nb_lines, start,
+        file_layout.size)) {
+        free(excluded);
+        return -1;
+    }
+    if (file_layout.size && (pread(old_fd, &last_char, 1,
+        file_layout.size - 1) != 1 || last_char != '\n')) {
+        fputc('\n', run->fp);
+        run->offset++;
+    }
+
+    // cells of the previous changes are written already too
+    excluded = realloc(excluded,
+        (nb_dropped + save->nb_changes)*sizeof(*excluded));
+    memcpy(excluded + nb_dropped, save->changes,
+        save->nb_changes*sizeof(*excluded));
+    run->excluded = excluded;
+    run->current_sheet = file_layout.last_sheet;
+    for (int i = 0; i < save->nb_changes; i++) {
+        run->nb_excluded = nb_dropped + i;
+        snapshot_visit_area(save->snapshot, save->changes[i], write_cell,
+            run);
+    }
+    flush_run(run);
+    free(excluded);
+    return 0;
+}
+
+void *
+writer_routine(void *sem)
+{
+    struct export *export;
+    struct save *save;
+
+    while (1) {
+        sem_wait(sem);
+        // pending saves and exports are written even if termination is
+        // requested
+        if (!pthread_queue_pop(&saves, &save)) {
+            save->is_failed = !file_path || write_save(save, file_path);
+            pthread_queue_push(&finished_saves, save);
+        } else if (!pthread_queue_pop(&exports, &export)) {
+            if (!export->area.row_span) {
+                export->area = snapshot_sheet_area(export->snapshot,
+                    export->area.sheet_id);
+            }
+            export->is_failed = csv_export(export->snapshot, export->area,
+                export->delimiter, export->path);
+            pthread_queue_push(&finished_exports, export);
+        } else if (should_terminate()) {
+            goto cleanup;
+        }
+    }
+
+cleanup:
+    return NULL;
+}
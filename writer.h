@@ -0,0 +1,8 @@
+#ifndef WRITER_H
+#define WRITER_H
+
+#include "types.h"
+
+int write_save(const struct save *save, const char *path);
+
+#endif // WRITER_H